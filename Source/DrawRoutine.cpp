@@ -14,8 +14,25 @@
 #include <Dx11/Rendering/ShaderManager.h>
 #include <Dx11/Rendering/FrustumCuller.h>
 
+#include <chrono>
+
 using namespace DirectX;
 
+// the depth of the LOD octree under which the subtrees are culled in parallel
+static const unsigned PARALLEL_CULL_SPLIT_DEPTH = 3;
+// number of frames in the default camera path of the culling benchmark
+static const unsigned BENCHMARK_FRAMES = 512;
+// the extra views of the multi-view benchmark are the camera that many frames later
+static const unsigned BENCHMARK_VIEW_FRAME_STEP = 4;
+// the screen-space error LOD settings - the error of a block is about a cell of it's LOD level
+static const float LOD_PIXEL_BUDGET = 16.f;
+static const float LOD_ERROR_FACTOR = 1.f / 16;
+static const float LOD_HYSTERESIS = 0.05f;
+// the blocks that cover fewer pixels than that are dropped by the contribution culling
+static const float CONTRIBUTION_PIXEL_AREA = 2.f;
+// the time the budgeted Cull has each frame to refine the LOD
+static const unsigned CULL_BUDGET_MICROSECONDS = 1000;
+
 DrawRoutine::DrawRoutine()
 	: m_DrawSolid(true)
 	, m_DrawSurface(true)
@@ -24,18 +41,28 @@ DrawRoutine::DrawRoutine()
 	, m_CurrentLodToDraw(0)
 	, m_UseLodOctree(true)
 	, m_LodUpdate(true)
+	, m_CoherentCull(true)
+	, m_ParallelCull(false)
+	, m_BudgetedCull(false)
+	, m_ScreenSpaceLod(true)
+	, m_OcclusionCull(false)
+	, m_BackFaceCull(true)
+	, m_ContributionCull(true)
+	, m_HorizonCull(true)
+	, m_RecordPath(false)
 {}
 
 DrawRoutine::~DrawRoutine()
 {}
 
-bool DrawRoutine::Initialize(Renderer* renderer, Camera* camera, const XMFLOAT4X4& projection, Scene* scene)
+bool DrawRoutine::Initialize(Renderer* renderer, Camera* camera, const XMFLOAT4X4& projection, unsigned viewportHeight, Scene* scene)
 {
 	DxRenderingRoutine::Initialize(renderer);
 
 	m_Camera = camera;
-	m_Projection = projection;
 	m_Scene = scene;
+	SetProjection(projection, viewportHeight);
+	m_OcclusionCuller.reset(new Voxels::OcclusionCuller());
 
 	ShaderManager shaderManager(m_Renderer->GetDevice());
 	ShaderManager::CompilationOutput compilationResult;
@@ -263,6 +290,7 @@ bool DrawRoutine::ReloadGrid()
 
 	SLOG(Sev_Debug, Fac_Rendering, "Successfully uploaded grid polygons to GPU");
 
+	m_OcclusionCuller->SetSurface(*surface);
 	UpdateCulledObjects();
 
 	// Update the texture properties
@@ -335,19 +363,38 @@ bool DrawRoutine::UpdateGrid() {
 
 	// Update the culled objects here - otherwise if culling updates are disabled we might
 	// remain with invalid block IDs in the block to draw collection
+	m_OcclusionCuller->SetSurface(*surface);
 	UpdateCulledObjects();
 
 	return true;
 }
 
-void DrawRoutine::UpdateCulledObjects() {
+void DrawRoutine::SetOcclusionCullEnabled(bool enabled) {
+	// nothing is occluded until the next update - it might not come if the LOD is frozen
+	m_OcclusionCull = enabled;
+	m_UnoccludedBlocks = m_BlockToDraw;
+}
+
+void DrawRoutine::SetRecordCameraPath(bool record) {
+	if(record && !m_RecordPath) {
+		m_RecordedPath.clear();
+	}
+	m_RecordPath = record;
+
+	if(record) {
+		SLOG(Sev_Info, Fac_Rendering, "Recording a camera path for the culling benchmark");
+	} else {
+		SLLOG(Sev_Info, Fac_Rendering, "Recorded camera path frames: ", m_RecordedPath.size());
+	}
+}
+
+void DrawRoutine::CalculateGridView(XMFLOAT4 frustumPlanes[6], XMFLOAT3& camPos) const {
 	// The drawn surface might have some transformation (in the world matrix).
 	// The Cull & LOD class expects works with the un-transformed grid so we have
 	// to transform our Camera and Frustum planes in the objects space of the 
 	// gid.
 
-	auto camPos = m_Camera->GetPos();
-	XMFLOAT4 frustumPlanes[6];
+	camPos = m_Camera->GetPos();
 	FrustumCuller::CalculateFrustumPlanes(m_Camera->GetViewMatrix(), m_Projection, frustumPlanes);
 	
 	const auto worldMat = XMLoadFloat4x4(&m_Scene->GetGridWorldMatrix());
@@ -368,8 +415,415 @@ void DrawRoutine::UpdateCulledObjects() {
 	XMVECTOR camVec = XMLoadFloat3(&camPos);
 	camVec = XMVector3Transform(camVec, invWorld);
 	XMStoreFloat3(&camPos, camVec);
-	
-	m_BlockToDraw = m_Scene->GetLodOctree().Cull(frustumPlanes, camPos);
+}
+
+void DrawRoutine::SetProjection(const XMFLOAT4X4& projection, unsigned viewportHeight) {
+	if(m_ScreenSpaceLodPolicy && m_ViewportHeight == float(viewportHeight) && !memcmp(&m_Projection, &projection, sizeof(XMFLOAT4X4)))
+		return;
+
+	m_Projection = projection;
+	m_ViewportHeight = float(viewportHeight);
+	m_ScreenSpaceLodPolicy.reset(new Voxels::ScreenSpaceErrorLodPolicy(m_Projection._22
+		, m_ViewportHeight
+		, LOD_PIXEL_BUDGET
+		, LOD_ERROR_FACTOR
+		, LOD_HYSTERESIS));
+	m_Scene->GetLodOctree().SetLodPolicy(m_ScreenSpaceLod ? m_ScreenSpaceLodPolicy.get() : nullptr);
+	// the new policy might get the address of the old one - the states wouldn't notice the change
+	m_CoherentCullState.Reset();
+	m_BudgetedCullState.Reset();
+}
+
+void DrawRoutine::CalculateGridViewProjection(XMFLOAT4X4& viewProjection) const {
+	const auto worldMat = XMLoadFloat4x4(&m_Scene->GetGridWorldMatrix());
+	const auto viewMat = XMLoadFloat4x4(&m_Camera->GetViewMatrix());
+	const auto projMat = XMLoadFloat4x4(&m_Projection);
+	XMStoreFloat4x4(&viewProjection, worldMat * viewMat * projMat);
+}
+
+void DrawRoutine::UpdateCulledObjects() {
+	XMFLOAT3 camPos;
+	XMFLOAT4 frustumPlanes[6];
+	CalculateGridView(frustumPlanes, camPos);
+
+	auto& octree = m_Scene->GetLodOctree();
+	octree.SetLodPolicy(m_ScreenSpaceLod ? m_ScreenSpaceLodPolicy.get() : nullptr);
+	octree.SetBackFaceCulling(m_BackFaceCull);
+	octree.SetContributionCulling(m_Projection._22, m_ViewportHeight, m_ContributionCull ? CONTRIBUTION_PIXEL_AREA : 0);
+	octree.SetHorizonCulling(m_HorizonCull && m_Scene->IsHeightmapTerrain());
+	if(m_CoherentCull && !m_BudgetedCull) {
+		octree.Cull(frustumPlanes, camPos, m_CoherentCullState, m_BlockToDraw);
+	} else {
+		// the blocks to draw change behind the back of the coherent cull
+		m_CoherentCullState.Reset();
+		if(m_BudgetedCull) {
+			if(!octree.CullBudgeted(frustumPlanes, camPos, CULL_BUDGET_MICROSECONDS, m_BudgetedCullState, m_BlockToDraw)) {
+				SLLOG(Sev_Trace, Fac_Rendering, "Budgeted culling: the LOD front isn't complete after ", CULL_BUDGET_MICROSECONDS, " us");
+			}
+		} else if(m_ParallelCull) {
+			octree.CullParallel(frustumPlanes, camPos, PARALLEL_CULL_SPLIT_DEPTH, m_ParallelCullScratch, m_BlockToDraw);
+		} else {
+			octree.Cull(frustumPlanes, camPos, m_CullScratch, m_BlockToDraw);
+		}
+	}
+
+	const auto& cullStats = octree.GetLastCullStatistics();
+	if(cullStats.OutputReused) {
+		SLLOG(Sev_Trace, Fac_Rendering, "Culling: the last ", m_BlockToDraw.size(), " blocks are still valid - checked in ", cullStats.SelectionTime, " us");
+	} else {
+		SLLOG(Sev_Trace, Fac_Rendering, "Culling: ", cullStats.NodesVisited, " nodes visited, ", cullStats.FrustumRejectedNodes
+			, " outside of the frustum, ", cullStats.PlaneTests, " plane tests, ", cullStats.GetSelectedBlocksCount(), " blocks selected with "
+			, cullStats.TransitionFaces, " transition faces in ", cullStats.SelectionTime, " + ", cullStats.TransitionTime, " us");
+	}
+
+	if(m_OcclusionCull) {
+		XMFLOAT4X4 viewProjection;
+		CalculateGridViewProjection(viewProjection);
+		m_OcclusionCuller->Cull(viewProjection, camPos, m_BlockToDraw, m_UnoccludedBlocks);
+
+		const auto& stats = m_OcclusionCuller->GetLastStatistics();
+		SLLOG(Sev_Trace, Fac_Rendering, "Occlusion culling: ", stats.OccludedCount, " of ", stats.CandidatesCount
+			, " blocks occluded (", stats.GetOccludedFraction() * 100, "%) by ", stats.OccluderTrianglesCount, " triangles in "
+			, stats.RasterizationTime + stats.TestTime, " us");
+	}
+}
+
+void DrawRoutine::RunCullBenchmark(size_t (*getMemoryUse)()) {
+	const auto surface = m_Scene->GetPolygonSurface();
+	if(!surface)
+		return;
+
+	// Use the recorded camera path if there is one. Otherwise the camera circles above
+	// the grid looking at it's center. Everything is in grid space so no transformation is needed
+	CameraPath orbitPath;
+	if(m_RecordedPath.empty()) {
+		const auto extents = surface->GetExtents();
+		const auto center = XMVectorSet(extents.x / 2, extents.y / 2, extents.z / 2, 1);
+		const auto radius = std::max(extents.x, extents.z) * 0.6f;
+
+		orbitPath.resize(BENCHMARK_FRAMES);
+		for(auto frame = 0u; frame < BENCHMARK_FRAMES; ++frame) {
+			const auto angle = XM_2PI * frame / BENCHMARK_FRAMES;
+			// also go up and down so that the LOD levels change
+			const auto height = extents.y * (0.5f + 0.4f * std::sin(angle * 3));
+			const auto position = XMVectorSet(extents.x / 2 + radius * std::cos(angle), height, extents.z / 2 + radius * std::sin(angle), 1);
+			XMStoreFloat3(&orbitPath[frame].Position, position);
+
+			XMFLOAT4X4 view;
+			XMStoreFloat4x4(&view, XMMatrixLookAtLH(position, center, XMVectorSet(0, 1, 0, 0)));
+			XMStoreFloat4x4(&orbitPath[frame].ViewProjection, XMLoadFloat4x4(&view) * XMLoadFloat4x4(&m_Projection));
+			auto planes = orbitPath[frame].FrustumPlanes;
+			FrustumCuller::CalculateFrustumPlanes(view, m_Projection, planes);
+			for(auto i = 0; i < 6; ++i) {
+				XMStoreFloat4(&planes[i], XMPlaneNormalize(XMLoadFloat4(&planes[i])));
+			}
+		}
+	}
+	const auto& path = m_RecordedPath.empty() ? orbitPath : m_RecordedPath;
+	const auto framesCnt = unsigned(path.size());
+	SLLOG(Sev_Info, Fac_Rendering, "Cull benchmark: ", m_RecordedPath.empty() ? "orbit" : "recorded", " camera path with ", framesCnt, " frames");
+
+	auto& octree = m_Scene->GetLodOctree();
+	Voxels::VoxelLodOctree::CullScratch scratch;
+	Voxels::VoxelLodOctree::ParallelCullScratch parallelScratch;
+	Voxels::VoxelLodOctree::VisibleBlocksVec blocks;
+
+	// Compare the LOD policies - the blocks drawn and how many of them change between frames
+	const Voxels::LodPolicy* policies[] = { nullptr, m_ScreenSpaceLodPolicy.get() };
+	const char* policyNames[] = { "distance", "screen-space error" };
+	Voxels::VoxelLodOctree::VisibleSetTracker tracker;
+	for(auto policy = 0u; policy < 2; ++policy) {
+		octree.SetLodPolicy(policies[policy]);
+		tracker.Reset();
+		auto blocksCnt = 0u;
+		auto changedCnt = 0u;
+		for(auto frame = 0u; frame < framesCnt; ++frame) {
+			octree.Cull(path[frame].FrustumPlanes, path[frame].Position, scratch, blocks, &tracker);
+			blocksCnt += unsigned(blocks.size());
+			if(frame) {
+				changedCnt += unsigned(tracker.GetEntered().size() + tracker.GetLeft().size());
+			}
+		}
+		SLLOG(Sev_Info, Fac_Rendering, "Cull benchmark: ", policyNames[policy], " LOD - ", float(blocksCnt) / framesCnt
+			, " blocks and ", float(changedCnt) / framesCnt, " block changes per frame");
+	}
+	octree.SetLodPolicy(m_ScreenSpaceLod ? m_ScreenSpaceLodPolicy.get() : nullptr);
+
+	// Once the scratch and the output have grown enough along the path their capacity doesn't change in a
+	// second pass. That's what is checked - with the memory of the voxels library if it's tracked - and not
+	// every allocation on the heap
+	const auto getCullMemory = [&]() {
+		return scratch.GetReservedMemory() + blocks.capacity() * sizeof(Voxels::VoxelLodOctree::VisibleBlock);
+	};
+	for(auto frame = 0u; frame < framesCnt; ++frame) {
+		octree.Cull(path[frame].FrustumPlanes, path[frame].Position, scratch, blocks);
+	}
+	auto allocatingFramesCnt = 0u;
+	for(auto frame = 0u; frame < framesCnt; ++frame) {
+		const auto cullMemory = getCullMemory();
+		const auto libraryMemory = getMemoryUse ? getMemoryUse() : 0;
+		octree.Cull(path[frame].FrustumPlanes, path[frame].Position, scratch, blocks);
+		if(getCullMemory() != cullMemory || (getMemoryUse && getMemoryUse() != libraryMemory)) {
+			++allocatingFramesCnt;
+		}
+	}
+	if(allocatingFramesCnt) {
+		SLLOG(Sev_Error, Fac_Rendering, "Cull benchmark: the capacity of the scratch and the output", getMemoryUse ? " or the voxels library memory" : ""
+			, " changed in ", allocatingFramesCnt, " of ", framesCnt, " frames with warmed up scratch memory!");
+	} else {
+		SLLOG(Sev_Info, Fac_Rendering, "Cull benchmark: the capacity of the scratch and the output", getMemoryUse ? " and the voxels library memory" : ""
+			, " didn't change with warmed up scratch memory (", getCullMemory(), " bytes reserved) - other heap allocations aren't checked");
+	}
+
+	// The frustum tests of the children of a node - 8 at once with SIMD against one by one
+	Voxels::VoxelLodOctree::ClassificationTimes classificationTimes;
+	for(auto frame = 0u; frame < framesCnt; ++frame) {
+		octree.MeasureChildClassification(path[frame].FrustumPlanes, classificationTimes);
+	}
+	SLLOG(Sev_Info, Fac_Rendering, "Cull benchmark: child frustum tests - SIMD ", classificationTimes.SimdTime / framesCnt
+		, " us, scalar ", classificationTimes.ScalarTime / framesCnt, " us per frame for ", classificationTimes.ChildrenTested / framesCnt
+		, " children, speed-up x", float(classificationTimes.ScalarTime) / std::max(classificationTimes.SimdTime, 1ll));
+	if(classificationTimes.Mismatches) {
+		SLLOG(Sev_Error, Fac_Rendering, "Cull benchmark: the SIMD and the scalar frustum tests differ for ", classificationTimes.Mismatches, " nodes!");
+	}
+
+	// The transition faces found with the lookups have to match a brute-force comparison of the blocks.
+	// Nothing is dropped so that the neighbours of every block are in the output
+	octree.SetBackFaceCulling(false);
+	octree.SetContributionCulling(m_Projection._22, m_ViewportHeight, 0);
+	octree.SetHorizonCulling(false);
+	auto transitionMismatchesCnt = 0u;
+	for(auto frame = 0u; frame < framesCnt; ++frame) {
+		octree.Cull(path[frame].FrustumPlanes, path[frame].Position, scratch, blocks);
+		transitionMismatchesCnt += octree.ValidateTransitionFaces(blocks);
+	}
+	octree.SetBackFaceCulling(m_BackFaceCull);
+	octree.SetContributionCulling(m_Projection._22, m_ViewportHeight, m_ContributionCull ? CONTRIBUTION_PIXEL_AREA : 0);
+	octree.SetHorizonCulling(m_HorizonCull && m_Scene->IsHeightmapTerrain());
+	if(transitionMismatchesCnt) {
+		SLLOG(Sev_Error, Fac_Rendering, "Cull benchmark: ", transitionMismatchesCnt, " blocks with wrong transition faces!");
+	} else {
+		SLLOG(Sev_Info, Fac_Rendering, "Cull benchmark: the transition faces of all the frames match the brute-force check");
+	}
+
+	// Bias the LOD in a sphere around the center of the grid - once keeping the detail twice as far and once
+	// never splitting the nodes of LOD level 2. The first view of a multi-view Cull with the frame and a later
+	// one has to pick the same blocks as the Cull of the frame. The volumes of the application are put back after that
+	const auto appBiasVolumes = octree.GetLodBiasVolumes();
+	const auto gridExtents = surface->GetExtents();
+	Voxels::VoxelLodOctree::LodBiasVolume biasVolume;
+	biasVolume.VolumeShape = Voxels::VoxelLodOctree::LodBiasVolume::Sphere;
+	biasVolume.MinCorner = biasVolume.MaxCorner = XMFLOAT3(0, 0, 0);
+	biasVolume.Center = XMFLOAT3(gridExtents.x / 2, gridExtents.y / 2, gridExtents.z / 2);
+	biasVolume.Radius = std::min(gridExtents.x, gridExtents.z) / 4;
+	const char* biasNames[] = { "none", "distance x2", "finest level 2" };
+	Voxels::VoxelLodOctree::CullView biasViews[2];
+	Voxels::VoxelLodOctree::VisibleBlocksVec biasViewBlocks[2];
+	Voxels::VoxelLodOctree::MultiViewCullScratch biasScratch;
+	std::vector<unsigned> blockIds;
+	std::vector<unsigned> viewBlockIds;
+	const auto getSortedIds = [](const Voxels::VoxelLodOctree::VisibleBlocksVec& visibleBlocks, std::vector<unsigned>& ids) {
+		ids.clear();
+		std::for_each(visibleBlocks.cbegin(), visibleBlocks.cend(), [&](const Voxels::VoxelLodOctree::VisibleBlock& block) {
+			ids.push_back(block.Id);
+		});
+		std::sort(ids.begin(), ids.end());
+	};
+	for(auto bias = 0u; bias < 3; ++bias) {
+		Voxels::VoxelLodOctree::LodBiasVolumesVec biasVolumes;
+		if(bias) {
+			biasVolume.DistanceScale = bias == 1 ? 2.f : 1.f;
+			biasVolume.FinestLevel = bias == 1 ? 0 : std::min(2u, octree.GetLodLevelsCount() - 1);
+			biasVolumes.push_back(biasVolume);
+		}
+		octree.SetLodBiasVolumes(biasVolumes);
+		auto selectedCnt = 0u;
+		auto mismatchedFramesCnt = 0u;
+		// the first pass only brings the hysteresis of both Culls to the same state
+		for(auto pass = 0u; pass < 2; ++pass) {
+			for(auto frame = 0u; frame < framesCnt; ++frame) {
+				octree.Cull(path[frame].FrustumPlanes, path[frame].Position, scratch, blocks);
+				const auto frameSelectedCnt = octree.GetLastCullStatistics().GetSelectedBlocksCount();
+				for(auto view = 0u; view < 2; ++view) {
+					const auto& viewFrame = path[(frame + view * BENCHMARK_VIEW_FRAME_STEP) % framesCnt];
+					std::copy(viewFrame.FrustumPlanes, viewFrame.FrustumPlanes + 6, biasViews[view].FrustumPlanes);
+					biasViews[view].CameraPosition = viewFrame.Position;
+				}
+				octree.Cull(biasViews, 2, biasScratch, biasViewBlocks);
+				if(!pass)
+					continue;
+
+				selectedCnt += frameSelectedCnt;
+				getSortedIds(blocks, blockIds);
+				getSortedIds(biasViewBlocks[0], viewBlockIds);
+				if(blockIds != viewBlockIds) {
+					++mismatchedFramesCnt;
+				}
+			}
+		}
+		SLLOG(Sev_Info, Fac_Rendering, "Cull benchmark: LOD bias ", biasNames[bias], " - ", float(selectedCnt) / framesCnt, " blocks selected per frame");
+		if(mismatchedFramesCnt) {
+			SLLOG(Sev_Error, Fac_Rendering, "Cull benchmark: LOD bias ", biasNames[bias], " - the multi-view Cull picked other blocks in "
+				, mismatchedFramesCnt, " of ", framesCnt, " frames!");
+		}
+	}
+	octree.SetLodBiasVolumes(appBiasVolumes);
+
+	// Cull several overlapping views each frame (like a camera and it's shadow cascades)
+	// with a Cull per view and with a single multi-view Cull
+	const auto maxViews = Voxels::VoxelLodOctree::MAX_BATCHED_VIEWS;
+	std::vector<Voxels::VoxelLodOctree::CullView> views(maxViews);
+	std::vector<Voxels::VoxelLodOctree::VisibleBlocksVec> viewBlocks(maxViews);
+	Voxels::VoxelLodOctree::MultiViewCullScratch multiViewScratch;
+	const auto runViews = [&](unsigned viewsCnt, bool batched) -> long long {
+		const auto start = std::chrono::high_resolution_clock::now();
+		for(auto frame = 0u; frame < framesCnt; ++frame) {
+			for(auto view = 0u; view < viewsCnt; ++view) {
+				const auto& viewFrame = path[(frame + view * BENCHMARK_VIEW_FRAME_STEP) % framesCnt];
+				std::copy(viewFrame.FrustumPlanes, viewFrame.FrustumPlanes + 6, views[view].FrustumPlanes);
+				views[view].CameraPosition = viewFrame.Position;
+			}
+			if(batched) {
+				octree.Cull(&views[0], viewsCnt, multiViewScratch, &viewBlocks[0]);
+			} else {
+				for(auto view = 0u; view < viewsCnt; ++view) {
+					octree.Cull(views[view].FrustumPlanes, views[view].CameraPosition, scratch, viewBlocks[view]);
+				}
+			}
+		}
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+	};
+	for(auto viewsCnt = 1u; viewsCnt <= maxViews; ++viewsCnt) {
+		runViews(viewsCnt, false);
+		const auto separateTime = runViews(viewsCnt, false);
+		runViews(viewsCnt, true);
+		const auto batchedTime = runViews(viewsCnt, true);
+
+		SLLOG(Sev_Info, Fac_Rendering, "Cull benchmark: ", viewsCnt, " views - separately ", separateTime / framesCnt
+			, " us, batched ", batchedTime / framesCnt, " us per frame");
+	}
+
+	// The budgeted Cull follows the path with a persistent front - how long it takes and how
+	// often it completes the front in the budget compared to the blocks of a full Cull
+	Voxels::VoxelLodOctree::BudgetedCullState budgetedState;
+	auto completeCnt = 0u;
+	auto budgetedBlocksCnt = 0u;
+	auto fullBlocksCnt = 0u;
+	auto budgetedTime = 0ll;
+	for(auto frame = 0u; frame < framesCnt; ++frame) {
+		const auto budgetedStart = std::chrono::high_resolution_clock::now();
+		if(octree.CullBudgeted(path[frame].FrustumPlanes, path[frame].Position, CULL_BUDGET_MICROSECONDS, budgetedState, blocks)) {
+			++completeCnt;
+		}
+		budgetedTime += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - budgetedStart).count();
+		budgetedBlocksCnt += unsigned(blocks.size());
+		octree.Cull(path[frame].FrustumPlanes, path[frame].Position, scratch, blocks);
+		fullBlocksCnt += unsigned(blocks.size());
+	}
+	SLLOG(Sev_Info, Fac_Rendering, "Cull benchmark: budgeted ", CULL_BUDGET_MICROSECONDS, " us - ", budgetedTime / framesCnt
+		, " us per frame, ", float(completeCnt) * 100 / framesCnt, "% of the frames complete, ", float(budgetedBlocksCnt) / framesCnt
+		, " blocks per frame (", float(fullBlocksCnt) / framesCnt, " without a budget)");
+
+	// Back-face culling of whole blocks - how many are dropped and what it costs
+	auto backFacingCnt = 0u;
+	auto selectedCnt = 0u;
+	octree.SetBackFaceCulling(true);
+	const auto backFaceStart = std::chrono::high_resolution_clock::now();
+	for(auto frame = 0u; frame < framesCnt; ++frame) {
+		octree.Cull(path[frame].FrustumPlanes, path[frame].Position, scratch, blocks);
+		backFacingCnt += octree.GetLastCullStatistics().BackFacingBlocks;
+		selectedCnt += unsigned(blocks.size()) + octree.GetLastCullStatistics().BackFacingBlocks;
+	}
+	const auto backFaceTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - backFaceStart).count();
+	octree.SetBackFaceCulling(false);
+	const auto frontFaceStart = std::chrono::high_resolution_clock::now();
+	for(auto frame = 0u; frame < framesCnt; ++frame) {
+		octree.Cull(path[frame].FrustumPlanes, path[frame].Position, scratch, blocks);
+	}
+	const auto frontFaceTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - frontFaceStart).count();
+	octree.SetBackFaceCulling(m_BackFaceCull);
+	SLLOG(Sev_Info, Fac_Rendering, "Cull benchmark: back-face - ", float(backFacingCnt) * 100 / std::max(selectedCnt, 1u)
+		, "% of the blocks dropped in ", (backFaceTime - frontFaceTime) / framesCnt, " us per frame");
+
+	// Contribution culling of the blocks under a few pixels
+	auto subPixelCnt = 0u;
+	selectedCnt = 0u;
+	octree.SetContributionCulling(m_Projection._22, m_ViewportHeight, CONTRIBUTION_PIXEL_AREA);
+	for(auto frame = 0u; frame < framesCnt; ++frame) {
+		octree.Cull(path[frame].FrustumPlanes, path[frame].Position, scratch, blocks);
+		const auto& stats = octree.GetLastCullStatistics();
+		subPixelCnt += stats.SubPixelBlocks;
+		selectedCnt += unsigned(blocks.size()) + stats.SubPixelBlocks + stats.BackFacingBlocks;
+	}
+	octree.SetContributionCulling(m_Projection._22, m_ViewportHeight, m_ContributionCull ? CONTRIBUTION_PIXEL_AREA : 0);
+	SLLOG(Sev_Info, Fac_Rendering, "Cull benchmark: contribution - ", float(subPixelCnt) * 100 / std::max(selectedCnt, 1u)
+		, "% of the blocks under ", CONTRIBUTION_PIXEL_AREA, " pixels dropped");
+
+	// Horizon culling - only for heightmap terrains
+	if(m_Scene->IsHeightmapTerrain()) {
+		auto belowHorizonCnt = 0u;
+		selectedCnt = 0u;
+		octree.SetHorizonCulling(true);
+		const auto horizonStart = std::chrono::high_resolution_clock::now();
+		for(auto frame = 0u; frame < framesCnt; ++frame) {
+			octree.Cull(path[frame].FrustumPlanes, path[frame].Position, scratch, blocks);
+			const auto& stats = octree.GetLastCullStatistics();
+			belowHorizonCnt += stats.BelowHorizonBlocks;
+			selectedCnt += unsigned(blocks.size()) + stats.BelowHorizonBlocks + stats.SubPixelBlocks + stats.BackFacingBlocks;
+		}
+		const auto horizonTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - horizonStart).count();
+		octree.SetHorizonCulling(m_HorizonCull);
+		SLLOG(Sev_Info, Fac_Rendering, "Cull benchmark: horizon - ", float(belowHorizonCnt) * 100 / std::max(selectedCnt, 1u)
+			, "% of the blocks hidden, ", horizonTime / framesCnt, " us per frame for the whole Cull");
+	}
+
+	// Occlusion culling after the LOD & culling - how much is hidden and what it costs
+	Voxels::VoxelLodOctree::VisibleBlocksVec unoccludedBlocks;
+	auto occludedFraction = 0.f;
+	auto occlusionTime = 0ll;
+	for(auto frame = 0u; frame < framesCnt; ++frame) {
+		octree.Cull(path[frame].FrustumPlanes, path[frame].Position, scratch, blocks);
+		m_OcclusionCuller->Cull(path[frame].ViewProjection, path[frame].Position, blocks, unoccludedBlocks);
+		const auto& occlusionStats = m_OcclusionCuller->GetLastStatistics();
+		occludedFraction += occlusionStats.GetOccludedFraction();
+		occlusionTime += occlusionStats.RasterizationTime + occlusionStats.TestTime;
+	}
+	SLLOG(Sev_Info, Fac_Rendering, "Cull benchmark: occlusion - ", occludedFraction * 100 / framesCnt
+		, "% of the blocks occluded in ", occlusionTime / framesCnt, " us per frame");
+
+	const auto runPath = [&](bool inParallel, Voxels::VoxelLodOctree::VisibleSetTracker* pathTracker) -> long long {
+		const auto start = std::chrono::high_resolution_clock::now();
+		for(auto frame = 0u; frame < framesCnt; ++frame) {
+			if(inParallel) {
+				octree.CullParallel(path[frame].FrustumPlanes, path[frame].Position, PARALLEL_CULL_SPLIT_DEPTH, parallelScratch, blocks, pathTracker);
+			} else {
+				octree.Cull(path[frame].FrustumPlanes, path[frame].Position, scratch, blocks, pathTracker);
+			}
+		}
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+	};
+
+	// the first run of each setup only warms up the caches and the scratch memory
+	runPath(false, nullptr);
+	const auto sequentialTime = runPath(false, nullptr);
+	SLLOG(Sev_Info, Fac_Rendering, "Cull benchmark: sequential - ", sequentialTime / framesCnt, " us per frame");
+
+	runPath(false, &tracker);
+	const auto trackedTime = runPath(false, &tracker);
+	SLLOG(Sev_Info, Fac_Rendering, "Cull benchmark: sequential with visible set tracking - ", trackedTime / framesCnt, " us per frame");
+
+	const auto maxThreads = concurrency::GetProcessorCount();
+	for(auto threads = 1u; threads <= maxThreads; ++threads) {
+		concurrency::CurrentScheduler::Create(concurrency::SchedulerPolicy(2
+			, concurrency::MinConcurrency, threads
+			, concurrency::MaxConcurrency, threads));
+		runPath(true, nullptr);
+		const auto parallelTime = runPath(true, nullptr);
+		concurrency::CurrentScheduler::Detach();
+
+		SLLOG(Sev_Info, Fac_Rendering, "Cull benchmark: ", threads, " threads - ", parallelTime / framesCnt
+			, " us per frame, speed-up x", float(sequentialTime) / std::max(parallelTime, 1ll));
+	}
 }
 
 bool DrawRoutine::Render(float deltaTime)
@@ -411,11 +865,19 @@ bool DrawRoutine::Render(float deltaTime)
 	ID3D11ShaderResourceView* const psTextures[] = {m_DiffuseTextures->GetSHRV(), m_NormalTextures->GetSHRV()};
 	context->PSSetShaderResources(0, 2, psTextures);
 
+	if(m_RecordPath) {
+		CameraPathFrame frame;
+		CalculateGridView(frame.FrustumPlanes, frame.Position);
+		CalculateGridViewProjection(frame.ViewProjection);
+		m_RecordedPath.push_back(frame);
+	}
+
 	if(m_UseLodOctree) {
 		if(m_LodUpdate) {
 			UpdateCulledObjects();
 		}
 	} else {
+		m_CoherentCullState.Reset();
 		m_BlockToDraw.clear();
 		auto& currentLodLevel = m_LodLevels[m_CurrentLodToDraw];
 		std::for_each(currentLodLevel.Blocks.begin(), currentLodLevel.Blocks.end(), 
@@ -426,9 +888,10 @@ bool DrawRoutine::Render(float deltaTime)
 		});
 	}
 
-	const auto blocksCount = m_BlockToDraw.size();
+	const auto& blocksToDraw = (m_UseLodOctree && m_OcclusionCull) ? m_UnoccludedBlocks : m_BlockToDraw;
+	const auto blocksCount = blocksToDraw.size();
 	for(auto id = 0u; id < blocksCount; ++id) {
-		auto blockIt = m_BlocksMap.find(m_BlockToDraw[id].Id);
+		auto blockIt = m_BlocksMap.find(blocksToDraw[id].Id);
 		assert(blockIt != m_BlocksMap.end());
 		auto& currentBlock = blockIt->second;
 
@@ -437,7 +900,7 @@ bool DrawRoutine::Render(float deltaTime)
 
 		int transitionFlags = 0;
 		for(auto tr = 0u; tr < 6; ++tr) {
-			if(!currentBlock->TransitionIndicesSizes[tr] || !m_BlockToDraw[id].TransitionFaces[tr])
+			if(!currentBlock->TransitionIndicesSizes[tr] || !blocksToDraw[id].TransitionFaces[tr])
 				continue;
 			transitionFlags |= (1 << tr);
 		}
@@ -466,7 +929,7 @@ bool DrawRoutine::Render(float deltaTime)
 		if(m_DrawTransitions) {
 			context->VSSetShader(m_VSTransition.Get(), nullptr, 0); 
 			for(auto tr = 0u; tr < 6; ++tr) {
-				if(!currentBlock->TransitionIndicesSizes[tr] || !m_BlockToDraw[id].TransitionFaces[tr])
+				if(!currentBlock->TransitionIndicesSizes[tr] || !blocksToDraw[id].TransitionFaces[tr])
 					continue;
 	
 				context->IASetIndexBuffer(currentBlock->TransitionIndexBuffers[tr].Get(), DXGI_FORMAT_R32_UINT, 0);
@@ -10,6 +10,7 @@
 #include <Utilities/Aligned.h>
 
 #include "Voxel/VoxelLodOctree.h"
+#include "Voxel/OcclusionCuller.h"
 #include "Scene.h"
 
 class Camera;
@@ -23,10 +24,14 @@ public:
 	DrawRoutine();
 	virtual ~DrawRoutine();
 
-	virtual bool Initialize(Renderer* renderer, Camera* camera, const DirectX::XMFLOAT4X4& projection, Scene* scene);
+	virtual bool Initialize(Renderer* renderer, Camera* camera, const DirectX::XMFLOAT4X4& projection, unsigned viewportHeight, Scene* scene);
 
 	virtual bool Render(float deltaTime);
 
+	// Takes the projection and the viewport height again after a resize - the screen-space error LOD
+	// and the contribution culling depend on them. Does nothing if they didn't change
+	void SetProjection(const DirectX::XMFLOAT4X4& projection, unsigned viewportHeight);
+
 	bool ReloadGrid();
 	bool UpdateGrid();
 
@@ -51,11 +56,60 @@ public:
 	bool GetLodUpdateEnabled() const { return m_LodUpdate; }
 	void SetLodUpdateEnabled(bool enabled) { m_LodUpdate = enabled; };
 
+	bool GetCoherentCullEnabled() const { return m_CoherentCull; }
+	void SetCoherentCullEnabled(bool enabled) { m_CoherentCull = enabled; };
+
+	bool GetParallelCullEnabled() const { return m_ParallelCull; }
+	void SetParallelCullEnabled(bool enabled) { m_ParallelCull = enabled; };
+
+	// When enabled the LOD front is refined for a fixed time each frame and the rest is left for the next frames
+	bool GetBudgetedCullEnabled() const { return m_BudgetedCull; }
+	void SetBudgetedCullEnabled(bool enabled) { m_BudgetedCull = enabled; };
+
+	bool GetScreenSpaceLodEnabled() const { return m_ScreenSpaceLod; }
+	void SetScreenSpaceLodEnabled(bool enabled) { m_ScreenSpaceLod = enabled; };
+
+	// When enabled the blocks hidden behind nearer blocks are dropped after the LOD & culling
+	bool GetOcclusionCullEnabled() const { return m_OcclusionCull; }
+	void SetOcclusionCullEnabled(bool enabled);
+	const Voxels::OcclusionCuller::Statistics& GetOcclusionStatistics() const { return m_OcclusionCuller->GetLastStatistics(); }
+
+	// What the last LOD & culling of the octree did and how long it took
+	const Voxels::VoxelLodOctree::CullStatistics& GetCullStatistics() const { return m_Scene->GetLodOctree().GetLastCullStatistics(); }
+
+	// When enabled the Cull drops the blocks that face away from the camera
+	bool GetBackFaceCullEnabled() const { return m_BackFaceCull; }
+	void SetBackFaceCullEnabled(bool enabled) { m_BackFaceCull = enabled; };
+
+	// When enabled the Cull drops the blocks that cover only a pixel or two
+	bool GetContributionCullEnabled() const { return m_ContributionCull; }
+	void SetContributionCullEnabled(bool enabled) { m_ContributionCull = enabled; };
+
+	// When enabled the Cull drops the blocks hidden behind nearer terrain. Only used for heightmap terrains
+	bool GetHorizonCullEnabled() const { return m_HorizonCull; }
+	void SetHorizonCullEnabled(bool enabled) { m_HorizonCull = enabled; };
+
+	// Records the camera each frame for the culling benchmark. Starting a recording drops the old one
+	bool GetRecordCameraPath() const { return m_RecordPath; }
+	void SetRecordCameraPath(bool record);
+
+	// Culls along the recorded camera path (or a fixed one if there is none) with each LOD policy,
+	// with several views at once, with a time budget, with back-face, contribution, horizon & occlusion culling and with 1 to N threads and logs the blocks drawn and the times.
+	// Also times the SIMD and the scalar frustum tests, checks the transition faces against a brute-force comparison, compares the blocks with and without LOD bias volumes (also in a multi-view Cull) and
+	// checks that the capacity of the Cull scratch memory doesn't change once it's warmed up. getMemoryUse, if passed, returns
+	// the memory used by the voxels library and it's checked too. Other heap allocations aren't seen
+	void RunCullBenchmark(size_t (*getMemoryUse)() = nullptr);
+
 private:
+	// Calculates the frustum planes and the position of the camera in grid space
+	void CalculateGridView(DirectX::XMFLOAT4 frustumPlanes[6], DirectX::XMFLOAT3& camPos) const;
+	// The view-projection matrix that takes grid space to clip space
+	void CalculateGridViewProjection(DirectX::XMFLOAT4X4& viewProjection) const;
 	void UpdateCulledObjects();
 
 	Camera* m_Camera;
 	DirectX::XMFLOAT4X4 m_Projection;
+	float m_ViewportHeight;
 
 	Scene* m_Scene;
 
@@ -65,8 +119,35 @@ private:
 	bool m_DrawSurface;
 	bool m_UseLodOctree;
 	bool m_LodUpdate;
+	bool m_CoherentCull;
+	bool m_ParallelCull;
+	bool m_BudgetedCull;
+	bool m_ScreenSpaceLod;
+	bool m_OcclusionCull;
+	bool m_BackFaceCull;
+	bool m_ContributionCull;
+	bool m_HorizonCull;
+	bool m_RecordPath;
 
 	Voxels::VoxelLodOctree::VisibleBlocksVec m_BlockToDraw;
+	Voxels::VoxelLodOctree::CullScratch m_CullScratch;
+	Voxels::VoxelLodOctree::CoherentCullState m_CoherentCullState;
+	Voxels::VoxelLodOctree::ParallelCullScratch m_ParallelCullScratch;
+	Voxels::VoxelLodOctree::BudgetedCullState m_BudgetedCullState;
+	std::unique_ptr<Voxels::ScreenSpaceErrorLodPolicy> m_ScreenSpaceLodPolicy;
+	// the blocks to draw that aren't occluded - the coherent Cull needs it's output untouched
+	Voxels::VoxelLodOctree::VisibleBlocksVec m_UnoccludedBlocks;
+	std::unique_ptr<Voxels::OcclusionCuller> m_OcclusionCuller;
+
+	// A frame of a camera path in grid space
+	struct CameraPathFrame
+	{
+		DirectX::XMFLOAT4 FrustumPlanes[6];
+		DirectX::XMFLOAT3 Position;
+		DirectX::XMFLOAT4X4 ViewProjection;
+	};
+	typedef std::vector<CameraPathFrame> CameraPath;
+	CameraPath m_RecordedPath;
 	
 	ReleaseGuard<ID3D11Buffer> m_PerFrameBuffer;
 	ReleaseGuard<ID3D11Buffer> m_PerBlockBuffer;	
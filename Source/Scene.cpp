@@ -14,9 +14,23 @@
 #include <Utilities/SimpleAllocator.h>
 #include "HeightMapLoader.h"
 
-#include <DirectXCollision.h>
+#include <chrono>
 
 using namespace DirectX;
+
+static const char* LOD_CACHE_EXTENSION = ".lod";
+// the rays cast by the picking benchmark - each one at the center of a block
+static const unsigned PICKING_BENCHMARK_RAYS = 16384;
+
+// FNV-1a hash of the bytes, continues from the hash passed
+static unsigned long long HashBytes(const void* data, size_t size, unsigned long long hash = 14695981039346656037ull)
+{
+	const auto bytes = static_cast<const unsigned char*>(data);
+	for(size_t i = 0; i < size; ++i) {
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	}
+	return hash;
+}
 							  
 Scene::Scene(const std::string& filename /*leave empty to generate*/
 		, unsigned gridSize
@@ -28,6 +42,8 @@ Scene::Scene(const std::string& filename /*leave empty to generate*/
 	: m_Scale(gridScale)
 	, m_Grid(nullptr)
 	, m_PolygonSurface(nullptr)
+	, m_GridHash(0)
+	, m_IsHeightmapTerrain(false)
 {
 	const float start_x = -(gridSize / 8.f);
 	const float start_y = -(gridSize / 8.f);
@@ -78,6 +94,9 @@ Scene::Scene(const std::string& filename /*leave empty to generate*/
 			fin.read(data.get(), length);
 
 			m_Grid = SceneGridType::Load(data.get(), length);
+
+			m_LodCacheFile = filename + LOD_CACHE_EXTENSION;
+			m_GridHash = HashBytes(data.get(), length);
 		} else {
 			unsigned int w;
 			std::shared_ptr<char> heightValues;
@@ -85,6 +104,7 @@ Scene::Scene(const std::string& filename /*leave empty to generate*/
 				SLOG(Sev_Error, Fac_Rendering, "Unable generate grid from hightmap!");
 			}
 			m_Grid = SceneGridType::Create(w, heightValues.get());
+			m_IsHeightmapTerrain = true;
 		}
 	}
 
@@ -113,11 +133,73 @@ bool Scene::SaveVoxelGrid(const std::string& filename)
 
 	fout.write(pack->GetData(), pack->GetSize());
 
+	// the octree is up to date with the grid as it is saved
+	m_LodCacheFile = filename + LOD_CACHE_EXTENSION;
+	m_GridHash = HashBytes(pack->GetData(), pack->GetSize());
+	SaveLodOctreeCache();
+
 	pack->Destroy();
 
 	return true;
 }
 
+unsigned long long Scene::GetLodCacheKey() const
+{
+	// The octree depends on the grid and on how the polygonizer splits it in blocks
+	auto key = m_GridHash;
+	const auto levelsCount = m_PolygonSurface->GetLevelsCount();
+	const auto extents = m_PolygonSurface->GetExtents();
+	key = HashBytes(&levelsCount, sizeof(levelsCount), key);
+	key = HashBytes(&extents, sizeof(extents), key);
+	for (auto level = 0u; level < levelsCount; ++level)
+	{
+		const auto blocksCnt = m_PolygonSurface->GetBlocksForLevelCount(level);
+		key = HashBytes(&blocksCnt, sizeof(blocksCnt), key);
+	}
+	return key;
+}
+
+bool Scene::LoadLodOctreeCache()
+{
+	if(m_LodCacheFile.empty())
+		return false;
+
+	std::ifstream fin(m_LodCacheFile.c_str(), std::ios::binary);
+	if (!fin.is_open())
+		return false;
+
+	// the whole cache is read at once
+	fin.seekg(0, std::ios::end);
+	unsigned length = (unsigned)fin.tellg();
+	fin.seekg(0, std::ios::beg);
+
+	std::unique_ptr<char[]> data(new char[length]);
+	if(!fin.read(data.get(), length))
+		return false;
+
+	if(!m_LodOctree->Load(*m_PolygonSurface, GetLodCacheKey(), data.get(), length)) {
+		SLOG(Sev_Info, Fac_Rendering, "LOD octree cache is out of date");
+		return false;
+	}
+
+	return true;
+}
+
+void Scene::SaveLodOctreeCache()
+{
+	if(m_LodCacheFile.empty() || !m_LodOctree)
+		return;
+
+	std::vector<char> blob;
+	m_LodOctree->Save(*m_PolygonSurface, GetLodCacheKey(), blob);
+
+	std::ofstream fout(m_LodCacheFile.c_str(), std::ios::binary);
+	if (!fout.is_open() || !fout.write(&blob[0], blob.size()))
+	{
+		SLOG(Sev_Warning, Fac_Rendering, "Unable to save the LOD octree cache!");
+	}
+}
+
 void Scene::RecalculateGrid(const Voxels::float3pair* modified)
 {
 	SLLOG(Sev_Info, Fac_Rendering, "Memory used for grid blocks: ", m_Grid->GetGridBlocksMemorySize());
@@ -136,6 +218,11 @@ void Scene::RecalculateGrid(const Voxels::float3pair* modified)
 		}
 	}
 
+	// the grid is different from the one in the grid file
+	if(modified) {
+		m_LodCacheFile.clear();
+	}
+
 	SLOG(Sev_Debug, Fac_Rendering, "Recalculating grid...");
 
 	m_PolygonSurface = std::move(decltype(m_PolygonSurface)(m_Polygonizer->Execute(*m_Grid, &m_Materials, modified ? modification : nullptr)));
@@ -149,6 +236,7 @@ void Scene::RecalculateGrid(const Voxels::float3pair* modified)
 	unsigned totalVertices = 0;
 	unsigned totalIndices = 0;
 
+	m_FinestBlocks.clear();
 	auto stats = m_PolygonSurface->GetStatistics();
 	SLOG(Sev_Debug, Fac_Rendering, "TransVoxel results:");
 	SLOG(Sev_Debug, Fac_Rendering, "Total blocks recalculated: ", stats->BlocksCalculated);
@@ -160,6 +248,9 @@ void Scene::RecalculateGrid(const Voxels::float3pair* modified)
 		{
 			unsigned temp = 0;
 			auto block = m_PolygonSurface->GetBlockForLevel(level, blockId);
+			if(level == 0) {
+				m_FinestBlocks.insert(std::make_pair(block->GetId(), block));
+			}
 			block->GetVertices(&temp);
 			SLOG(Sev_Trace, Fac_Rendering, "Vertices produced ", temp);
 			totalVertices += temp;
@@ -168,6 +259,8 @@ void Scene::RecalculateGrid(const Voxels::float3pair* modified)
 			SLOG(Sev_Trace, Fac_Rendering, "Indices produced ", temp);
 		}
 	}
+	InvalidateBlockBvhs(modified);
+
 	SLOG(Sev_Debug, Fac_Rendering, "Total vertices produced: ", totalVertices);
 	SLOG(Sev_Debug, Fac_Rendering, "Total indices produced: ", totalIndices);
 
@@ -178,11 +271,33 @@ void Scene::RecalculateGrid(const Voxels::float3pair* modified)
 		SLOG(Sev_Trace, Fac_Rendering, "Cells with Case[", i, "] ", stats->PerCaseCellsCount[i]);
 	}
 
-	// Rebuild the octree
-	m_LodOctree.reset(new Voxels::VoxelLodOctree());
-	if(!m_LodOctree->Build(*m_PolygonSurface)) {
+	// Patch the octree if only a part of the grid was recalculated - rebuild it otherwise
+	const auto buildStart = std::chrono::high_resolution_clock::now();
+	const auto isPatch = modified && m_LodOctree;
+	auto isLoaded = false;
+	auto isBuilt = false;
+	if(isPatch) {
+		// The grid works with Z up and the polygons with Y up so swap
+		const Voxels::float3pair surfaceModified(
+			Voxels::float3(modified->first.x, modified->first.z, modified->first.y),
+			Voxels::float3(modified->second.x, modified->second.z, modified->second.y));
+		isBuilt = m_LodOctree->Update(*m_PolygonSurface, surfaceModified);
+	} else {
+		// the octree of a grid loaded from a file is taken from the cache if it's there
+		m_LodOctree.reset(new Voxels::VoxelLodOctree());
+		isLoaded = LoadLodOctreeCache();
+		isBuilt = isLoaded || m_LodOctree->Build(*m_PolygonSurface);
+		if(isBuilt && !isLoaded) {
+			SaveLodOctreeCache();
+		}
+	}
+	if(!isBuilt) {
 		SLOG(Sev_Error, Fac_Rendering, "LOD octree building failed!");
 	}
+	const auto buildTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - buildStart);
+
+	const auto extents = m_PolygonSurface->GetExtents();
+	SLLOG(Sev_Info, Fac_Rendering, "LOD octree ", isPatch ? "patched" : (isLoaded ? "loaded" : "built"), " for grid extents ", extents.x, "x", extents.y, "x", extents.z, " in ", buildTime.count(), " us");
 
 	SLLOG(Sev_Debug, Fac_Rendering, "LOD octree levels: ", m_LodOctree->GetLodLevelsCount());
 	SLLOG(Sev_Debug, Fac_Rendering, "LOD octree non-empty cells: ", m_LodOctree->GetNonEmptyNodesCount());
@@ -194,70 +309,348 @@ bool Scene::Intersect(DirectX::FXMVECTOR start,
 {
 	using namespace DirectX;
 
+	const auto pickStart = std::chrono::high_resolution_clock::now();
 	const auto recScale = XMVectorReciprocal(XMLoadFloat3(&m_Scale));
 	const auto origin = XMVectorMultiply(start, recScale);
 	const auto endPoint = XMVectorMultiply(end, recScale);
 
-	unsigned blocksCnt = m_PolygonSurface->GetBlocksForLevelCount(0);
 	auto direction = DirectX::XMVector3Normalize(end - start);
 
-	typedef std::pair<float, const Voxels::BlockPolygons*> HitBlock;
-	std::vector<HitBlock> hitBlocks;
-	for (auto blockId = 0u; blockId < blocksCnt; ++blockId)
-	{
-		BoundingBox aabb;
-		auto block = m_PolygonSurface->GetBlockForLevel(0, blockId);
-		const auto minCorner = block->GetMinimalCorner();
-		const auto maxCorner = block->GetMaximalCorner();
-		aabb.Extents = XMFLOAT3((maxCorner.x - minCorner.x) / 2.f,
-								(maxCorner.y - minCorner.y) / 2.f,
-								(maxCorner.z - minCorner.z) / 2.f);
-
-		aabb.Center = XMFLOAT3(minCorner.x + aabb.Extents.x,
-								minCorner.y + aabb.Extents.y,
-								minCorner.z + aabb.Extents.z);
+	// the octree returns the finest blocks on the ray sorted near to far
+	XMFLOAT3 rayOrigin;
+	XMFLOAT3 rayDirection;
+	XMStoreFloat3(&rayOrigin, start);
+	XMStoreFloat3(&rayDirection, direction);
+	Voxels::VoxelLodOctree::RayHitsVec hitBlocks;
+	m_LodOctree->QueryRay(rayOrigin, rayDirection, std::numeric_limits<float>::max(), 0, hitBlocks);
 
-		float distance = 0;
-		if (aabb.Intersects(start, direction, distance))
+	// The blocks are disjoint and sorted by where the ray enters them - the
+	// blocks that start after the nearest hit can't have a nearer one
+	float distance = 0;
+	float nearest = std::numeric_limits<float>::max();
+	bool found = false;
+	unsigned triangle = 0;
+	auto testedCnt = 0u;
+	for (auto block = hitBlocks.cbegin(); block != hitBlocks.cend() && block->Distance <= nearest; ++block, ++testedCnt)
+	{
+		if (GetBlockBvh(block->Id).Intersect(rayOrigin, rayDirection, nearest, distance, triangle))
 		{
-			hitBlocks.push_back(std::make_pair(distance, block));
+			nearest = distance;
+			found = true;
 		}
 	}
 
-	std::sort(hitBlocks.begin(), hitBlocks.end(), 
-		[](HitBlock& block1, HitBlock& block2) {
-		return std::abs(block1.first) < std::abs(block2.first);
+	intersection = start + nearest * direction;
+
+	const auto pickTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - pickStart);
+	SLLOG(Sev_Trace, Fac_Rendering, "Picking tested ", testedCnt, " of ", hitBlocks.size(), " blocks on the ray in ", pickTime.count(), " us");
+
+	return found;
+}
+
+void Scene::IntersectRays(const Ray* rays, unsigned raysCnt, RayHit* hits) const
+{
+	if(!raysCnt)
+		return;
+	const auto traceStart = std::chrono::high_resolution_clock::now();
+
+	// the finest blocks on each ray near to far - the octree is only read
+	std::vector<Voxels::VoxelLodOctree::RayHitsVec> rayBlocks(raysCnt);
+	std::vector<XMFLOAT3> directions(raysCnt);
+	concurrency::parallel_for(0u, raysCnt, [&](unsigned ray) {
+		hits[ray].Hit = false;
+		const auto direction = XMLoadFloat3(&rays[ray].Direction);
+		const auto length = XMVectorGetX(XMVector3Length(direction));
+		if(length <= 0)
+			return;
+		XMStoreFloat3(&directions[ray], direction / length);
+		m_LodOctree->QueryRay(rays[ray].Origin, directions[ray], rays[ray].MaxDistance, 0, rayBlocks[ray]);
 	});
 
-	float distance = 0;
-	float nearest = std::numeric_limits<float>::max();
-	bool found = false;
-	XMVECTOR V0, V1, V2;
-	for (auto block = hitBlocks.cbegin(); block != hitBlocks.cend(); ++block)
-	{
-		const auto blockRef = block->second;
+	// The BVHs are built before the tracing so that the threads only read the map. Other callers
+	// can only add BVHs meanwhile, so the map is read under the lock that keeps them out
+	std::vector<unsigned> blockIds;
+	std::for_each(rayBlocks.cbegin(), rayBlocks.cend(), [&](const Voxels::VoxelLodOctree::RayHitsVec& blocks) {
+		std::for_each(blocks.cbegin(), blocks.cend(), [&](const Voxels::VoxelLodOctree::RayHit& block) {
+			blockIds.push_back(block.Id);
+		});
+	});
+	BuildBlockBvhs(blockIds);
+	concurrency::reader_writer_lock::scoped_lock_read bvhsLock(m_BlockBvhsLock);
+
+	// Sort the rays by the first block they reach and their direction, so each thread
+	// gets a range of rays that go through the same nodes and triangles
+	std::vector<unsigned> order;
+	order.reserve(raysCnt);
+	for(auto ray = 0u; ray < raysCnt; ++ray) {
+		if(!rayBlocks[ray].empty()) {
+			order.push_back(ray);
+		}
+	}
+	const auto getOctant = [&](unsigned ray) {
+		const auto& direction = directions[ray];
+		return unsigned(direction.x < 0) | (unsigned(direction.y < 0) << 1) | (unsigned(direction.z < 0) << 2);
+	};
+	std::sort(order.begin(), order.end(), [&](unsigned lhs, unsigned rhs) {
+		const auto lhsBlock = rayBlocks[lhs].front().Id;
+		const auto rhsBlock = rayBlocks[rhs].front().Id;
+		return lhsBlock != rhsBlock ? lhsBlock < rhsBlock : getOctant(lhs) < getOctant(rhs);
+	});
+
+	concurrency::parallel_for(0u, unsigned(order.size()), [&](unsigned id) {
+		const auto ray = order[id];
+		const auto& blocks = rayBlocks[ray];
+		auto nearest = rays[ray].MaxDistance;
+		const Voxels::TriangleBvh* hitBvh = nullptr;
+		auto hitBlockId = 0u;
+		auto triangle = 0u;
+		float distance = 0;
+		// the same early out as in Intersect - the blocks are disjoint and sorted
+		for(auto block = blocks.cbegin(); block != blocks.cend() && block->Distance <= nearest; ++block) {
+			const auto& bvh = *m_BlockBvhs.find(block->Id)->second;
+			if(bvh.Intersect(rays[ray].Origin, directions[ray], nearest, distance, triangle)) {
+				nearest = distance;
+				hitBvh = &bvh;
+				hitBlockId = block->Id;
+			}
+		}
+		if(!hitBvh)
+			return;
+
+		auto& hit = hits[ray];
+		hit.Hit = true;
+		hit.Distance = nearest;
+		hit.BlockId = hitBlockId;
+		const auto origin = XMLoadFloat3(&rays[ray].Origin);
+		const auto direction = XMLoadFloat3(&directions[ray]);
+		XMStoreFloat3(&hit.Position, origin + nearest * direction);
+
 		unsigned indicesCnt = 0;
-		auto indices = blockRef->GetIndices(&indicesCnt);
-		for (auto triangle = 0u; triangle < indicesCnt; triangle += 3)
-		{
-			auto vertices = blockRef->GetVertices(nullptr);
-			V0 = XMLoadFloat3(reinterpret_cast<const DirectX::XMFLOAT3*>(&vertices[indices[triangle]].Position));
-			V1 = XMLoadFloat3(reinterpret_cast<const DirectX::XMFLOAT3*>(&vertices[indices[triangle + 1]].Position));
-			V2 = XMLoadFloat3(reinterpret_cast<const DirectX::XMFLOAT3*>(&vertices[indices[triangle + 2]].Position));
-			if (TriangleTests::Intersects(start, direction, V0, V1, V2, distance))
-			{
-				nearest = std::min(nearest, distance);
-				found = true;
+		const auto indices = hitBvh->GetBlock()->GetIndices(&indicesCnt);
+		const auto vertices = hitBvh->GetBlock()->GetVertices(nullptr);
+		XMVECTOR corners[3];
+		for(auto vertex = 0u; vertex < 3; ++vertex) {
+			const auto& position = vertices[indices[triangle + vertex]].Position;
+			corners[vertex] = XMVectorSet(position.x, position.y, position.z, 0);
+		}
+		auto normal = XMVector3Normalize(XMVector3Cross(corners[1] - corners[0], corners[2] - corners[0]));
+		if(XMVectorGetX(XMVector3Dot(normal, direction)) > 0) {
+			normal = -normal;
+		}
+		XMStoreFloat3(&hit.Normal, normal);
+	});
+
+	const auto traceTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - traceStart);
+	SLLOG(Sev_Trace, Fac_Rendering, "Traced ", raysCnt, " rays (", order.size(), " reached blocks) in ", traceTime.count(), " us");
+}
+
+void Scene::RunPickingBenchmark() const
+{
+	if(!m_PolygonSurface || m_FinestBlocks.empty())
+		return;
+
+	// build the BVHs first so that only the tests are measured
+	std::vector<unsigned> blockIds;
+	blockIds.reserve(m_FinestBlocks.size());
+	std::for_each(m_FinestBlocks.cbegin(), m_FinestBlocks.cend(), [&](const std::pair<unsigned, const Voxels::BlockPolygons*>& block) {
+		blockIds.push_back(block.first);
+	});
+	std::sort(blockIds.begin(), blockIds.end());
+	std::vector<const Voxels::TriangleBvh*> bvhs;
+	bvhs.reserve(blockIds.size());
+	std::for_each(blockIds.cbegin(), blockIds.cend(), [&](unsigned blockId) {
+		const auto& bvh = GetBlockBvh(blockId);
+		if(bvh.GetTrianglesCount()) {
+			bvhs.push_back(&bvh);
+		}
+	});
+	if(bvhs.empty())
+		return;
+
+	// The rays come from all around the blocks - the directions are on a spiral over the sphere
+	struct BenchmarkRay
+	{
+		const Voxels::TriangleBvh* Bvh;
+		XMFLOAT3 Origin;
+		XMFLOAT3 Direction;
+	};
+	std::vector<BenchmarkRay> rays(PICKING_BENCHMARK_RAYS);
+	for(auto ray = 0u; ray < PICKING_BENCHMARK_RAYS; ++ray) {
+		const auto bvh = bvhs[ray % bvhs.size()];
+		const auto minCorner = bvh->GetBlock()->GetMinimalCorner();
+		const auto maxCorner = bvh->GetBlock()->GetMaximalCorner();
+		const auto center = XMVectorSet((minCorner.x + maxCorner.x) / 2, (minCorner.y + maxCorner.y) / 2, (minCorner.z + maxCorner.z) / 2, 1);
+		const auto radius = XMVectorGetX(XMVector3Length(XMVectorSet(maxCorner.x - minCorner.x, maxCorner.y - minCorner.y, maxCorner.z - minCorner.z, 0)));
+
+		const auto y = 1 - 2 * (ray + 0.5f) / PICKING_BENCHMARK_RAYS;
+		const auto ringRadius = std::sqrt(std::max(0.f, 1 - y * y));
+		const auto angle = ray * 2.39996323f;
+		const auto direction = XMVectorSet(ringRadius * std::cos(angle), y, ringRadius * std::sin(angle), 0);
+		rays[ray].Bvh = bvh;
+		XMStoreFloat3(&rays[ray].Direction, direction);
+		XMStoreFloat3(&rays[ray].Origin, center - radius * direction);
+	}
+
+	struct BenchmarkHit
+	{
+		bool Found;
+		float Distance;
+		unsigned Triangle;
+	};
+	std::vector<BenchmarkHit> hits[2];
+	const Voxels::TriangleBvh::Kernel kernels[] = { Voxels::TriangleBvh::Kernel_Packet, Voxels::TriangleBvh::Kernel_Scalar };
+	const auto runKernels = [&](bool useTree, long long times[2]) -> unsigned {
+		for(auto kernel = 0u; kernel < 2; ++kernel) {
+			hits[kernel].assign(PICKING_BENCHMARK_RAYS, BenchmarkHit());
+			const auto start = std::chrono::high_resolution_clock::now();
+			for(auto ray = 0u; ray < PICKING_BENCHMARK_RAYS; ++ray) {
+				const auto& query = rays[ray];
+				auto& hit = hits[kernel][ray];
+				hit.Found = useTree
+					? query.Bvh->Intersect(query.Origin, query.Direction, std::numeric_limits<float>::max(), hit.Distance, hit.Triangle, kernels[kernel])
+					: query.Bvh->IntersectAll(query.Origin, query.Direction, std::numeric_limits<float>::max(), hit.Distance, hit.Triangle, kernels[kernel]);
 			}
+			times[kernel] = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
 		}
 
-		if (found)
-			break;
+		// both kernels have to find exactly the same hits
+		auto mismatchesCnt = 0u;
+		for(auto ray = 0u; ray < PICKING_BENCHMARK_RAYS; ++ray) {
+			const auto& packet = hits[0][ray];
+			const auto& scalar = hits[1][ray];
+			if(packet.Found != scalar.Found || (packet.Found && (packet.Distance != scalar.Distance || packet.Triangle != scalar.Triangle))) {
+				++mismatchesCnt;
+			}
+		}
+		return mismatchesCnt;
+	};
+
+	unsigned long long trianglesCnt = 0;
+	std::for_each(rays.cbegin(), rays.cend(), [&](const BenchmarkRay& ray) {
+		trianglesCnt += ray.Bvh->GetTrianglesCount();
+	});
+	const auto perSecond = [](unsigned long long count, long long microseconds) {
+		return double(count) * 1000000 / std::max(microseconds, 1ll);
+	};
+
+	SLLOG(Sev_Info, Fac_Rendering, "Picking benchmark: ", PICKING_BENCHMARK_RAYS, " rays at ", bvhs.size(), " blocks");
+	long long times[2];
+	auto mismatchesCnt = runKernels(false, times);
+	SLLOG(Sev_Info, Fac_Rendering, "Picking benchmark: all triangles - packet kernel ", perSecond(trianglesCnt, times[0]), " triangles/s, scalar kernel "
+		, perSecond(trianglesCnt, times[1]), " triangles/s");
+	if(mismatchesCnt) {
+		SLLOG(Sev_Error, Fac_Rendering, "Picking benchmark: the kernels found different hits for ", mismatchesCnt, " rays!");
 	}
 
-	intersection = start + nearest * direction;
+	mismatchesCnt = runKernels(true, times);
+	SLLOG(Sev_Info, Fac_Rendering, "Picking benchmark: BVH - packet kernel ", perSecond(PICKING_BENCHMARK_RAYS, times[0]), " rays/s, scalar kernel "
+		, perSecond(PICKING_BENCHMARK_RAYS, times[1]), " rays/s");
+	if(mismatchesCnt) {
+		SLLOG(Sev_Error, Fac_Rendering, "Picking benchmark: the kernels found different hits for ", mismatchesCnt, " rays with the BVH!");
+	}
 
-	return found;
+	// The same rays through the whole surface in one batch on 1 to N threads
+	std::vector<Ray> batch(PICKING_BENCHMARK_RAYS);
+	std::vector<RayHit> batchHits(PICKING_BENCHMARK_RAYS);
+	for(auto ray = 0u; ray < PICKING_BENCHMARK_RAYS; ++ray) {
+		batch[ray].Origin = rays[ray].Origin;
+		batch[ray].Direction = rays[ray].Direction;
+		batch[ray].MaxDistance = std::numeric_limits<float>::max();
+	}
+	long long singleThreadTime = 0;
+	const auto maxThreads = concurrency::GetProcessorCount();
+	for(auto threads = 1u; threads <= maxThreads; ++threads) {
+		concurrency::CurrentScheduler::Create(concurrency::SchedulerPolicy(2
+			, concurrency::MinConcurrency, threads
+			, concurrency::MaxConcurrency, threads));
+		// the first run only warms up the caches
+		IntersectRays(&batch[0], PICKING_BENCHMARK_RAYS, &batchHits[0]);
+		const auto start = std::chrono::high_resolution_clock::now();
+		IntersectRays(&batch[0], PICKING_BENCHMARK_RAYS, &batchHits[0]);
+		const auto batchTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+		concurrency::CurrentScheduler::Detach();
+
+		if(threads == 1) {
+			singleThreadTime = batchTime;
+		}
+		SLLOG(Sev_Info, Fac_Rendering, "Picking benchmark: batch on ", threads, " threads - ", perSecond(PICKING_BENCHMARK_RAYS, batchTime)
+			, " rays/s, speed-up x", float(singleThreadTime) / std::max(batchTime, 1ll));
+	}
+}
+
+void Scene::BuildBlockBvhs(std::vector<unsigned>& blockIds) const
+{
+	concurrency::reader_writer_lock::scoped_lock bvhsLock(m_BlockBvhsLock);
+	std::sort(blockIds.begin(), blockIds.end());
+	blockIds.erase(std::unique(blockIds.begin(), blockIds.end()), blockIds.end());
+	blockIds.erase(std::remove_if(blockIds.begin(), blockIds.end(), [&](unsigned blockId) {
+		return m_BlockBvhs.find(blockId) != m_BlockBvhs.end();
+	}), blockIds.end());
+
+	std::vector<std::unique_ptr<Voxels::TriangleBvh>> bvhs(blockIds.size());
+	concurrency::parallel_for(size_t(0), blockIds.size(), [&](size_t id) {
+		const auto block = m_FinestBlocks.find(blockIds[id]);
+		assert(block != m_FinestBlocks.end() && "A ray hit a block that isn't in the surface!");
+		bvhs[id].reset(new Voxels::TriangleBvh(*block->second));
+	});
+	for(auto id = 0u; id < blockIds.size(); ++id) {
+		m_BlockBvhs[blockIds[id]] = std::move(bvhs[id]);
+	}
+}
+
+const Voxels::TriangleBvh& Scene::GetBlockBvh(unsigned blockId) const
+{
+	{
+		concurrency::reader_writer_lock::scoped_lock_read bvhsLock(m_BlockBvhsLock);
+		const auto bvh = m_BlockBvhs.find(blockId);
+		if(bvh != m_BlockBvhs.end())
+			return *bvh->second;
+	}
+
+	// another thread might have built it since the lookup
+	concurrency::reader_writer_lock::scoped_lock bvhsLock(m_BlockBvhsLock);
+	auto& bvh = m_BlockBvhs[blockId];
+	if(!bvh) {
+		const auto block = m_FinestBlocks.find(blockId);
+		assert(block != m_FinestBlocks.end() && "A ray hit a block that isn't in the surface!");
+		bvh.reset(new Voxels::TriangleBvh(*block->second));
+	}
+	return *bvh;
+}
+
+void Scene::InvalidateBlockBvhs(const Voxels::float3pair* modified)
+{
+	concurrency::reader_writer_lock::scoped_lock bvhsLock(m_BlockBvhsLock);
+	if(!modified) {
+		m_BlockBvhs.clear();
+		return;
+	}
+
+	// The grid works with Z up and the polygons with Y up so swap. The blocks next to
+	// the box read the modified voxels on their borders so they are recalculated too
+	const XMFLOAT3 boxMin(modified->first.x, modified->first.z, modified->first.y);
+	const XMFLOAT3 boxMax(modified->second.x, modified->second.z, modified->second.y);
+	for(auto bvh = m_BlockBvhs.begin(); bvh != m_BlockBvhs.end();) {
+		const auto block = m_FinestBlocks.find(bvh->first);
+		auto isValid = block != m_FinestBlocks.end() && block->second == bvh->second->GetBlock();
+		if(isValid) {
+			const auto minCorner = block->second->GetMinimalCorner();
+			const auto maxCorner = block->second->GetMaximalCorner();
+			// the margin is a whole block on each side
+			const auto marginX = maxCorner.x - minCorner.x;
+			const auto marginY = maxCorner.y - minCorner.y;
+			const auto marginZ = maxCorner.z - minCorner.z;
+			isValid = minCorner.x > boxMax.x + marginX || maxCorner.x < boxMin.x - marginX
+				|| minCorner.y > boxMax.y + marginY || maxCorner.y < boxMin.y - marginY
+				|| minCorner.z > boxMax.z + marginZ || maxCorner.z < boxMin.z - marginZ;
+		}
+
+		if(isValid) {
+			++bvh;
+		} else {
+			bvh = m_BlockBvhs.erase(bvh);
+		}
+	}
 }
 
 const MaterialTable& Scene::GetMaterials() const {
@@ -271,6 +664,9 @@ void Scene::DestroySurface()
 		m_PolygonSurface->Destroy();
 		m_PolygonSurface = nullptr;
 	}
+	m_FinestBlocks.clear();
+	concurrency::reader_writer_lock::scoped_lock bvhsLock(m_BlockBvhsLock);
+	m_BlockBvhs.clear();
 }
 
 Scene::~Scene()
@@ -10,6 +10,7 @@
 
 #include "MaterialTable.h"
 #include "Voxel/VoxelLodOctree.h"
+#include "Voxel/TriangleBvh.h"
 
 class AllocatorBase;
 
@@ -28,6 +29,26 @@ public:
 		SSU_Box
 	};
 
+	// A ray of IntersectRays - in un-transformed grid coordinates like the points of Intersect.
+	// The direction doesn't have to be normalized - the distances are in grid units
+	struct Ray
+	{
+		DirectX::XMFLOAT3 Origin;
+		DirectX::XMFLOAT3 Direction;
+		float MaxDistance;
+	};
+
+	// The nearest hit of a ray. The distance is along the normalized direction and the normal
+	// of the triangle that was hit faces the origin of the ray. Only Hit is set on a miss
+	struct RayHit
+	{
+		bool Hit;
+		float Distance;
+		DirectX::XMFLOAT3 Position;
+		DirectX::XMFLOAT3 Normal;
+		unsigned BlockId;
+	};
+
 	Scene(const std::string& filename /*leave empty to generate*/
 		, unsigned gridSize
 		, const std::string& materialTable
@@ -43,10 +64,27 @@ public:
 	void DestroySurface();
 	SceneGridType* GetVoxelGrid() const { return m_Grid; }
 
+	// The nearest point of the surface on the ray. The blocks are visited near to far until the
+	// next one starts after the nearest hit and their triangles are tested with a BVH per block.
+	// Can be called from several threads at once, also together with IntersectRays.
+	// NB: MUST NOT be called while the grid is recalculated
 	bool Intersect(DirectX::FXMVECTOR start,
 		DirectX::FXMVECTOR end,
 		DirectX::XMVECTOR& intersection) const;
 
+	// The nearest hits of many rays at once - for line of sight and occlusion queries. The rays are
+	// sorted by the first block they reach and traced in parallel so that the neighbouring rays
+	// on a thread test the same triangles. The BVHs of all the blocks on the rays are built first.
+	// Can be called from several threads at once, also together with Intersect.
+	// NB: MUST NOT be called while the grid is recalculated
+	void IntersectRays(const Ray* rays, unsigned raysCnt, RayHit* hits) const;
+
+	// Measures the ray-triangle tests of the picking BVHs - the packet and the scalar kernel
+	// on the same rays, with and without the trees - and IntersectRays on 1 to N threads.
+	// Results are in the log
+	void RunPickingBenchmark() const;
+
+	// Also saves the LOD octree cache next to the grid file
 	bool SaveVoxelGrid(const std::string& filename);
 
 	const DirectX::XMFLOAT4X4& GetGridWorldMatrix() const { return m_GridWorld; }
@@ -55,12 +93,38 @@ public:
 
 	Voxels::VoxelLodOctree& GetLodOctree() const { return *m_LodOctree; }
 
+	// True if the grid was made from a heightmap - it's a 2.5D terrain
+	bool IsHeightmapTerrain() const { return m_IsHeightmapTerrain; }
+
 private:
+	// The LOD octree is cached in a file next to the grid file. The cache is
+	// keyed by the contents of the grid and the block layout of the surface
+	unsigned long long GetLodCacheKey() const;
+	bool LoadLodOctreeCache();
+	void SaveLodOctreeCache();
+	// The triangle BVH of a finest block - built the first time it's needed. The BVH stays
+	// valid after the lock is released - only recalculating the grid drops BVHs
+	const Voxels::TriangleBvh& GetBlockBvh(unsigned blockId) const;
+	// Builds in parallel the BVHs of the blocks that don't have one yet
+	void BuildBlockBvhs(std::vector<unsigned>& blockIds) const;
+	// Drops the BVHs of the blocks that were recalculated - all of them if modified is null
+	void InvalidateBlockBvhs(const Voxels::float3pair* modified);
+
 	SceneGridType* m_Grid;
 	std::unique_ptr<Voxels::VoxelSurface> m_Surface;
 	std::unique_ptr<VoxelAlgorithm> m_Polygonizer;
 	Voxels::PolygonSurface* m_PolygonSurface;
 	std::unique_ptr<Voxels::VoxelLodOctree> m_LodOctree;
+	// the blocks of the finest LOD level by id - the octree queries return ids
+	std::unordered_map<unsigned, const Voxels::BlockPolygons*> m_FinestBlocks;
+	// the triangle BVHs of the finest blocks that rays reached so far by block id
+	mutable std::unordered_map<unsigned, std::unique_ptr<Voxels::TriangleBvh>> m_BlockBvhs;
+	// BVHs are added under the writer lock and the rays are traced under the reader lock
+	mutable concurrency::reader_writer_lock m_BlockBvhsLock;
+	// empty if the grid isn't the same as the one in a grid file
+	std::string m_LodCacheFile;
+	unsigned long long m_GridHash;
+	bool m_IsHeightmapTerrain;
 	MaterialTable m_Materials;
 
 	DirectX::XMFLOAT3 m_Scale;
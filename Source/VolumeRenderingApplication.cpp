@@ -312,7 +312,7 @@ bool VolumeRenderingApplication::Initiate(char* className, char* windowName, uns
 	renderer->AddRoutine(m_ClearRoutine.get());
 
 	m_DrawRoutine.reset(new DrawRoutine());
-	ReturnUnless(m_DrawRoutine->Initialize(renderer, GetMainCamera(), GetProjection(), m_Scene.get()), false);
+	ReturnUnless(m_DrawRoutine->Initialize(renderer, GetMainCamera(), GetProjection(), GetHeight(), m_Scene.get()), false);
 	renderer->AddRoutine(m_DrawRoutine.get());
 
 	m_PresentRoutine.reset(new PresentRoutine());
@@ -324,6 +324,10 @@ bool VolumeRenderingApplication::Initiate(char* className, char* windowName, uns
 
 void VolumeRenderingApplication::Update(float delta)
 {
+	// the window might have been resized
+	if(m_DrawRoutine) {
+		m_DrawRoutine->SetProjection(GetProjection(), GetHeight());
+	}
 }
 
 void VolumeRenderingApplication::KeyDown(unsigned int key)
@@ -359,6 +363,17 @@ void VolumeRenderingApplication::KeyDown(unsigned int key)
 	case VK_F2:
 		m_Scene->SaveVoxelGrid("output.grd");
 		break;
+	case VK_F3:
+		// the library memory is only known when it's tracked
+#if TRACK_MEMORY
+		m_DrawRoutine->RunCullBenchmark(&AllocatorImpl::GetCurrentMemoryUse);
+#else
+		m_DrawRoutine->RunCullBenchmark();
+#endif
+		break;
+	case VK_F4:
+		m_DrawRoutine->SetRecordCameraPath(!m_DrawRoutine->GetRecordCameraPath());
+		break;
 	case 'S':
 		m_DrawRoutine->SetDrawSolid(!m_DrawRoutine->GetDrawSolid());
 		break;
@@ -377,6 +392,33 @@ void VolumeRenderingApplication::KeyDown(unsigned int key)
 	case 'U':
 		m_DrawRoutine->SetLodUpdateEnabled(!m_DrawRoutine->GetLodUpdateEnabled());
 		break;
+	case 'C':
+		m_DrawRoutine->SetCoherentCullEnabled(!m_DrawRoutine->GetCoherentCullEnabled());
+		break;
+	case 'P':
+		m_DrawRoutine->SetParallelCullEnabled(!m_DrawRoutine->GetParallelCullEnabled());
+		break;
+	case 'E':
+		m_DrawRoutine->SetScreenSpaceLodEnabled(!m_DrawRoutine->GetScreenSpaceLodEnabled());
+		break;
+	case 'O':
+		m_DrawRoutine->SetOcclusionCullEnabled(!m_DrawRoutine->GetOcclusionCullEnabled());
+		break;
+	case 'B':
+		m_DrawRoutine->SetBackFaceCullEnabled(!m_DrawRoutine->GetBackFaceCullEnabled());
+		break;
+	case 'K':
+		m_DrawRoutine->SetContributionCullEnabled(!m_DrawRoutine->GetContributionCullEnabled());
+		break;
+	case 'H':
+		m_DrawRoutine->SetHorizonCullEnabled(!m_DrawRoutine->GetHorizonCullEnabled());
+		break;
+	case 'I':
+		m_Scene->RunPickingBenchmark();
+		break;
+	case 'G':
+		m_DrawRoutine->SetBudgetedCullEnabled(!m_DrawRoutine->GetBudgetedCullEnabled());
+		break;
 	case 'R':
 		RecalculateGrid();
 		break;
@@ -0,0 +1,57 @@
+// Copyright (c) 2013-2014, Stoyan Nikolov
+// All rights reserved.
+// This sample is governed by a permissive BSD-style license. See LICENSE.
+// Note: The Voxels Library itself has a separate license. Check out it's
+// website for more information
+#include "stdafx.h"
+#include "LodPolicy.h"
+
+using namespace DirectX;
+
+namespace Voxels
+{
+
+// A node N drawn with keep coefficient K and a twice smaller neighbour M that is not
+// drawn with settle coefficient S (so it's children are) can't exist if K >= S / 2 + 3 / 4,
+// because their centers are at most 3 / 4 of N's extent apart. The smallest coefficient
+// known to work without hysteresis is 1.6875 - the same margin is kept with it
+static const float MIN_SETTLE_COEFF = 1.6875f;
+static const float MAX_HYSTERESIS = 0.4f;
+
+DistanceLodPolicy::DistanceLodPolicy(float settleCoeff, float hysteresis)
+{
+	SetCoefficients(settleCoeff, hysteresis);
+}
+
+void DistanceLodPolicy::SetCoefficients(float settleCoeff, float hysteresis)
+{
+	assert(hysteresis >= 0 && hysteresis <= MAX_HYSTERESIS && "Invalid LOD hysteresis!");
+	hysteresis = std::min(std::max(hysteresis, 0.f), MAX_HYSTERESIS);
+
+	// K = S * (1 - h) >= S / 2 + MIN / 2
+	m_SettleCoeff = std::max(settleCoeff, MIN_SETTLE_COEFF / (1 - 2 * hysteresis));
+	m_KeepCoeff = m_SettleCoeff * (1 - hysteresis);
+}
+
+float DistanceLodPolicy::GetSettleMargin(const XMFLOAT3& nodeCenter, float nodeExtent, const XMFLOAT3& cameraPosition, bool wasSettled) const
+{
+	const auto chebishevDistance = std::max(std::max(std::abs(nodeCenter.x - cameraPosition.x)
+		, std::abs(nodeCenter.y - cameraPosition.y))
+		, std::abs(nodeCenter.z - cameraPosition.z));
+
+	return chebishevDistance - nodeExtent * (wasSettled ? m_KeepCoeff : m_SettleCoeff);
+}
+
+ScreenSpaceErrorLodPolicy::ScreenSpaceErrorLodPolicy(float projectionScale, float viewportHeight, float pixelBudget, float errorFactor, float hysteresis)
+{
+	assert(pixelBudget > 0 && "Invalid LOD pixel budget!");
+
+	// An error e at distance d covers e * projectionScale * viewportHeight / (2 * d) pixels. The
+	// chebishev distance to the node's cube is never more than the real one so the error is
+	// over-estimated if anything. The node is within budget when the distance to it's center is
+	// at least (errorFactor * projectionScale * viewportHeight / (2 * pixelBudget) + 1 / 2) * extent
+	const auto cubeDistanceCoeff = errorFactor * projectionScale * viewportHeight / (2 * std::max(pixelBudget, 1e-3f));
+	SetCoefficients(cubeDistanceCoeff + 0.5f, hysteresis);
+}
+
+}
@@ -0,0 +1,58 @@
+// Copyright (c) 2013-2014, Stoyan Nikolov
+// All rights reserved.
+// This sample is governed by a permissive BSD-style license. See LICENSE.
+// Note: The Voxels Library itself has a separate license. Check out it's
+// website for more information
+#pragma once
+
+namespace Voxels
+{
+
+// Decides if a node of the LOD octree is detailed enough to be drawn instead of it's children
+class LodPolicy
+{
+public:
+	virtual ~LodPolicy() {}
+
+	// Returns by how much the camera is further (>= 0) or nearer (< 0) than the distance at which
+	// the node can be drawn instead of it's children. wasSettled tells if the node was drawn the
+	// last time it was examined so that the decision can have some hysteresis.
+	// NB: The margin must not change more than the camera moves - the coherent Cull relies on it
+	virtual float GetSettleMargin(const DirectX::XMFLOAT3& nodeCenter, float nodeExtent, const DirectX::XMFLOAT3& cameraPosition, bool wasSettled) const = 0;
+};
+
+// Draws a node if the chebishev distance between the camera and it's center is at least
+// settleCoeff times it's extent. Nodes already drawn are kept until the camera gets
+// closer than (1 - hysteresis) times that.
+// NB: The coefficients are raised if needed so that neighbouring nodes are never more than
+// one LOD level apart. Without hysteresis this means settleCoeff >= 1.6875
+class DistanceLodPolicy : public LodPolicy
+{
+public:
+	explicit DistanceLodPolicy(float settleCoeff = 2.0f, float hysteresis = 0.0f);
+
+	virtual float GetSettleMargin(const DirectX::XMFLOAT3& nodeCenter, float nodeExtent, const DirectX::XMFLOAT3& cameraPosition, bool wasSettled) const override;
+
+	float GetSettleCoeff() const { return m_SettleCoeff; }
+	float GetKeepCoeff() const { return m_KeepCoeff; }
+
+protected:
+	void SetCoefficients(float settleCoeff, float hysteresis);
+
+private:
+	float m_SettleCoeff;
+	float m_KeepCoeff;
+};
+
+// Draws a node if it's geometric error projected on the screen is within a budget of pixels.
+// The error of a node is errorFactor times it's extent and it's projected with the distance
+// between the camera and the node's cube, so the policy comes down to a distance coefficient
+// that depends on the field of view and the resolution.
+class ScreenSpaceErrorLodPolicy : public DistanceLodPolicy
+{
+public:
+	// projectionScale is the vertical scale of the projection matrix - cot(fovY / 2)
+	ScreenSpaceErrorLodPolicy(float projectionScale, float viewportHeight, float pixelBudget, float errorFactor, float hysteresis);
+};
+
+}
@@ -0,0 +1,358 @@
+// Copyright (c) 2013-2014, Stoyan Nikolov
+// All rights reserved.
+// This sample is governed by a permissive BSD-style license. See LICENSE.
+// Note: The Voxels Library itself has a separate license. Check out it's
+// website for more information
+#include "stdafx.h"
+#include "OcclusionCuller.h"
+
+#include <chrono>
+
+using namespace DirectX;
+
+namespace Voxels
+{
+
+// The tiles are rasterized in parallel. The width is a multiple of 4 so that each row
+// of a tile is done 4 pixels at a time
+static const unsigned TILE_WIDTH = 32;
+static const unsigned TILE_HEIGHT = 16;
+static const unsigned TILE_PIXELS = TILE_WIDTH * TILE_HEIGHT;
+// Triangles with a vertex that close to the eye or behind it are not rasterized and
+// boxes with such a corner are never occluded
+static const float MIN_VIEW_DEPTH = 1e-3f;
+// An occluder has to be that much nearer relative to the depth than a box to hide it
+static const float DEPTH_BIAS = 1e-3f;
+
+// Converts a coordinate to a pixel clamped just outside the buffer - vertices near the eye
+// project very far away and must not overflow
+inline int ToPixel(float coordinate, unsigned size)
+{
+	return int(std::min(std::max(coordinate, -1.f), float(size)));
+}
+
+OcclusionCuller::OcclusionCuller(unsigned width, unsigned height, unsigned triangleBudget)
+	: m_TilesX((width + TILE_WIDTH - 1) / TILE_WIDTH)
+	, m_TilesY((height + TILE_HEIGHT - 1) / TILE_HEIGHT)
+	, m_TriangleBudget(triangleBudget)
+{
+	m_Width = m_TilesX * TILE_WIDTH;
+	m_Height = m_TilesY * TILE_HEIGHT;
+
+	m_Depth.resize(m_Width * m_Height);
+	m_TileFarthest.resize(m_TilesX * m_TilesY);
+	m_TileTriangles.resize(m_TilesX * m_TilesY);
+}
+
+void OcclusionCuller::SetSurface(const PolygonSurface& surface)
+{
+	m_Blocks.clear();
+	const auto levelsCount = surface.GetLevelsCount();
+	for(auto lodLevel = 0u; lodLevel < levelsCount; ++lodLevel) {
+		const auto blocksCnt = surface.GetBlocksForLevelCount(lodLevel);
+		for(auto bit = 0u; bit < blocksCnt; ++bit) {
+			const auto block = surface.GetBlockForLevel(lodLevel, bit);
+			const auto minCorner = block->GetMinimalCorner();
+			const auto maxCorner = block->GetMaximalCorner();
+
+			BlockEntry entry;
+			entry.Block = block;
+			entry.MinCorner = XMFLOAT3(minCorner.x, minCorner.y, minCorner.z);
+			entry.MaxCorner = XMFLOAT3(maxCorner.x, maxCorner.y, maxCorner.z);
+			m_Blocks.insert(std::make_pair(block->GetId(), entry));
+		}
+	}
+}
+
+void OcclusionCuller::Cull(const XMFLOAT4X4& viewProjection
+	, const XMFLOAT3& cameraPosition
+	, const VoxelLodOctree::VisibleBlocksVec& candidates
+	, VoxelLodOctree::VisibleBlocksVec& output)
+{
+	const auto start = std::chrono::high_resolution_clock::now();
+
+	m_Statistics = Statistics();
+	m_Statistics.CandidatesCount = unsigned(candidates.size());
+	output.clear();
+
+	// the nearest candidates are the best occluders
+	const auto camera = XMLoadFloat3(&cameraPosition);
+	const auto candidatesCnt = unsigned(candidates.size());
+	m_Candidates.resize(candidatesCnt);
+	m_CandidateOrder.resize(candidatesCnt);
+	for(auto id = 0u; id < candidatesCnt; ++id) {
+		const auto entry = m_Blocks.find(candidates[id].Id);
+		assert(entry != m_Blocks.end() && "The surface of the occlusion culler is out of date!");
+		const auto nearest = XMVectorClamp(camera, XMLoadFloat3(&entry->second.MinCorner), XMLoadFloat3(&entry->second.MaxCorner));
+		m_Candidates[id].Entry = &entry->second;
+		m_Candidates[id].DistanceSq = XMVectorGetX(XMVector3LengthSq(nearest - camera));
+		m_CandidateOrder[id] = id;
+	}
+	std::sort(m_CandidateOrder.begin(), m_CandidateOrder.end(), [&](unsigned lhs, unsigned rhs) {
+		return m_Candidates[lhs].DistanceSq < m_Candidates[rhs].DistanceSq;
+	});
+
+	// take occluders until the triangle budget runs out
+	m_Occluders.clear();
+	auto verticesCnt = 0u;
+	auto trianglesCnt = 0u;
+	for(auto order = 0u; order < candidatesCnt; ++order) {
+		const auto block = m_Candidates[m_CandidateOrder[order]].Entry->Block;
+		unsigned blockVertices = 0;
+		unsigned blockIndices = 0;
+		block->GetVertices(&blockVertices);
+		block->GetIndices(&blockIndices);
+		if(!blockIndices)
+			continue;
+		if(trianglesCnt + blockIndices / 3 > m_TriangleBudget)
+			break;
+
+		Occluder occluder = { block, verticesCnt, trianglesCnt };
+		m_Occluders.push_back(occluder);
+		verticesCnt += blockVertices;
+		trianglesCnt += blockIndices / 3;
+	}
+	m_Statistics.OccludersCount = unsigned(m_Occluders.size());
+	m_Statistics.OccluderTrianglesCount = trianglesCnt;
+
+	// every occluder writes only it's own vertices and triangles
+	m_Vertices.resize(verticesCnt);
+	m_Triangles.resize(trianglesCnt);
+	concurrency::parallel_for(size_t(0), m_Occluders.size(), [&](size_t occluder) {
+		TransformOccluder(viewProjection, m_Occluders[occluder]);
+	});
+
+	// bin the triangles in the tiles they overlap and rasterize each tile on it's own
+	std::for_each(m_TileTriangles.begin(), m_TileTriangles.end(), [](std::vector<unsigned>& triangles) {
+		triangles.clear();
+	});
+	for(auto id = 0u; id < trianglesCnt; ++id) {
+		const auto& triangle = m_Triangles[id];
+		if(triangle.MinX > triangle.MaxX || triangle.MinY > triangle.MaxY)
+			continue;
+		for(auto tileY = triangle.MinY / TILE_HEIGHT; tileY <= triangle.MaxY / TILE_HEIGHT; ++tileY) {
+			for(auto tileX = triangle.MinX / TILE_WIDTH; tileX <= triangle.MaxX / TILE_WIDTH; ++tileX) {
+				m_TileTriangles[tileY * m_TilesX + tileX].push_back(id);
+			}
+		}
+	}
+	concurrency::parallel_for(0u, m_TilesX * m_TilesY, [&](unsigned tile) {
+		RasterizeTile(tile);
+	});
+
+	const auto rasterized = std::chrono::high_resolution_clock::now();
+
+	m_Occluded.resize(candidatesCnt);
+	concurrency::parallel_for(0u, candidatesCnt, [&](unsigned id) {
+		m_Occluded[id] = IsOccluded(viewProjection, *m_Candidates[id].Entry);
+	});
+	for(auto id = 0u; id < candidatesCnt; ++id) {
+		if(m_Occluded[id]) {
+			++m_Statistics.OccludedCount;
+		} else {
+			output.push_back(candidates[id]);
+		}
+	}
+
+	const auto end = std::chrono::high_resolution_clock::now();
+	m_Statistics.RasterizationTime = std::chrono::duration_cast<std::chrono::microseconds>(rasterized - start).count();
+	m_Statistics.TestTime = std::chrono::duration_cast<std::chrono::microseconds>(end - rasterized).count();
+}
+
+void OcclusionCuller::TransformOccluder(const XMFLOAT4X4& viewProjection, const Occluder& occluder)
+{
+	const auto matrix = XMLoadFloat4x4(&viewProjection);
+	const auto halfWidth = m_Width * 0.5f;
+	const auto halfHeight = m_Height * 0.5f;
+
+	unsigned verticesCnt = 0;
+	const auto vertices = occluder.Block->GetVertices(&verticesCnt);
+	auto screenVertex = &m_Vertices[occluder.FirstVertex];
+	for(auto id = 0u; id < verticesCnt; ++id, ++screenVertex) {
+		XMFLOAT4 clip;
+		XMStoreFloat4(&clip, XMVector3Transform(XMLoadFloat3(reinterpret_cast<const XMFLOAT3*>(&vertices[id].Position)), matrix));
+		// a negative inverse depth marks the vertices too close to rasterize
+		if(clip.w < MIN_VIEW_DEPTH) {
+			screenVertex->InvW = -1;
+			continue;
+		}
+		const auto invW = 1.f / clip.w;
+		screenVertex->X = (clip.x * invW + 1) * halfWidth;
+		screenVertex->Y = (clip.y * invW + 1) * halfHeight;
+		screenVertex->InvW = invW;
+	}
+
+	unsigned indicesCnt = 0;
+	const auto indices = occluder.Block->GetIndices(&indicesCnt);
+	const auto blockVertices = &m_Vertices[occluder.FirstVertex];
+	auto triangle = &m_Triangles[occluder.FirstTriangle];
+	for(auto index = 0u; index + 2 < indicesCnt; index += 3, ++triangle) {
+		triangle->MinX = triangle->MinY = 0;
+		triangle->MaxX = triangle->MaxY = -1;
+
+		auto& v0 = triangle->Vertices[0];
+		auto& v1 = triangle->Vertices[1];
+		auto& v2 = triangle->Vertices[2];
+		v0 = blockVertices[indices[index]];
+		v1 = blockVertices[indices[index + 1]];
+		v2 = blockVertices[indices[index + 2]];
+		if(v0.InvW < 0 || v1.InvW < 0 || v2.InvW < 0)
+			continue;
+
+		// both windings occlude - make them all counter-clockwise
+		const auto area = (v1.X - v0.X) * (v2.Y - v0.Y) - (v2.X - v0.X) * (v1.Y - v0.Y);
+		if(area == 0)
+			continue;
+		if(area < 0) {
+			std::swap(v1, v2);
+		}
+
+		// the pixels whose centers might be in the triangle
+		triangle->MinX = std::max(ToPixel(std::ceil(std::min(v0.X, std::min(v1.X, v2.X)) - 0.5f), m_Width), 0);
+		triangle->MaxX = std::min(ToPixel(std::floor(std::max(v0.X, std::max(v1.X, v2.X)) - 0.5f), m_Width), int(m_Width) - 1);
+		triangle->MinY = std::max(ToPixel(std::ceil(std::min(v0.Y, std::min(v1.Y, v2.Y)) - 0.5f), m_Height), 0);
+		triangle->MaxY = std::min(ToPixel(std::floor(std::max(v0.Y, std::max(v1.Y, v2.Y)) - 0.5f), m_Height), int(m_Height) - 1);
+	}
+}
+
+void OcclusionCuller::RasterizeTile(unsigned tile)
+{
+	const auto tileX = int((tile % m_TilesX) * TILE_WIDTH);
+	const auto tileY = int((tile / m_TilesX) * TILE_HEIGHT);
+	float* depth = &m_Depth[tile * TILE_PIXELS];
+	std::fill(depth, depth + TILE_PIXELS, 0.f);
+
+	const auto zero = XMVectorZero();
+	const auto pixelStep = XMVectorReplicate(4.f);
+	const auto& triangles = m_TileTriangles[tile];
+	std::for_each(triangles.cbegin(), triangles.cend(), [&](unsigned id) {
+		const auto& triangle = m_Triangles[id];
+		const auto& v0 = triangle.Vertices[0];
+		const auto& v1 = triangle.Vertices[1];
+		const auto& v2 = triangle.Vertices[2];
+
+		// The edge functions are a * x + b * y + c and are positive inside.
+		// The inverse depth is a plane on the screen
+		const float a[3] = { v0.Y - v1.Y, v1.Y - v2.Y, v2.Y - v0.Y };
+		const float b[3] = { v1.X - v0.X, v2.X - v1.X, v0.X - v2.X };
+		const float c[3] = { -b[0] * v0.Y - a[0] * v0.X, -b[1] * v1.Y - a[1] * v1.X, -b[2] * v2.Y - a[2] * v2.X };
+
+		const auto dx1 = v1.X - v0.X;
+		const auto dy1 = v1.Y - v0.Y;
+		const auto dx2 = v2.X - v0.X;
+		const auto dy2 = v2.Y - v0.Y;
+		const auto dz1 = v1.InvW - v0.InvW;
+		const auto dz2 = v2.InvW - v0.InvW;
+		const auto area = dx1 * dy2 - dx2 * dy1;
+		const auto depthX = (dz1 * dy2 - dz2 * dy1) / area;
+		const auto depthY = (dx1 * dz2 - dx2 * dz1) / area;
+		const auto depthC = v0.InvW - depthX * v0.X - depthY * v0.Y;
+
+		const XMVECTOR edgeA[3] = { XMVectorReplicate(a[0]), XMVectorReplicate(a[1]), XMVectorReplicate(a[2]) };
+		const auto depthA = XMVectorReplicate(depthX);
+
+		// the rows start at a multiple of 4 pixels in the tile
+		const auto minX = std::max(triangle.MinX, tileX) & ~3;
+		const auto maxX = std::min(triangle.MaxX, tileX + int(TILE_WIDTH) - 1);
+		const auto minY = std::max(triangle.MinY, tileY);
+		const auto maxY = std::min(triangle.MaxY, tileY + int(TILE_HEIGHT) - 1);
+		for(auto y = minY; y <= maxY; ++y) {
+			const auto centerY = y + 0.5f;
+			const XMVECTOR rowEdge[3] = {
+				XMVectorReplicate(b[0] * centerY + c[0]),
+				XMVectorReplicate(b[1] * centerY + c[1]),
+				XMVectorReplicate(b[2] * centerY + c[2])
+			};
+			const auto rowDepth = XMVectorReplicate(depthY * centerY + depthC);
+
+			float* row = depth + (y - tileY) * TILE_WIDTH - tileX;
+			auto centerX = XMVectorSet(minX + 0.5f, minX + 1.5f, minX + 2.5f, minX + 3.5f);
+			for(auto x = minX; x <= maxX; x += 4, centerX += pixelStep) {
+				auto inside = XMVectorGreaterOrEqual(XMVectorMultiplyAdd(edgeA[0], centerX, rowEdge[0]), zero);
+				inside = XMVectorAndInt(inside, XMVectorGreaterOrEqual(XMVectorMultiplyAdd(edgeA[1], centerX, rowEdge[1]), zero));
+				inside = XMVectorAndInt(inside, XMVectorGreaterOrEqual(XMVectorMultiplyAdd(edgeA[2], centerX, rowEdge[2]), zero));
+
+				auto pixels = reinterpret_cast<XMFLOAT4*>(row + x);
+				const auto current = XMLoadFloat4(pixels);
+				const auto triangleDepth = XMVectorMultiplyAdd(depthA, centerX, rowDepth);
+				XMStoreFloat4(pixels, XMVectorSelect(current, XMVectorMax(current, triangleDepth), inside));
+			}
+		}
+	});
+
+	// the farthest occluder in the tile lets whole tiles be tested at once
+	auto farthest = XMVectorReplicate(std::numeric_limits<float>::max());
+	for(auto pixel = 0u; pixel < TILE_PIXELS; pixel += 4) {
+		farthest = XMVectorMin(farthest, XMLoadFloat4(reinterpret_cast<const XMFLOAT4*>(depth + pixel)));
+	}
+	XMFLOAT4 lanes;
+	XMStoreFloat4(&lanes, farthest);
+	m_TileFarthest[tile] = std::min(std::min(lanes.x, lanes.y), std::min(lanes.z, lanes.w));
+}
+
+bool OcclusionCuller::IsOccluded(const XMFLOAT4X4& viewProjection, const BlockEntry& entry) const
+{
+	const auto matrix = XMLoadFloat4x4(&viewProjection);
+	const auto halfWidth = m_Width * 0.5f;
+	const auto halfHeight = m_Height * 0.5f;
+
+	// the screen rectangle of the box and the depth of it's nearest corner
+	auto minX = std::numeric_limits<float>::max();
+	auto minY = std::numeric_limits<float>::max();
+	auto maxX = -std::numeric_limits<float>::max();
+	auto maxY = -std::numeric_limits<float>::max();
+	auto nearest = 0.f;
+	for(auto corner = 0u; corner < 8; ++corner) {
+		const auto position = XMVectorSet((corner & 4) ? entry.MaxCorner.x : entry.MinCorner.x
+			, (corner & 2) ? entry.MaxCorner.y : entry.MinCorner.y
+			, (corner & 1) ? entry.MaxCorner.z : entry.MinCorner.z
+			, 1);
+		XMFLOAT4 clip;
+		XMStoreFloat4(&clip, XMVector4Transform(position, matrix));
+		if(clip.w < MIN_VIEW_DEPTH)
+			return false;
+
+		const auto invW = 1.f / clip.w;
+		const auto x = (clip.x * invW + 1) * halfWidth;
+		const auto y = (clip.y * invW + 1) * halfHeight;
+		minX = std::min(minX, x);
+		maxX = std::max(maxX, x);
+		minY = std::min(minY, y);
+		maxY = std::max(maxY, y);
+		nearest = std::max(nearest, invW);
+	}
+
+	// every pixel the rectangle touches must have a nearer occluder
+	const auto rectMinX = std::max(ToPixel(std::floor(minX), m_Width), 0);
+	const auto rectMaxX = std::min(ToPixel(std::floor(maxX), m_Width), int(m_Width) - 1);
+	const auto rectMinY = std::max(ToPixel(std::floor(minY), m_Height), 0);
+	const auto rectMaxY = std::min(ToPixel(std::floor(maxY), m_Height), int(m_Height) - 1);
+	if(rectMinX > rectMaxX || rectMinY > rectMaxY)
+		return false;
+
+	const auto hiddenDepth = nearest * (1 + DEPTH_BIAS);
+	for(auto tileY = unsigned(rectMinY) / TILE_HEIGHT; tileY <= unsigned(rectMaxY) / TILE_HEIGHT; ++tileY) {
+		for(auto tileX = unsigned(rectMinX) / TILE_WIDTH; tileX <= unsigned(rectMaxX) / TILE_WIDTH; ++tileX) {
+			const auto tile = tileY * m_TilesX + tileX;
+			if(m_TileFarthest[tile] > hiddenDepth)
+				continue;
+
+			const float* depth = &m_Depth[tile * TILE_PIXELS];
+			const auto startX = std::max(rectMinX, int(tileX * TILE_WIDTH));
+			const auto endX = std::min(rectMaxX, int(tileX * TILE_WIDTH + TILE_WIDTH - 1));
+			const auto startY = std::max(rectMinY, int(tileY * TILE_HEIGHT));
+			const auto endY = std::min(rectMaxY, int(tileY * TILE_HEIGHT + TILE_HEIGHT - 1));
+			for(auto y = startY; y <= endY; ++y) {
+				const float* row = depth + (y - tileY * TILE_HEIGHT) * TILE_WIDTH - tileX * TILE_WIDTH;
+				for(auto x = startX; x <= endX; ++x) {
+					if(row[x] <= hiddenDepth)
+						return false;
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+}
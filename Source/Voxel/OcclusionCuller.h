@@ -0,0 +1,133 @@
+// Copyright (c) 2013-2014, Stoyan Nikolov
+// All rights reserved.
+// This sample is governed by a permissive BSD-style license. See LICENSE.
+// Note: The Voxels Library itself has a separate license. Check out it's
+// website for more information
+#pragma once
+
+#include "VoxelLodOctree.h"
+
+namespace Voxels
+{
+
+// Drops the blocks hidden behind other blocks from the output of a Cull. The meshes of the
+// nearest visible blocks are rasterized as occluders in a small tiled depth buffer on the CPU
+// and the bounds of every block are tested against it.
+// A block never occludes itself - it's triangles are all behind the nearest point of it's box.
+// NB: Needs no device - everything is in un-transformed grid coordinates like in the octree
+class OcclusionCuller
+{
+public:
+	// Data collected during the last Cull
+	struct Statistics
+	{
+		Statistics()
+			: CandidatesCount(0)
+			, OccludedCount(0)
+			, OccludersCount(0)
+			, OccluderTrianglesCount(0)
+			, RasterizationTime(0)
+			, TestTime(0)
+		{}
+
+		float GetOccludedFraction() const { return CandidatesCount ? float(OccludedCount) / CandidatesCount : 0.f; }
+
+		unsigned CandidatesCount;
+		unsigned OccludedCount;
+		unsigned OccludersCount;
+		unsigned OccluderTrianglesCount;
+		// in microseconds
+		long long RasterizationTime;
+		long long TestTime;
+	};
+
+	// The depth buffer is rounded up to whole tiles. At most triangleBudget triangles
+	// are rasterized each Cull - the nearest blocks come first
+	OcclusionCuller(unsigned width = 256, unsigned height = 128, unsigned triangleBudget = 32768);
+
+	// Takes the blocks of the surface - has to be called again every time the surface changes
+	void SetSurface(const PolygonSurface& surface);
+
+	// Writes in the output the candidates that aren't occluded in the same order.
+	// The view-projection matrix MUST take un-transformed grid coordinates to clip space
+	// and the camera position MUST be in un-transformed grid coordinates
+	void Cull(const DirectX::XMFLOAT4X4& viewProjection
+		, const DirectX::XMFLOAT3& cameraPosition
+		, const VoxelLodOctree::VisibleBlocksVec& candidates
+		, VoxelLodOctree::VisibleBlocksVec& output);
+
+	const Statistics& GetLastStatistics() const { return m_Statistics; }
+
+private:
+	struct BlockEntry
+	{
+		const BlockPolygons* Block;
+		DirectX::XMFLOAT3 MinCorner;
+		DirectX::XMFLOAT3 MaxCorner;
+	};
+	typedef std::unordered_map<unsigned, BlockEntry> BlocksMap;
+
+	// A candidate block and the squared distance from the camera to it's box
+	struct Candidate
+	{
+		const BlockEntry* Entry;
+		float DistanceSq;
+	};
+
+	// An occluder block and where it's vertices and triangles start in the frame arrays
+	struct Occluder
+	{
+		const BlockPolygons* Block;
+		unsigned FirstVertex;
+		unsigned FirstTriangle;
+	};
+
+	// A vertex in pixels with the inverse of it's view depth - it's linear on the screen
+	struct ScreenVertex
+	{
+		float X;
+		float Y;
+		float InvW;
+	};
+
+	// A triangle in the depth buffer and the pixels it might cover. Empty if it's not rasterized
+	struct ScreenTriangle
+	{
+		ScreenVertex Vertices[3];
+		int MinX;
+		int MaxX;
+		int MinY;
+		int MaxY;
+	};
+
+	void TransformOccluder(const DirectX::XMFLOAT4X4& viewProjection, const Occluder& occluder);
+	void RasterizeTile(unsigned tile);
+	bool IsOccluded(const DirectX::XMFLOAT4X4& viewProjection, const BlockEntry& entry) const;
+
+	unsigned m_Width;
+	unsigned m_Height;
+	unsigned m_TilesX;
+	unsigned m_TilesY;
+	unsigned m_TriangleBudget;
+
+	BlocksMap m_Blocks;
+
+	// the working memory of a Cull - kept between Culls
+	std::vector<Candidate> m_Candidates;
+	std::vector<unsigned> m_CandidateOrder;
+	std::vector<Occluder> m_Occluders;
+	std::vector<ScreenVertex> m_Vertices;
+	std::vector<ScreenTriangle> m_Triangles;
+	std::vector<std::vector<unsigned>> m_TileTriangles;
+	std::vector<unsigned char> m_Occluded;
+
+	// The inverse view depth of the nearest occluder in each pixel - 0 if there is none.
+	// The pixels of each tile are contiguous
+	std::vector<float> m_Depth;
+	// per tile - the smallest inverse depth in it (the farthest occluder)
+	std::vector<float> m_TileFarthest;
+
+	Statistics m_Statistics;
+};
+
+}
@@ -0,0 +1,358 @@
+// Copyright (c) 2013-2014, Stoyan Nikolov
+// All rights reserved.
+// This sample is governed by a permissive BSD-style license. See LICENSE.
+// Note: The Voxels Library itself has a separate license. Check out it's
+// website for more information
+#include "stdafx.h"
+#include "TriangleBvh.h"
+
+using namespace DirectX;
+
+namespace Voxels
+{
+
+// nodes with that many triangles or fewer aren't split - 2 packets
+static const unsigned MAX_LEAF_TRIANGLES = 2 * TriangleBvh::PACKET_SIZE;
+// the depth of a median split tree is the log of the triangles - far fewer than that
+static const unsigned TRAVERSAL_STACK_SIZE = 64;
+// rays that parallel to a triangle miss it
+static const float PARALLEL_EPSILON = 1e-12f;
+
+// Returns a bit for each component with the sign bit set
+inline unsigned GetSignMask(FXMVECTOR vec)
+{
+#if defined(_XM_SSE_INTRINSICS_)
+	return unsigned(_mm_movemask_ps(vec));
+#else
+	uint32_t components[4];
+	XMStoreInt4(components, vec);
+	return (components[0] >> 31) | ((components[1] >> 31) << 1) | ((components[2] >> 31) << 2) | ((components[3] >> 31) << 3);
+#endif
+}
+
+// The distances along the ray where it's inside of the box, limited to [0, maxDistance]
+inline bool ClipRay(const float origin[3], const float inverseDirection[3], float maxDistance, const XMFLOAT3& minCorner, const XMFLOAT3& maxCorner, float& entry)
+{
+	const float* boxMin = &minCorner.x;
+	const float* boxMax = &maxCorner.x;
+	auto tMin = 0.f;
+	auto tMax = maxDistance;
+	for(auto axis = 0u; axis < 3; ++axis) {
+		auto t0 = (boxMin[axis] - origin[axis]) * inverseDirection[axis];
+		auto t1 = (boxMax[axis] - origin[axis]) * inverseDirection[axis];
+		if(t0 > t1) {
+			std::swap(t0, t1);
+		}
+		// NB: NaN (an origin on the plane of a parallel side) leaves the range as it is
+		tMin = std::max(tMin, t0);
+		tMax = std::min(tMax, t1);
+	}
+	entry = tMin;
+	return tMin <= tMax;
+}
+
+TriangleBvh::TriangleBvh(const BlockPolygons& block)
+	: m_Block(&block)
+	, m_TrianglesCount(0)
+{
+	unsigned indicesCnt = 0;
+	const auto indices = block.GetIndices(&indicesCnt);
+	const auto vertices = block.GetVertices(nullptr);
+	const auto trianglesCnt = indicesCnt / 3;
+	if(!trianglesCnt)
+		return;
+	m_TrianglesCount = trianglesCnt;
+
+	struct Triangle
+	{
+		XMFLOAT3 Vertices[3];
+	};
+	std::vector<Triangle> triangles(trianglesCnt);
+	std::vector<XMFLOAT3> centers(trianglesCnt);
+	for(auto triangle = 0u; triangle < trianglesCnt; ++triangle) {
+		auto& output = triangles[triangle];
+		for(auto vertex = 0u; vertex < 3; ++vertex) {
+			const auto& position = vertices[indices[triangle * 3 + vertex]].Position;
+			output.Vertices[vertex] = XMFLOAT3(position.x, position.y, position.z);
+		}
+		XMStoreFloat3(&centers[triangle], (XMLoadFloat3(&output.Vertices[0]) + XMLoadFloat3(&output.Vertices[1]) + XMLoadFloat3(&output.Vertices[2])) / 3);
+	}
+
+	// The triangles are sorted in place with their centers. Each node is split when it's
+	// taken from the stack - it's children are appended so they end up next to each other.
+	// While building First and PacketsCount of the leaves are in triangles
+	std::vector<unsigned> order(trianglesCnt);
+	for(auto triangle = 0u; triangle < trianglesCnt; ++triangle) {
+		order[triangle] = triangle;
+	}
+	m_Nodes.reserve(2 * (trianglesCnt / MAX_LEAF_TRIANGLES) + 1);
+	Node root = { XMFLOAT3(), 0, XMFLOAT3(), trianglesCnt };
+	m_Nodes.push_back(root);
+
+	std::vector<unsigned> unsplitNodes(1, 0);
+	while(!unsplitNodes.empty()) {
+		const auto nodeId = unsplitNodes.back();
+		unsplitNodes.pop_back();
+		const auto first = m_Nodes[nodeId].First;
+		const auto count = m_Nodes[nodeId].PacketsCount;
+
+		auto boundsMin = XMVectorReplicate(std::numeric_limits<float>::max());
+		auto boundsMax = XMVectorReplicate(-std::numeric_limits<float>::max());
+		auto centersMin = boundsMin;
+		auto centersMax = boundsMax;
+		for(auto id = first; id < first + count; ++id) {
+			const auto& triangle = triangles[order[id]];
+			for(auto vertex = 0u; vertex < 3; ++vertex) {
+				const auto position = XMLoadFloat3(&triangle.Vertices[vertex]);
+				boundsMin = XMVectorMin(boundsMin, position);
+				boundsMax = XMVectorMax(boundsMax, position);
+			}
+			const auto center = XMLoadFloat3(&centers[order[id]]);
+			centersMin = XMVectorMin(centersMin, center);
+			centersMax = XMVectorMax(centersMax, center);
+		}
+		XMStoreFloat3(&m_Nodes[nodeId].MinCorner, boundsMin);
+		XMStoreFloat3(&m_Nodes[nodeId].MaxCorner, boundsMax);
+		if(count <= MAX_LEAF_TRIANGLES)
+			continue;
+
+		XMFLOAT3 spread;
+		XMStoreFloat3(&spread, centersMax - centersMin);
+		const auto axis = (spread.x >= spread.y && spread.x >= spread.z) ? 0u : (spread.y >= spread.z ? 1u : 2u);
+		const auto middle = order.begin() + first + count / 2;
+		std::nth_element(order.begin() + first, middle, order.begin() + first + count, [&](unsigned lhs, unsigned rhs) {
+			return (&centers[lhs].x)[axis] < (&centers[rhs].x)[axis];
+		});
+
+		const auto childId = unsigned(m_Nodes.size());
+		Node children[2] = {
+			{ XMFLOAT3(), first, XMFLOAT3(), count / 2 },
+			{ XMFLOAT3(), first + count / 2, XMFLOAT3(), count - count / 2 }
+		};
+		m_Nodes.push_back(children[0]);
+		m_Nodes.push_back(children[1]);
+		m_Nodes[nodeId].First = childId;
+		m_Nodes[nodeId].PacketsCount = 0;
+		unsplitNodes.push_back(childId);
+		unsplitNodes.push_back(childId + 1);
+	}
+
+	// pack the triangles of each leaf
+	m_Packets.reserve((trianglesCnt + PACKET_SIZE - 1) / PACKET_SIZE + m_Nodes.size() / 2);
+	std::for_each(m_Nodes.begin(), m_Nodes.end(), [&](Node& node) {
+		if(!node.PacketsCount)
+			return;
+		const auto firstTriangle = node.First;
+		const auto leafTrianglesCnt = node.PacketsCount;
+		node.First = unsigned(m_Packets.size());
+		node.PacketsCount = (leafTrianglesCnt + PACKET_SIZE - 1) / PACKET_SIZE;
+		for(auto packetId = 0u; packetId < node.PacketsCount; ++packetId) {
+			TrianglePacket packet = {};
+			for(auto lane = 0u; lane < PACKET_SIZE; ++lane) {
+				const auto id = packetId * PACKET_SIZE + lane;
+				if(id >= leafTrianglesCnt)
+					break;
+				const auto triangleId = order[firstTriangle + id];
+				const auto& triangle = triangles[triangleId];
+				const float* v0 = &triangle.Vertices[0].x;
+				const float* v1 = &triangle.Vertices[1].x;
+				const float* v2 = &triangle.Vertices[2].x;
+				for(auto axis = 0u; axis < 3; ++axis) {
+					packet.V0[axis][lane] = v0[axis];
+					packet.Edge1[axis][lane] = v1[axis] - v0[axis];
+					packet.Edge2[axis][lane] = v2[axis] - v0[axis];
+				}
+				packet.FirstIndices[lane] = triangleId * 3;
+			}
+			m_Packets.push_back(packet);
+		}
+	});
+}
+
+struct TriangleBvh::RayPacket
+{
+	RayPacket(const XMFLOAT3& origin, const XMFLOAT3& direction)
+	{
+		for(auto axis = 0u; axis < 3; ++axis) {
+			OriginScalar[axis] = (&origin.x)[axis];
+			DirectionScalar[axis] = (&direction.x)[axis];
+			Origin[axis] = XMVectorReplicate(OriginScalar[axis]);
+			Direction[axis] = XMVectorReplicate(DirectionScalar[axis]);
+		}
+	}
+
+	XMVECTOR Origin[3];
+	XMVECTOR Direction[3];
+	float OriginScalar[3];
+	float DirectionScalar[3];
+};
+
+// Moller-Trumbore - the barycentric coordinates and the distance without the plane of the triangle.
+// Both kernels do exactly the same operations in the same order on each triangle, so they
+// find the same hits with the same distances. A hit at the same distance as an earlier
+// one is dropped - the first triangle wins in both
+bool TriangleBvh::IntersectPackets(const RayPacket& ray, const TrianglePacket* packets, unsigned count, Kernel kernel, float& nearest, unsigned& triangle)
+{
+	auto found = false;
+	if(kernel == Kernel_Packet) {
+		const auto zero = XMVectorZero();
+		const auto one = XMVectorSplatOne();
+		const auto epsilon = XMVectorReplicate(PARALLEL_EPSILON);
+		const auto& o = ray.Origin;
+		const auto& d = ray.Direction;
+		for(auto packet = packets; packet != packets + count; ++packet) {
+			const XMVECTOR e1[3] = { XMLoadFloat4((const XMFLOAT4*)packet->Edge1[0]), XMLoadFloat4((const XMFLOAT4*)packet->Edge1[1]), XMLoadFloat4((const XMFLOAT4*)packet->Edge1[2]) };
+			const XMVECTOR e2[3] = { XMLoadFloat4((const XMFLOAT4*)packet->Edge2[0]), XMLoadFloat4((const XMFLOAT4*)packet->Edge2[1]), XMLoadFloat4((const XMFLOAT4*)packet->Edge2[2]) };
+			const auto px = d[1] * e2[2] - d[2] * e2[1];
+			const auto py = d[2] * e2[0] - d[0] * e2[2];
+			const auto pz = d[0] * e2[1] - d[1] * e2[0];
+			const auto determinant = e1[0] * px + e1[1] * py + e1[2] * pz;
+			auto valid = XMVectorGreaterOrEqual(XMVectorAbs(determinant), epsilon);
+			const auto inverseDeterminant = XMVectorReciprocal(determinant);
+
+			const auto sx = o[0] - XMLoadFloat4((const XMFLOAT4*)packet->V0[0]);
+			const auto sy = o[1] - XMLoadFloat4((const XMFLOAT4*)packet->V0[1]);
+			const auto sz = o[2] - XMLoadFloat4((const XMFLOAT4*)packet->V0[2]);
+			const auto u = (sx * px + sy * py + sz * pz) * inverseDeterminant;
+			valid = XMVectorAndInt(valid, XMVectorAndInt(XMVectorGreaterOrEqual(u, zero), XMVectorLessOrEqual(u, one)));
+			const auto qx = sy * e1[2] - sz * e1[1];
+			const auto qy = sz * e1[0] - sx * e1[2];
+			const auto qz = sx * e1[1] - sy * e1[0];
+			const auto v = (d[0] * qx + d[1] * qy + d[2] * qz) * inverseDeterminant;
+			valid = XMVectorAndInt(valid, XMVectorAndInt(XMVectorGreaterOrEqual(v, zero), XMVectorLessOrEqual(u + v, one)));
+			const auto t = (e2[0] * qx + e2[1] * qy + e2[2] * qz) * inverseDeterminant;
+			valid = XMVectorAndInt(valid, XMVectorAndInt(XMVectorGreaterOrEqual(t, zero), XMVectorLess(t, XMVectorReplicate(nearest))));
+
+			auto hitLanes = GetSignMask(valid);
+			if(!hitLanes)
+				continue;
+			XMFLOAT4 distances;
+			XMStoreFloat4(&distances, t);
+			const float* laneDistances = &distances.x;
+			for(auto lane = 0u; hitLanes; ++lane, hitLanes >>= 1) {
+				if((hitLanes & 1) && laneDistances[lane] < nearest) {
+					nearest = laneDistances[lane];
+					triangle = packet->FirstIndices[lane];
+					found = true;
+				}
+			}
+		}
+		return found;
+	}
+
+	const auto& o = ray.OriginScalar;
+	const auto& d = ray.DirectionScalar;
+	for(auto packet = packets; packet != packets + count; ++packet) {
+		for(auto lane = 0u; lane < PACKET_SIZE; ++lane) {
+			const float e1[3] = { packet->Edge1[0][lane], packet->Edge1[1][lane], packet->Edge1[2][lane] };
+			const float e2[3] = { packet->Edge2[0][lane], packet->Edge2[1][lane], packet->Edge2[2][lane] };
+			const auto px = d[1] * e2[2] - d[2] * e2[1];
+			const auto py = d[2] * e2[0] - d[0] * e2[2];
+			const auto pz = d[0] * e2[1] - d[1] * e2[0];
+			const auto determinant = e1[0] * px + e1[1] * py + e1[2] * pz;
+			// NB: the tests are written so that NaN fails them like in the packets
+			if(!(std::abs(determinant) >= PARALLEL_EPSILON))
+				continue;
+			const auto inverseDeterminant = 1.f / determinant;
+
+			const auto sx = o[0] - packet->V0[0][lane];
+			const auto sy = o[1] - packet->V0[1][lane];
+			const auto sz = o[2] - packet->V0[2][lane];
+			const auto u = (sx * px + sy * py + sz * pz) * inverseDeterminant;
+			if(!(u >= 0 && u <= 1))
+				continue;
+			const auto qx = sy * e1[2] - sz * e1[1];
+			const auto qy = sz * e1[0] - sx * e1[2];
+			const auto qz = sx * e1[1] - sy * e1[0];
+			const auto v = (d[0] * qx + d[1] * qy + d[2] * qz) * inverseDeterminant;
+			if(!(v >= 0 && u + v <= 1))
+				continue;
+			const auto t = (e2[0] * qx + e2[1] * qy + e2[2] * qz) * inverseDeterminant;
+			if(!(t >= 0 && t < nearest))
+				continue;
+
+			nearest = t;
+			triangle = packet->FirstIndices[lane];
+			found = true;
+		}
+	}
+	return found;
+}
+
+bool TriangleBvh::Intersect(const XMFLOAT3& origin, const XMFLOAT3& direction, float maxDistance, float& distance, unsigned& triangle, Kernel kernel) const
+{
+	if(m_Nodes.empty())
+		return false;
+
+	const float rayOrigin[3] = { origin.x, origin.y, origin.z };
+	const float inverseDirection[3] = { 1.f / direction.x, 1.f / direction.y, 1.f / direction.z };
+	float entry;
+	if(!ClipRay(rayOrigin, inverseDirection, maxDistance, m_Nodes[0].MinCorner, m_Nodes[0].MaxCorner, entry))
+		return false;
+
+	const RayPacket ray(origin, direction);
+	auto nearest = maxDistance;
+	auto found = false;
+
+	// Depth-first with the nearer child first. A node is skipped when the ray
+	// enters it's box after the nearest hit so far
+	struct StackEntry
+	{
+		unsigned NodeId;
+		float Entry;
+	};
+	StackEntry unvisitedNodes[TRAVERSAL_STACK_SIZE];
+	auto unvisitedCnt = 0u;
+	StackEntry rootEntry = { 0, entry };
+	unvisitedNodes[unvisitedCnt++] = rootEntry;
+	while(unvisitedCnt) {
+		const auto current = unvisitedNodes[--unvisitedCnt];
+		if(current.Entry > nearest)
+			continue;
+
+		const auto& node = m_Nodes[current.NodeId];
+		if(node.PacketsCount) {
+			if(IntersectPackets(ray, &m_Packets[node.First], node.PacketsCount, kernel, nearest, triangle)) {
+				found = true;
+			}
+			continue;
+		}
+
+		StackEntry children[2];
+		auto hitChildrenCnt = 0u;
+		for(auto child = node.First; child < node.First + 2; ++child) {
+			if(ClipRay(rayOrigin, inverseDirection, nearest, m_Nodes[child].MinCorner, m_Nodes[child].MaxCorner, entry)) {
+				StackEntry childEntry = { child, entry };
+				children[hitChildrenCnt++] = childEntry;
+			}
+		}
+		if(hitChildrenCnt == 2 && children[0].Entry < children[1].Entry) {
+			std::swap(children[0], children[1]);
+		}
+		assert(unvisitedCnt + hitChildrenCnt <= TRAVERSAL_STACK_SIZE && "Triangle BVH traversal stack overflow!");
+		for(auto child = 0u; child < hitChildrenCnt; ++child) {
+			unvisitedNodes[unvisitedCnt++] = children[child];
+		}
+	}
+
+	if(found) {
+		distance = nearest;
+	}
+	return found;
+}
+
+bool TriangleBvh::IntersectAll(const XMFLOAT3& origin, const XMFLOAT3& direction, float maxDistance, float& distance, unsigned& triangle, Kernel kernel) const
+{
+	if(m_Packets.empty())
+		return false;
+
+	const RayPacket ray(origin, direction);
+	auto nearest = maxDistance;
+	const auto found = IntersectPackets(ray, &m_Packets[0], unsigned(m_Packets.size()), kernel, nearest, triangle);
+	if(found) {
+		distance = nearest;
+	}
+	return found;
+}
+
+}
@@ -0,0 +1,93 @@
+// Copyright (c) 2013-2014, Stoyan Nikolov
+// All rights reserved.
+// This sample is governed by a permissive BSD-style license. See LICENSE.
+// Note: The Voxels Library itself has a separate license. Check out it's
+// website for more information
+#pragma once
+
+#include "../../Voxels/include/Polygonizer.h"
+
+namespace Voxels
+{
+
+// Bounding volume hierarchy over the triangles of a block for ray queries. Each inner node
+// splits it's triangles at the median along the longest axis of their centers, so building
+// it is cheap enough to do the first time a ray reaches the block.
+// The triangles of each leaf are kept in packets of 4 with each coordinate in it's own
+// vector so that a packet is tested at once with SSE.
+// NB: The positions are copied - the block is only kept to tell if it was replaced
+class TriangleBvh
+{
+public:
+	// Triangles tested at once by the packet kernel
+	static const unsigned PACKET_SIZE = 4;
+
+	// How the triangles are tested - both give exactly the same hits
+	enum Kernel
+	{
+		// all the triangles of a packet at once. Scalar if DirectXMath has no intrinsics
+		Kernel_Packet,
+		// one triangle after the other
+		Kernel_Scalar
+	};
+
+	explicit TriangleBvh(const BlockPolygons& block);
+
+	// Finds the nearest triangle that the ray hits closer than maxDistance - both sides of the triangles
+	// are hit. The direction doesn't have to be normalized - the distance is in multiples of it's length.
+	// triangle is the index of the first index of the triangle in the block
+	bool Intersect(const DirectX::XMFLOAT3& origin
+		, const DirectX::XMFLOAT3& direction
+		, float maxDistance
+		, float& distance
+		, unsigned& triangle
+		, Kernel kernel = Kernel_Packet) const;
+	// Same as Intersect, but tests all the triangles without the tree - for measuring the kernels
+	bool IntersectAll(const DirectX::XMFLOAT3& origin
+		, const DirectX::XMFLOAT3& direction
+		, float maxDistance
+		, float& distance
+		, unsigned& triangle
+		, Kernel kernel) const;
+
+	const BlockPolygons* GetBlock() const { return m_Block; }
+	unsigned GetTrianglesCount() const { return m_TrianglesCount; }
+
+private:
+	// A ray with each of it's coordinates in all the lanes
+	struct RayPacket;
+	// Each coordinate of the first vertex and of the two edges from it for 4 triangles. The
+	// empty places of the last packet of a leaf have no edges - they are never hit
+	struct TrianglePacket
+	{
+		float V0[3][PACKET_SIZE];
+		float Edge1[3][PACKET_SIZE];
+		float Edge2[3][PACKET_SIZE];
+		unsigned FirstIndices[PACKET_SIZE];
+	};
+
+	// A leaf has PacketsCount > 0 and it's packets start at First. The two children
+	// of an inner node are next to each other starting at First
+	struct Node
+	{
+		DirectX::XMFLOAT3 MinCorner;
+		unsigned First;
+		DirectX::XMFLOAT3 MaxCorner;
+		unsigned PacketsCount;
+	};
+
+	// Tests count packets and lowers nearest to the nearest hit
+	static bool IntersectPackets(const RayPacket& ray
+		, const TrianglePacket* packets
+		, unsigned count
+		, Kernel kernel
+		, float& nearest
+		, unsigned& triangle);
+
+	const BlockPolygons* m_Block;
+	unsigned m_TrianglesCount;
+	std::vector<Node> m_Nodes;
+	std::vector<TrianglePacket> m_Packets;
+};
+
+}
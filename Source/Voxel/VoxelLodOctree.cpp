@@ -6,370 +6,2941 @@
 #include "stdafx.h"
 #include "VoxelLodOctree.h"
 
+#include <chrono>
+#include <atomic>
+
 using namespace DirectX;
 
-namespace Voxels
+namespace Voxels
+{
+
+// when enabled the transition faces found with the selected nodes lookups are
+// checked against a brute-force comparison of all the selected node pairs
+#define VALIDATE_TRANSITION_FACES 0
+
+// when enabled the result of every coherent Cull is checked against a full Cull
+#define VALIDATE_COHERENT_CULL 0
+
+inline DirectX::XMVECTOR XMLoadFloat3(const float3* fl)
+{
+	static_assert(sizeof(float3) == sizeof(DirectX::XMFLOAT3), "Float types incompatible!");
+	return XMLoadFloat3(reinterpret_cast<const DirectX::XMFLOAT3*>(fl));
+}
+
+inline DirectX::XMVECTOR XMLoadFloat4(const float4* fl)
+{
+	static_assert(sizeof(float4) == sizeof(DirectX::XMFLOAT4), "Float types incompatible!");
+	return XMLoadFloat4(reinterpret_cast<const DirectX::XMFLOAT4*>(fl));
+}
+
+inline void XMStoreFloat3(float3* pDestination, DirectX::FXMVECTOR V)
+{
+	XMStoreFloat3(reinterpret_cast<DirectX::XMFLOAT3*>(pDestination), V);
+}
+
+inline void XMStoreFloat4(float4* pDestination, DirectX::FXMVECTOR V)
+{
+	XMStoreFloat4(reinterpret_cast<DirectX::XMFLOAT4*>(pDestination), V);
+}
+
+// all the 6 frustum planes have to be tested
+static const unsigned ALL_PLANES_MASK = (1 << 6) - 1;
+static const unsigned char NO_REJECTING_PLANE = 6;
+static const unsigned NO_PARENT_RECORD = ~0u;
+// the budgeted Cull reads the clock only every that many splits
+static const unsigned BUDGET_CHECK_INTERVAL = 8;
+// and every that many nodes when merging and examining the front - they are much cheaper than splits
+static const unsigned BUDGET_CHECK_NODES = 64;
+// at most that many places between the eye and a block are checked for terrain hiding it
+static const unsigned MAX_HORIZON_STEPS = 32;
+// The normal cones are widened by that much (in cosine) for the rounding errors
+static const float NORMAL_CONE_EPSILON = 1e-4f;
+// The policies keep K >= S / 2 + 27 / 32 (see LodPolicy.cpp). Scaling the coefficients of a node by s and those
+// of it's twice smaller neighbours by at most s still keeps K >= S / 2 + 3 / 4 while s >= 8 / 9
+static const float MIN_LOD_BIAS_DISTANCE_SCALE = 8.f / 9;
+
+// Node keys pack the LOD level and the Morton code of the integer cell
+// coordinates of the node in that level
+static const unsigned KEY_LEVEL_SHIFT = 27;
+static const unsigned KEY_MORTON_MASK = (1 << KEY_LEVEL_SHIFT) - 1;
+// Max cells per axis in the finest level that fit in the Morton code
+static const unsigned MAX_CELLS_PER_AXIS = 1 << (KEY_LEVEL_SHIFT / 3);
+
+// Spreads the lower 10 bits of the value so that there are two zero bits between each of them
+inline unsigned SpreadBits(unsigned value)
+{
+	value &= 0x000003ff;
+	value = (value | (value << 16)) & 0x030000ff;
+	value = (value | (value << 8)) & 0x0300f00f;
+	value = (value | (value << 4)) & 0x030c30c3;
+	value = (value | (value << 2)) & 0x09249249;
+	return value;
+}
+
+// Inverse of SpreadBits
+inline unsigned CompactBits(unsigned value)
+{
+	value &= 0x09249249;
+	value = (value | (value >> 2)) & 0x030c30c3;
+	value = (value | (value >> 4)) & 0x0300f00f;
+	value = (value | (value >> 8)) & 0x030000ff;
+	value = (value | (value >> 16)) & 0x000003ff;
+	return value;
+}
+
+// NB: The child index of a node is x * 4 + y * 2 + z, so the key of a child is
+// the key of the parent shifted by 3 bits with the child index appended
+inline unsigned MakeNodeKey(unsigned level, unsigned x, unsigned y, unsigned z)
+{
+	return (level << KEY_LEVEL_SHIFT) | (SpreadBits(x) << 2) | (SpreadBits(y) << 1) | SpreadBits(z);
+}
+
+inline unsigned GetKeyLevel(unsigned key)
+{
+	return key >> KEY_LEVEL_SHIFT;
+}
+
+inline void GetKeyCell(unsigned key, unsigned cell[3])
+{
+	const auto morton = key & KEY_MORTON_MASK;
+	cell[0] = CompactBits(morton >> 2);
+	cell[1] = CompactBits(morton >> 1);
+	cell[2] = CompactBits(morton);
+}
+
+inline unsigned GetChildKey(unsigned parentKey, unsigned child)
+{
+	const auto level = GetKeyLevel(parentKey);
+	assert(level > 0);
+	return ((level - 1) << KEY_LEVEL_SHIFT) | (((parentKey & KEY_MORTON_MASK) << 3) | child);
+}
+
+inline unsigned GetParentKey(unsigned childKey)
+{
+	return ((GetKeyLevel(childKey) + 1) << KEY_LEVEL_SHIFT) | ((childKey & KEY_MORTON_MASK) >> 3);
+}
+
+inline unsigned CountChildren(unsigned char childMask)
+{
+	auto count = 0u;
+	for(; childMask; childMask &= childMask - 1) {
+		++count;
+	}
+	return count;
+}
+
+// The build ids of all the octrees come from a single counter, so a state kept after it's octree
+// was destroyed never matches a new octree. 0 is left for the states that weren't used yet
+static unsigned GetNextBuildId()
+{
+	static std::atomic<unsigned> nextBuildId(1);
+	return nextBuildId++;
+}
+
+inline long long GetMicrosecondsSince(const std::chrono::high_resolution_clock::time_point& start)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+// How far the camera moved - the LOD policy margins change at most that much
+inline float GetCameraChange(const XMFLOAT3& from, const XMFLOAT3& to)
+{
+	return XMVectorGetX(XMVector3Length(XMLoadFloat3(&to) - XMLoadFloat3(&from)));
+}
+
+// The most the distance between any point in [0, extents] and a frustum plane changes between the frustums
+inline float GetFrustumChange(const XMFLOAT4 from[6], const XMFLOAT4 to[6], const XMFLOAT3& extents)
+{
+	auto change = 0.f;
+	for(auto i = 0u; i < 6; ++i) {
+		change = std::max(change, std::abs(to[i].x - from[i].x) * extents.x
+			+ std::abs(to[i].y - from[i].y) * extents.y
+			+ std::abs(to[i].z - from[i].z) * extents.z
+			+ std::abs(to[i].w - from[i].w));
+	}
+	return change;
+}
+
+// Max nodes waiting on the stack of a depth-first query - up to 7 siblings wait on each depth
+static const unsigned QUERY_STACK_SIZE = 8 * (KEY_LEVEL_SHIFT / 3 + 1);
+
+// Clips the ray to the box - returns false if it misses it within [0, maxDistance]
+inline bool ClipRay(const XMFLOAT3& origin, const XMFLOAT3& direction, float maxDistance, const XMFLOAT3& boxMin, const XMFLOAT3& boxMax, float& entry)
+{
+	const float* rayOrigin = &origin.x;
+	const float* rayDirection = &direction.x;
+	const float* minCorner = &boxMin.x;
+	const float* maxCorner = &boxMax.x;
+
+	auto entryDistance = 0.f;
+	auto exitDistance = maxDistance;
+	for(auto axis = 0u; axis < 3; ++axis) {
+		// a ray parallel to the slab is either always in it or never
+		if(rayDirection[axis] == 0) {
+			if(rayOrigin[axis] < minCorner[axis] || rayOrigin[axis] > maxCorner[axis])
+				return false;
+			continue;
+		}
+		auto slabNear = (minCorner[axis] - rayOrigin[axis]) / rayDirection[axis];
+		auto slabFar = (maxCorner[axis] - rayOrigin[axis]) / rayDirection[axis];
+		if(slabNear > slabFar) {
+			std::swap(slabNear, slabFar);
+		}
+		entryDistance = std::max(entryDistance, slabNear);
+		exitDistance = std::min(exitDistance, slabFar);
+		if(entryDistance > exitDistance)
+			return false;
+	}
+	entry = entryDistance;
+	return true;
+}
+
+// The transition faces of a block as a bit per face
+inline unsigned char GetTransitionMask(const VoxelLodOctree::VisibleBlock& block)
+{
+	unsigned char mask = 0;
+	for(auto face = 0u; face < BlockPolygons::Face_Count; ++face) {
+		mask |= (unsigned char)(block.TransitionFaces[face] << face);
+	}
+	return mask;
+}
+
+// The frustum planes splatted for testing 4 boxes at once
+struct FrustumPlanesSoA
+{
+	XMVECTOR X[6];
+	XMVECTOR Y[6];
+	XMVECTOR Z[6];
+	XMVECTOR W[6];
+	// if the normal component is <= 0 the min corner is the extreme point on that axis
+	bool UseMinX[6];
+	bool UseMinY[6];
+	bool UseMinZ[6];
+
+	FrustumPlanesSoA()
+	{}
+
+	explicit FrustumPlanesSoA(const XMFLOAT4 frustumPlanes[6])
+	{
+		for(auto i = 0u; i < 6; ++i) {
+			X[i] = XMVectorReplicate(frustumPlanes[i].x);
+			Y[i] = XMVectorReplicate(frustumPlanes[i].y);
+			Z[i] = XMVectorReplicate(frustumPlanes[i].z);
+			W[i] = XMVectorReplicate(frustumPlanes[i].w);
+			UseMinX[i] = frustumPlanes[i].x <= 0;
+			UseMinY[i] = frustumPlanes[i].y <= 0;
+			UseMinZ[i] = frustumPlanes[i].z <= 0;
+		}
+	}
+};
+
+// The boxes of the 8 children of a node - children 0-3 are in the first half and 4-7 in the second
+struct ChildBoxesSoA
+{
+	XMVECTOR MinX[2];
+	XMVECTOR MaxX[2];
+	XMVECTOR MinY;
+	XMVECTOR MaxY;
+	XMVECTOR MinZ;
+	XMVECTOR MaxZ;
+
+	ChildBoxesSoA(const unsigned parentCell[3], const XMFLOAT3& childExtents)
+	{
+		// child index is x * 4 + y * 2 + z
+		const auto cellX = XMVectorReplicate(float(parentCell[0] * 2));
+		const auto cellY = XMVectorReplicate(float(parentCell[1] * 2)) + XMVectorSet(0, 0, 1, 1);
+		const auto cellZ = XMVectorReplicate(float(parentCell[2] * 2)) + XMVectorSet(0, 1, 0, 1);
+		const auto one = XMVectorSplatOne();
+
+		const auto extX = XMVectorReplicate(childExtents.x);
+		const auto extY = XMVectorReplicate(childExtents.y);
+		const auto extZ = XMVectorReplicate(childExtents.z);
+
+		MinX[0] = XMVectorMultiply(cellX, extX);
+		MinX[1] = XMVectorMultiply(cellX + one, extX);
+		MaxX[0] = XMVectorMultiply(cellX + one, extX);
+		MaxX[1] = XMVectorMultiply(cellX + one + one, extX);
+		MinY = XMVectorMultiply(cellY, extY);
+		MaxY = XMVectorMultiply(cellY + one, extY);
+		MinZ = XMVectorMultiply(cellZ, extZ);
+		MaxZ = XMVectorMultiply(cellZ + one, extZ);
+	}
+};
+
+// Returns a bit for each component with the sign bit set
+inline unsigned GetSignMask(FXMVECTOR vec)
+{
+#if defined(_XM_SSE_INTRINSICS_)
+	return unsigned(_mm_movemask_ps(vec));
+#else
+	uint32_t components[4];
+	XMStoreInt4(components, vec);
+	return (components[0] >> 31) | ((components[1] >> 31) << 1) | ((components[2] >> 31) << 2) | ((components[3] >> 31) << 3);
+#endif
+}
+
+// Tests the 8 children of a node against the active frustum planes at once.
+// Returns a bit for each visible child
+// and clears in childPlaneMasks the planes that each child is completely inside of.
+// The plane that rejected children the last time is tested first and the test stops
+// as soon as all the children are rejected.
+// If slack is not null it's lowered to the smallest distance between a tested child and plane.
+// NB: Does exactly the same arithmetic as ClassifyCube on each child
+static unsigned ClassifyChildren(const FrustumPlanesSoA& frustum
+	, const ChildBoxesSoA& children
+	, unsigned childMask
+	, unsigned planeMask
+	, unsigned char& rejectingPlane
+	, unsigned char childPlaneMasks[8]
+	, unsigned& planeTests
+	, float* slack = nullptr)
+{
+	const auto& minX = children.MinX;
+	const auto& maxX = children.MaxX;
+	const auto& minY = children.MinY;
+	const auto& maxY = children.MaxY;
+	const auto& minZ = children.MinZ;
+	const auto& maxZ = children.MaxZ;
+
+	std::fill(childPlaneMasks, childPlaneMasks + 8, (unsigned char)planeMask);
+
+	const auto zero = XMVectorZero();
+	const unsigned firstPlane = rejectingPlane < NO_REJECTING_PLANE ? rejectingPlane : 0;
+	auto culled = 0u;
+	for(auto planeId = 0u; planeId < 6 && (culled & childMask) != childMask; ++planeId) {
+		// start with the cached plane and continue with the others in order
+		const auto i = (planeId == 0) ? firstPlane : (planeId - 1 < firstPlane ? planeId - 1 : planeId);
+		if(!(planeMask & (1 << i)))
+			continue;
+
+		planeTests += CountChildren((unsigned char)(childMask & ~culled));
+
+		// the point furthest along the normal decides if the box is outside and the
+		// nearest one if it's completely inside
+		const auto outerY = frustum.UseMinY[i] ? minY : maxY;
+		const auto outerZ = frustum.UseMinZ[i] ? minZ : maxZ;
+		const auto innerY = frustum.UseMinY[i] ? maxY : minY;
+		const auto innerZ = frustum.UseMinZ[i] ? maxZ : minZ;
+		auto outside = 0u;
+		auto inside = 0u;
+		for(auto half = 0u; half < 2; ++half) {
+			const auto outerX = frustum.UseMinX[i] ? minX[half] : maxX[half];
+			const auto innerX = frustum.UseMinX[i] ? maxX[half] : minX[half];
+
+			auto distance = XMVectorMultiply(frustum.X[i], outerX);
+			distance = XMVectorAdd(distance, XMVectorMultiply(frustum.Y[i], outerY));
+			distance = XMVectorAdd(distance, XMVectorMultiply(frustum.Z[i], outerZ));
+			distance = XMVectorAdd(distance, frustum.W[i]);
+			outside |= GetSignMask(XMVectorLess(distance, zero)) << (half * 4);
+
+			auto innerDistance = XMVectorMultiply(frustum.X[i], innerX);
+			innerDistance = XMVectorAdd(innerDistance, XMVectorMultiply(frustum.Y[i], innerY));
+			innerDistance = XMVectorAdd(innerDistance, XMVectorMultiply(frustum.Z[i], innerZ));
+			innerDistance = XMVectorAdd(innerDistance, frustum.W[i]);
+			inside |= GetSignMask(XMVectorGreaterOrEqual(innerDistance, zero)) << (half * 4);
+
+			if(slack) {
+				XMFLOAT4A distances;
+				XMStoreFloat4A(&distances, XMVectorMin(XMVectorAbs(distance), XMVectorAbs(innerDistance)));
+				const float* lanes = &distances.x;
+				for(auto tested = ((childMask & ~culled) >> (half * 4)) & 0xf; tested; tested &= tested - 1) {
+					*slack = std::min(*slack, lanes[CountChildren((unsigned char)((tested & (~tested + 1)) - 1))]);
+				}
+			}
+		}
+
+		if(outside & childMask & ~culled) {
+			rejectingPlane = (unsigned char)i;
+		}
+		culled |= outside;
+
+		for(inside &= childMask & ~culled; inside; inside &= inside - 1) {
+			const auto child = CountChildren((unsigned char)((inside & (~inside + 1)) - 1));
+			childPlaneMasks[child] &= ~(1 << i);
+		}
+	}
+
+	return ~culled & childMask;
+}
+
+const unsigned VoxelLodOctree::NodeKeySet::EMPTY_SLOT;
+const unsigned VoxelLodOctree::NodeKeyViewsMap::EMPTY_SLOT;
+const unsigned VoxelLodOctree::MAX_BATCHED_VIEWS;
+const unsigned VoxelLodOctree::MAX_LOD_LEVELS;
+
+size_t VoxelLodOctree::CullScratch::GetReservedMemory() const
+{
+	auto size = UnvisitedNodes.capacity() * sizeof(TraversalEntry)
+		+ NodesToDraw.capacity() * sizeof(NodeIndicesVec)
+		+ SelectedKeys.GetReservedMemory()
+		+ (Selected.capacity() + DrawnNodes.capacity()) * sizeof(unsigned);
+	std::for_each(NodesToDraw.cbegin(), NodesToDraw.cend(), [&](const NodeIndicesVec& nodes) {
+		size += nodes.capacity() * sizeof(unsigned);
+	});
+	return size;
+}
+
+void VoxelLodOctree::NodeKeySet::Reset(unsigned expectedCount)
+{
+	auto capacity = 16u;
+	while(capacity < expectedCount * 2) {
+		capacity *= 2;
+	}
+	// NB: assign doesn't reallocate if the capacity is enough
+	m_Slots.assign(capacity, EMPTY_SLOT);
+	m_Mask = capacity - 1;
+}
+
+void VoxelLodOctree::NodeKeySet::Insert(unsigned key)
+{
+	assert(key != EMPTY_SLOT);
+	auto slot = Hash(key);
+	while(m_Slots[slot] != EMPTY_SLOT) {
+		if(m_Slots[slot] == key)
+			return;
+		slot = (slot + 1) & m_Mask;
+	}
+	m_Slots[slot] = key;
+}
+
+bool VoxelLodOctree::NodeKeySet::Contains(unsigned key) const
+{
+	auto slot = Hash(key);
+	while(m_Slots[slot] != EMPTY_SLOT) {
+		if(m_Slots[slot] == key)
+			return true;
+		slot = (slot + 1) & m_Mask;
+	}
+	return false;
+}
+
+void VoxelLodOctree::NodeKeyViewsMap::Reset(unsigned expectedCount)
+{
+	auto capacity = 16u;
+	while(capacity < expectedCount * 2) {
+		capacity *= 2;
+	}
+	m_Slots.assign(capacity, EMPTY_SLOT);
+	m_Views.resize(capacity);
+	m_Mask = capacity - 1;
+}
+
+void VoxelLodOctree::NodeKeyViewsMap::Insert(unsigned key, unsigned viewMask)
+{
+	assert(key != EMPTY_SLOT);
+	auto slot = Hash(key);
+	while(m_Slots[slot] != EMPTY_SLOT) {
+		if(m_Slots[slot] == key) {
+			m_Views[slot] |= viewMask;
+			return;
+		}
+		slot = (slot + 1) & m_Mask;
+	}
+	m_Slots[slot] = key;
+	m_Views[slot] = viewMask;
+}
+
+unsigned VoxelLodOctree::NodeKeyViewsMap::GetViews(unsigned key) const
+{
+	auto slot = Hash(key);
+	while(m_Slots[slot] != EMPTY_SLOT) {
+		if(m_Slots[slot] == key)
+			return m_Views[slot];
+		slot = (slot + 1) & m_Mask;
+	}
+	return 0;
+}
+
+VoxelLodOctree::VoxelLodOctree()
+	: m_BackFaceCulling(false)
+	, m_MinPixelArea(0)
+	, m_ContributionDistanceCoeff(0)
+	, m_HorizonCulling(false)
+	, m_MaxSolidHeight(-std::numeric_limits<float>::max())
+	, m_LodPolicy(&m_DefaultLodPolicy)
+	, m_BuildId(GetNextBuildId())
+	, m_LodLevels(0)
+	, m_NonEmptyNodes(0)
+{}
+
+VoxelLodOctree::~VoxelLodOctree()
+{}
+
+void VoxelLodOctree::GetNodeBounds(unsigned key, XMFLOAT3& minCorner, XMFLOAT3& maxCorner) const
+{
+	unsigned cell[3];
+	GetKeyCell(key, cell);
+	const auto& extents = m_CellExtents[GetKeyLevel(key)];
+
+	minCorner = XMFLOAT3(cell[0] * extents.x, cell[1] * extents.y, cell[2] * extents.z);
+	maxCorner = XMFLOAT3((cell[0] + 1) * extents.x, (cell[1] + 1) * extents.y, (cell[2] + 1) * extents.z);
+}
+
+unsigned VoxelLodOctree::GetBlockKey(unsigned lodLevel, const BlockPolygons& block) const
+{
+	const auto& cellExtents = m_CellExtents[lodLevel];
+	const auto minCorner = block.GetMinimalCorner();
+	return MakeNodeKey(lodLevel
+		, unsigned(minCorner.x / cellExtents.x + 0.5f)
+		, unsigned(minCorner.y / cellExtents.y + 0.5f)
+		, unsigned(minCorner.z / cellExtents.z + 0.5f));
+}
+
+unsigned VoxelLodOctree::FindNode(unsigned key) const
+{
+	const auto level = GetKeyLevel(key);
+	if(m_Nodes.empty() || level >= m_LodLevels)
+		return PolygonSurface::INVALID_ID;
+
+	// every level down takes the next 3 bits of the Morton code as the child index
+	const auto morton = key & KEY_MORTON_MASK;
+	auto nodeId = 0u;
+	for(auto nodeLevel = m_LodLevels - 1; nodeLevel > level; --nodeLevel) {
+		const auto& node = m_Nodes[nodeId];
+		const auto childBit = 1u << ((morton >> (3 * (nodeLevel - 1 - level))) & 7);
+		if(!(node.ChildMask & childBit))
+			return PolygonSurface::INVALID_ID;
+		nodeId = node.FirstChild + CountChildren((unsigned char)(node.ChildMask & (childBit - 1)));
+	}
+	return nodeId;
+}
+
+VoxelLodOctree::NormalCone VoxelLodOctree::ComputeNormalCone(const BlockPolygons& block)
+{
+	NormalCone cone = { XMFLOAT3(0, 0, 0), -1, 0 };
+
+	unsigned indicesCnt = 0;
+	const auto indices = block.GetIndices(&indicesCnt);
+	const auto vertices = block.GetVertices(nullptr);
+	// The front faces are counter-clockwise like in the rasterizer state of DrawRoutine.
+	// Degenerate triangles are never drawn so they don't count
+	const auto getNormal = [&](unsigned index) -> XMVECTOR {
+		const auto v0 = XMLoadFloat3(&vertices[indices[index]].Position);
+		const auto v1 = XMLoadFloat3(&vertices[indices[index + 1]].Position);
+		const auto v2 = XMLoadFloat3(&vertices[indices[index + 2]].Position);
+		return XMVector3Normalize(XMVector3Cross(v2 - v0, v1 - v0));
+	};
+
+	// the axis is the average of the normals and the angle is to the furthest normal
+	auto axis = XMVectorZero();
+	for(auto index = 0u; index + 2 < indicesCnt; index += 3) {
+		axis += getNormal(index);
+	}
+	const auto axisLength = XMVectorGetX(XMVector3Length(axis));
+	if(axisLength < NORMAL_CONE_EPSILON)
+		return cone;
+	axis /= axisLength;
+
+	auto cosAngle = 1.f;
+	for(auto index = 0u; index + 2 < indicesCnt; index += 3) {
+		const auto normal = getNormal(index);
+		if(!XMVector3Equal(normal, XMVectorZero())) {
+			cosAngle = std::min(cosAngle, XMVectorGetX(XMVector3Dot(axis, normal)));
+		}
+	}
+	cosAngle -= NORMAL_CONE_EPSILON;
+	if(cosAngle <= 0)
+		return cone;
+
+	XMStoreFloat3(&cone.Axis, axis);
+	cone.CosAngle = cosAngle;
+	cone.SinAngle = std::sqrt(1 - cosAngle * cosAngle);
+	return cone;
+}
+
+bool VoxelLodOctree::IsBackFacing(unsigned nodeId, const XMFLOAT3& eye, float* slack) const
+{
+	const auto& cone = m_NormalCones[nodeId];
+	if(cone.CosAngle <= 0)
+		return false;
+
+	XMFLOAT3 nodeMinCorner;
+	XMFLOAT3 nodeMaxCorner;
+	GetNodeBounds(m_Nodes[nodeId].Key, nodeMinCorner, nodeMaxCorner);
+	const auto minCorner = XMLoadFloat3(&nodeMinCorner);
+	const auto maxCorner = XMLoadFloat3(&nodeMaxCorner);
+	const auto center = (minCorner + maxCorner) * 0.5f;
+	const auto radius = XMVectorGetX(XMVector3Length(maxCorner - minCorner)) * 0.5f;
+
+	// A triangle at p with normal n faces the eye if dot(n, eye - p) > 0. With p in the sphere around
+	// the node and n in the cone that is at most the largest dot(n, eye - center) plus the radius.
+	// It's largest for the n in the cone nearest to eye - center and changes at most as much as the eye moves
+	const auto toEye = XMLoadFloat3(&eye) - center;
+	const auto alongAxis = XMVectorGetX(XMVector3Dot(XMLoadFloat3(&cone.Axis), toEye));
+	const auto acrossAxis = std::sqrt(std::max(XMVectorGetX(XMVector3LengthSq(toEye)) - alongAxis * alongAxis, 0.f));
+	const auto facing = alongAxis * cone.CosAngle + acrossAxis * cone.SinAngle + radius;
+
+	if(slack) {
+		*slack = std::min(*slack, std::abs(facing));
+	}
+	return facing < 0;
+}
+
+void VoxelLodOctree::SetContributionCulling(float projectionScale, float viewportHeight, float minPixelArea)
+{
+	m_MinPixelArea = std::max(minPixelArea, 0.f);
+
+	// A sphere with radius r at distance d covers about pi * (r * projectionScale * viewportHeight / (2 * d))^2
+	// pixels near the center of the view - a bit more towards the edges. That's under the area when
+	// d > r * projectionScale * viewportHeight / (2 * sqrt(area / pi))
+	m_ContributionDistanceCoeff = m_MinPixelArea > 0
+		? projectionScale * viewportHeight / (2 * std::sqrt(m_MinPixelArea / XM_PI))
+		: 0;
+}
+
+bool VoxelLodOctree::IsSubPixel(unsigned nodeId, const XMFLOAT3& eye, float* slack) const
+{
+	if(m_ContributionDistanceCoeff <= 0)
+		return false;
+
+	XMFLOAT3 nodeMinCorner;
+	XMFLOAT3 nodeMaxCorner;
+	GetNodeBounds(m_Nodes[nodeId].Key, nodeMinCorner, nodeMaxCorner);
+	const auto minCorner = XMLoadFloat3(&nodeMinCorner);
+	const auto maxCorner = XMLoadFloat3(&nodeMaxCorner);
+	const auto center = (minCorner + maxCorner) * 0.5f;
+	const auto radius = XMVectorGetX(XMVector3Length(maxCorner - minCorner)) * 0.5f;
+
+	// the distance is to the sphere so the area is over-estimated if anything
+	const auto distance = XMVectorGetX(XMVector3Length(XMLoadFloat3(&eye) - center)) - radius;
+	const auto margin = distance - radius * m_ContributionDistanceCoeff;
+
+	if(slack) {
+		*slack = std::min(*slack, std::abs(margin));
+	}
+	return margin > 0;
+}
+
+void VoxelLodOctree::BuildSolidHeights()
+{
+	m_SolidHeights.clear();
+	m_MaxSolidHeight = -std::numeric_limits<float>::max();
+	if(m_Nodes.empty())
+		return;
+
+	// In a heightmap terrain everything under the lowest block of a column is solid
+	const auto columnsPerAxis = 1u << (m_LodLevels - 1);
+	m_SolidHeights.resize(m_LodLevels);
+	m_SolidHeights[0].assign(columnsPerAxis * columnsPerAxis, -std::numeric_limits<float>::max());
+	auto& columns = m_SolidHeights[0];
+	std::vector<unsigned char> hasBlocks(columns.size(), 0);
+	unsigned nodeCell[3];
+	std::for_each(m_Nodes.cbegin(), m_Nodes.cend(), [&](const Node& node) {
+		if(GetKeyLevel(node.Key) != 0 || node.Id == PolygonSurface::INVALID_ID)
+			return;
+		GetKeyCell(node.Key, nodeCell);
+		const auto column = nodeCell[2] * columnsPerAxis + nodeCell[0];
+		const auto bottom = nodeCell[1] * m_CellExtents[0].y;
+		columns[column] = hasBlocks[column] ? std::min(columns[column], bottom) : bottom;
+		hasBlocks[column] = 1;
+	});
+
+	// each cell of the next level is the lowest of it's 4 columns
+	for(auto level = 1u; level < m_LodLevels; ++level) {
+		const auto& fine = m_SolidHeights[level - 1];
+		const auto fineCnt = columnsPerAxis >> (level - 1);
+		const auto cellsCnt = columnsPerAxis >> level;
+		auto& coarse = m_SolidHeights[level];
+		coarse.resize(cellsCnt * cellsCnt);
+		for(auto z = 0u; z < cellsCnt; ++z) {
+			for(auto x = 0u; x < cellsCnt; ++x) {
+				const auto first = 2 * z * fineCnt + 2 * x;
+				coarse[z * cellsCnt + x] = std::min(std::min(fine[first], fine[first + 1]), std::min(fine[first + fineCnt], fine[first + fineCnt + 1]));
+			}
+		}
+	}
+	m_MaxSolidHeight = *std::max_element(columns.cbegin(), columns.cend());
+}
+
+float VoxelLodOctree::GetSolidHeight(float minX, float minZ, float maxX, float maxZ) const
+{
+	const auto& cell = m_CellExtents[0];
+	const auto columnsPerAxis = int(1u << (m_LodLevels - 1));
+	const auto minColumnX = int(std::floor(minX / cell.x));
+	const auto minColumnZ = int(std::floor(minZ / cell.z));
+	const auto maxColumnX = int(std::ceil(maxX / cell.x)) - 1;
+	const auto maxColumnZ = int(std::ceil(maxZ / cell.z)) - 1;
+	if(minColumnX < 0 || minColumnZ < 0 || maxColumnX >= columnsPerAxis || maxColumnZ >= columnsPerAxis)
+		return -std::numeric_limits<float>::max();
+
+	// take the level where the rectangle is in at most 2x2 cells
+	auto level = 0u;
+	while((maxColumnX >> level) - (minColumnX >> level) > 1 || (maxColumnZ >> level) - (minColumnZ >> level) > 1) {
+		++level;
+	}
+	const auto& cells = m_SolidHeights[level];
+	const auto cellsCnt = columnsPerAxis >> level;
+	auto height = std::numeric_limits<float>::max();
+	for(auto z = minColumnZ >> level; z <= (maxColumnZ >> level); ++z) {
+		for(auto x = minColumnX >> level; x <= (maxColumnX >> level); ++x) {
+			height = std::min(height, cells[z * cellsCnt + x]);
+		}
+	}
+	return height;
+}
+
+bool VoxelLodOctree::IsBelowHorizon(unsigned nodeId, const XMFLOAT3& eye) const
+{
+	if(m_SolidHeights.empty())
+		return false;
+
+	XMFLOAT3 minCorner;
+	XMFLOAT3 maxCorner;
+	GetNodeBounds(m_Nodes[nodeId].Key, minCorner, maxCorner);
+
+	// The segments from the eye to the top of the box are all at the same height at the same fraction t of
+	// their length - there they go through the top rectangle shrunk towards the eye by t. If all the columns
+	// under that rectangle are solid higher than that the top is hidden and everything under it too.
+	// The segments are nowhere lower than both of their ends so only the terrain higher than that can hide them
+	const auto top = maxCorner.y;
+	if(std::min(eye.y, top) >= m_MaxSolidHeight)
+		return false;
+
+	const auto toCenterX = (minCorner.x + maxCorner.x) * 0.5f - eye.x;
+	const auto toCenterZ = (minCorner.z + maxCorner.z) * 0.5f - eye.z;
+	const auto distance = std::sqrt(toCenterX * toCenterX + toCenterZ * toCenterZ);
+	const auto stepsCnt = std::min(MAX_HORIZON_STEPS, unsigned(distance / std::min(m_CellExtents[0].x, m_CellExtents[0].z)) + 1);
+	for(auto step = 1u; step < stepsCnt; ++step) {
+		const auto t = float(step) / stepsCnt;
+		const auto height = eye.y + t * (top - eye.y);
+		const auto solidHeight = GetSolidHeight(eye.x + t * (minCorner.x - eye.x)
+			, eye.z + t * (minCorner.z - eye.z)
+			, eye.x + t * (maxCorner.x - eye.x)
+			, eye.z + t * (maxCorner.z - eye.z));
+		if(solidHeight > height)
+			return true;
+	}
+	return false;
+}
+
+void VoxelLodOctree::GetNodeCenter(unsigned key, XMFLOAT3& center, float& extent) const
+{
+	XMFLOAT3 nodeMinCorner;
+	XMFLOAT3 nodeMaxCorner;
+	GetNodeBounds(key, nodeMinCorner, nodeMaxCorner);
+
+	center = XMFLOAT3((nodeMinCorner.x + nodeMaxCorner.x) / 2
+		, (nodeMinCorner.y + nodeMaxCorner.y) / 2
+		, (nodeMinCorner.z + nodeMaxCorner.z) / 2);
+	extent = nodeMaxCorner.x - nodeMinCorner.x; // it's a cube - all axes have the same extent
+}
+
+bool VoxelLodOctree::InitializeLevels(const PolygonSurface& map)
+{
+	m_LodLevels = map.GetLevelsCount();
+	m_NonEmptyNodes = 0;
+	m_BuildId = GetNextBuildId();
+	m_Nodes.clear();
+	m_CellExtents.clear();
+	m_SolidHeights.clear();
+	m_NodeBiases.clear();
+
+	if(!m_LodLevels)
+		return false;
+
+	if((1u << (m_LodLevels - 1)) > MAX_CELLS_PER_AXIS || m_LodLevels - 1 > (~0u >> KEY_LEVEL_SHIFT) || m_LodLevels > MAX_LOD_LEVELS) {
+		assert(false && "Too many LOD levels for the octree keys!");
+		return false;
+	}
+
+	// the extents of the nodes in each level
+	m_CellExtents.resize(m_LodLevels);
+	auto levelExtents = map.GetExtents();
+	for(int lodLevel = m_LodLevels - 1; lodLevel >= 0; --lodLevel) {
+		m_CellExtents[lodLevel] = XMFLOAT3(levelExtents.x, levelExtents.y, levelExtents.z);
+		levelExtents.x /= 2;
+		levelExtents.y /= 2;
+		levelExtents.z /= 2;
+	}
+
+	return true;
+}
+
+bool VoxelLodOctree::Build(const PolygonSurface& map)
+{
+	if(!InitializeLevels(map))
+		return false;
+
+	// The complete octree is built first one depth at a time. The children of
+	// the node with index i are at indices [8 * i, 8 * i + 8) in the next depth
+	struct BuildNode
+	{
+		unsigned Key;
+		unsigned Id;
+		bool IsUsed;
+	};
+	typedef std::vector<BuildNode> BuildNodesVec;
+	std::vector<BuildNodesVec> depths(m_LodLevels);
+
+	BuildNode root = { MakeNodeKey(m_LodLevels - 1, 0, 0, 0), PolygonSurface::INVALID_ID, false };
+	depths[0].push_back(root);
+
+	typedef std::unordered_map<unsigned, const BlockPolygons*> BlocksIndex;
+	BlocksIndex blocksIndex;
+
+	for(auto depth = 0u; depth < m_LodLevels; ++depth) {
+		const auto lodLevel = m_LodLevels - 1 - depth;
+
+		// index all the blocks of the level by their cell so that each node
+		// finds it's block with a single lookup
+		const auto blocksCnt = map.GetBlocksForLevelCount(lodLevel);
+		blocksIndex.clear();
+		blocksIndex.reserve(blocksCnt);
+		for (auto bit = 0u; bit < blocksCnt; ++bit) {
+			auto block = map.GetBlockForLevel(lodLevel, bit);
+			const auto inserted = blocksIndex.insert(std::make_pair(GetBlockKey(lodLevel, *block), block));
+			assert(inserted.second && "Two blocks share the same cell!");
+		}
+
+		auto& currentLevelNodes = depths[depth];
+		const auto nodesCnt = currentLevelNodes.size();
+		if(lodLevel > 0) {
+			depths[depth + 1].reserve(nodesCnt * 8);
+		}
+
+		for(auto nodeId = 0u; nodeId < nodesCnt; ++nodeId) {
+			auto& currentNode = currentLevelNodes[nodeId];
+
+			// look for a polygon block to assign to this node
+			auto blockIt = blocksIndex.find(currentNode.Key);
+			if(blockIt != blocksIndex.end()) {
+				auto block = blockIt->second;
+				currentNode.Id = block->GetId();
+				++m_NonEmptyNodes;
+
+				#ifdef _DEBUG
+				// assert that the corners are the same
+				XMFLOAT3 nodeMinCorner;
+				XMFLOAT3 nodeMaxCorner;
+				GetNodeBounds(currentNode.Key, nodeMinCorner, nodeMaxCorner);
+
+				UINT areEqual;
+				const auto currentNodeMin = XMLoadFloat3(&nodeMinCorner);
+				const auto minCorner = block->GetMinimalCorner();
+				const auto blockMin = XMLoadFloat3(&minCorner);
+				XMVectorEqualIntR(&areEqual, currentNodeMin, blockMin);
+				assert(XMComparisonAllTrue(areEqual));
+
+				const auto currentNodeMax = XMLoadFloat3(&nodeMaxCorner);
+				const auto maxCorner = block->GetMaximalCorner();
+				const auto blockMax = XMLoadFloat3(&maxCorner);
+				XMVectorEqualIntR(&areEqual, currentNodeMax, blockMax);
+				assert(XMComparisonAllTrue(areEqual));
+				#endif
+			}
+
+			if(lodLevel > 0) {
+				// create all the children
+				for(auto child = 0u; child < 8; ++child) {
+					BuildNode childNode = { GetChildKey(currentNode.Key, child), PolygonSurface::INVALID_ID, false };
+					depths[depth + 1].push_back(childNode);
+				}
+			}
+		}
+	}
+
+	#ifdef _DEBUG
+	// assert that all blocks are in the octree
+	auto blockTotalCnt = 0u;
+	for(auto lodLevel = 0u; lodLevel < m_LodLevels; ++lodLevel) {
+		blockTotalCnt += map.GetBlocksForLevelCount(lodLevel);
+	}
+	assert(blockTotalCnt == m_NonEmptyNodes);
+	#endif
+
+	// Prune all empty nodes - a node is kept if it has a block or a kept child
+	std::vector<unsigned> usedPerDepth(m_LodLevels);
+	for(int depth = m_LodLevels - 1; depth >= 0; --depth) {
+		auto& currentLevelNodes = depths[depth];
+		const auto nodesCnt = currentLevelNodes.size();
+		for(auto nodeId = 0u; nodeId < nodesCnt; ++nodeId) {
+			auto& node = currentLevelNodes[nodeId];
+			node.IsUsed = node.Id != PolygonSurface::INVALID_ID;
+			if(depth + 1 < int(m_LodLevels)) {
+				for(auto child = 0u; child < 8; ++child) {
+					node.IsUsed |= depths[depth + 1][nodeId * 8 + child].IsUsed;
+				}
+			}
+			// the root is always kept
+			node.IsUsed |= (depth == 0);
+			usedPerDepth[depth] += node.IsUsed;
+		}
+	}
+
+	// Lay out the kept nodes breadth-first
+	auto totalNodes = 0u;
+	for(auto depth = 0u; depth < m_LodLevels; ++depth) {
+		totalNodes += usedPerDepth[depth];
+	}
+	m_Nodes.reserve(totalNodes);
+
+	auto nextDepthStart = 0u;
+	for(auto depth = 0u; depth < m_LodLevels; ++depth) {
+		nextDepthStart += usedPerDepth[depth];
+		auto childCursor = nextDepthStart;
+
+		const auto& currentLevelNodes = depths[depth];
+		const auto nodesCnt = currentLevelNodes.size();
+		for(auto nodeId = 0u; nodeId < nodesCnt; ++nodeId) {
+			const auto& buildNode = currentLevelNodes[nodeId];
+			if(!buildNode.IsUsed)
+				continue;
+
+			Node node;
+			node.Id = buildNode.Id;
+			node.Key = buildNode.Key;
+			node.ChildMask = 0;
+			node.FirstChild = childCursor;
+			if(depth + 1 < m_LodLevels) {
+				for(auto child = 0u; child < 8; ++child) {
+					if(depths[depth + 1][nodeId * 8 + child].IsUsed) {
+						node.ChildMask |= (1 << child);
+					}
+				}
+			}
+			childCursor += CountChildren(node.ChildMask);
+
+			m_Nodes.push_back(node);
+		}
+	}
+	assert(m_Nodes.size() == totalNodes);
+
+	m_RejectingPlanes.assign(m_Nodes.size(), NO_REJECTING_PLANE);
+	m_SettledNodes.assign(m_Nodes.size(), 0);
+
+	const NormalCone noCone = { XMFLOAT3(0, 0, 0), -1, 0 };
+	m_NormalCones.assign(m_Nodes.size(), noCone);
+	for(auto lodLevel = 0u; lodLevel < m_LodLevels; ++lodLevel) {
+		const auto blocksCnt = map.GetBlocksForLevelCount(lodLevel);
+		for(auto bit = 0u; bit < blocksCnt; ++bit) {
+			const auto block = map.GetBlockForLevel(lodLevel, bit);
+			m_NormalCones[FindNode(GetBlockKey(lodLevel, *block))] = ComputeNormalCone(*block);
+		}
+	}
+	BuildSolidHeights();
+	BuildNodeBiases();
+
+	return true;
+}
+
+bool VoxelLodOctree::Update(const PolygonSurface& map, const float3pair& modified)
+{
+	const auto extents = map.GetExtents();
+	if(m_Nodes.empty()
+		|| map.GetLevelsCount() != m_LodLevels
+		|| extents.x != m_CellExtents[m_LodLevels - 1].x
+		|| extents.y != m_CellExtents[m_LodLevels - 1].y
+		|| extents.z != m_CellExtents[m_LodLevels - 1].z)
+	{
+		return Build(map);
+	}
+
+	// The blocks next to the box read the modified voxels on their borders so they
+	// are recalculated too - take one more block of the finest level on each side
+	const auto& margin = m_CellExtents[0];
+	const XMFLOAT3 boxMin(modified.first.x - margin.x, modified.first.y - margin.y, modified.first.z - margin.z);
+	const XMFLOAT3 boxMax(modified.second.x + margin.x, modified.second.y + margin.y, modified.second.z + margin.z);
+	const auto isInBox = [&](const XMFLOAT3& minCorner, const XMFLOAT3& maxCorner) {
+		return minCorner.x <= boxMax.x && maxCorner.x >= boxMin.x
+			&& minCorner.y <= boxMax.y && maxCorner.y >= boxMin.y
+			&& minCorner.z <= boxMax.z && maxCorner.z >= boxMin.z;
+	};
+
+	// the blocks in the box by the keys of their nodes
+	KeyIdsMap blocksInBox;
+	std::vector<std::pair<unsigned, const BlockPolygons*>> recalculatedBlocks;
+	auto blockTotalCnt = 0u;
+	for(auto lodLevel = 0u; lodLevel < m_LodLevels; ++lodLevel) {
+		const auto blocksCnt = map.GetBlocksForLevelCount(lodLevel);
+		blockTotalCnt += blocksCnt;
+		for(auto bit = 0u; bit < blocksCnt; ++bit) {
+			auto block = map.GetBlockForLevel(lodLevel, bit);
+
+			// NB: The corners of a block are the same as the bounds of it's node
+			const auto minCorner = block->GetMinimalCorner();
+			const auto maxCorner = block->GetMaximalCorner();
+			if(!isInBox(XMFLOAT3(minCorner.x, minCorner.y, minCorner.z), XMFLOAT3(maxCorner.x, maxCorner.y, maxCorner.z)))
+				continue;
+
+			const auto key = GetBlockKey(lodLevel, *block);
+			blocksInBox.insert(std::make_pair(key, block->GetId()));
+			recalculatedBlocks.push_back(std::make_pair(key, block));
+		}
+	}
+
+	// Give the nodes in the box their new blocks. A node outside of the box has all it's
+	// children outside too so only the paths to the box are visited
+	auto hasEmptyLeaves = false;
+	XMFLOAT3 nodeMinCorner;
+	XMFLOAT3 nodeMaxCorner;
+	NodeIndicesVec unvisitedNodes(1, 0);
+	while(!unvisitedNodes.empty()) {
+		auto& node = m_Nodes[unvisitedNodes.back()];
+		unvisitedNodes.pop_back();
+		GetNodeBounds(node.Key, nodeMinCorner, nodeMaxCorner);
+		if(!isInBox(nodeMinCorner, nodeMaxCorner))
+			continue;
+
+		auto id = PolygonSurface::INVALID_ID;
+		auto block = blocksInBox.find(node.Key);
+		if(block != blocksInBox.end()) {
+			id = block->second;
+			blocksInBox.erase(block);
+		}
+
+		if(node.Id != id) {
+			m_NonEmptyNodes -= (node.Id != PolygonSurface::INVALID_ID);
+			m_NonEmptyNodes += (id != PolygonSurface::INVALID_ID);
+			node.Id = id;
+			hasEmptyLeaves |= (id == PolygonSurface::INVALID_ID && !node.ChildMask);
+		}
+
+		const auto childrenCnt = CountChildren(node.ChildMask);
+		for(auto child = 0u; child < childrenCnt; ++child) {
+			unvisitedNodes.push_back(node.FirstChild + child);
+		}
+	}
+
+	// the blocks left have no nodes yet - the nodes are laid out again only if some have to be added or removed
+	if(!blocksInBox.empty() || hasEmptyLeaves) {
+		PatchLayout(blocksInBox);
+	}
+	// the coherent states keep node indices and decisions that might be wrong now
+	m_BuildId = GetNextBuildId();
+
+	// blocks were added or removed outside of the box - the octree can't be patched
+	if(blockTotalCnt != m_NonEmptyNodes) {
+		SLLOG(Sev_Warning, Fac_Rendering, "LOD octree: ", m_NonEmptyNodes, " blocks after patching instead of ", blockTotalCnt
+			, " - blocks changed outside of the modified box, building the octree from scratch");
+		return Build(map);
+	}
+
+	// the triangles of all the blocks in the box might have changed
+	std::for_each(recalculatedBlocks.cbegin(), recalculatedBlocks.cend(), [&](const std::pair<unsigned, const BlockPolygons*>& block) {
+		m_NormalCones[FindNode(block.first)] = ComputeNormalCone(*block.second);
+	});
+	BuildSolidHeights();
+	BuildNodeBiases();
+
+	#ifdef _DEBUG
+	std::for_each(m_Nodes.cbegin(), m_Nodes.cend(), [&](const Node& node) {
+		assert((node.Id != PolygonSurface::INVALID_ID || node.ChildMask || &node == &m_Nodes[0]) && "Empty leaf left in the octree!");
+	});
+	#endif
+
+	return true;
+}
+
+void VoxelLodOctree::PatchLayout(const KeyIdsMap& addedBlocks)
+{
+	static const unsigned NO_OLD_NODE = ~0u;
+	struct PatchNode
+	{
+		unsigned Key;
+		unsigned Id;
+		unsigned OldNode;
+		unsigned char ChildMask;
+		bool IsUsed;
+
+		bool operator<(const PatchNode& other) const { return Key < other.Key; }
+	};
+	typedef std::vector<PatchNode> PatchNodesVec;
+
+	// The nodes of each depth sorted by key are in breadth-first order - the old
+	// nodes already are. The new ones come with all their missing ancestors
+	std::vector<PatchNodesVec> depths(m_LodLevels);
+	std::vector<PatchNodesVec> addedNodes(m_LodLevels);
+	for(auto nodeId = 0u; nodeId < m_Nodes.size(); ++nodeId) {
+		const auto& node = m_Nodes[nodeId];
+		PatchNode patchNode = { node.Key, node.Id, nodeId, 0, false };
+		depths[m_LodLevels - 1 - GetKeyLevel(node.Key)].push_back(patchNode);
+	}
+	std::for_each(addedBlocks.cbegin(), addedBlocks.cend(), [&](const KeyIdsMap::value_type& block) {
+		PatchNode patchNode = { block.first, block.second, NO_OLD_NODE, 0, false };
+		addedNodes[m_LodLevels - 1 - GetKeyLevel(patchNode.Key)].push_back(patchNode);
+		for(auto level = GetKeyLevel(patchNode.Key) + 1; level < m_LodLevels; ++level) {
+			patchNode.Key = GetParentKey(patchNode.Key);
+			patchNode.Id = PolygonSurface::INVALID_ID;
+			addedNodes[m_LodLevels - 1 - level].push_back(patchNode);
+		}
+	});
+
+	PatchNodesVec merged;
+	for(auto depth = 0u; depth < m_LodLevels; ++depth) {
+		auto& added = addedNodes[depth];
+		if(added.empty())
+			continue;
+		std::sort(added.begin(), added.end());
+
+		// an added node might already be there as an ancestor of an old or another added node
+		auto& nodes = depths[depth];
+		merged.clear();
+		merged.reserve(nodes.size() + added.size());
+		std::merge(nodes.cbegin(), nodes.cend(), added.cbegin(), added.cend(), std::back_inserter(merged));
+		nodes.clear();
+		std::for_each(merged.cbegin(), merged.cend(), [&](const PatchNode& node) {
+			if(!nodes.empty() && nodes.back().Key == node.Key) {
+				auto& kept = nodes.back();
+				if(kept.Id == PolygonSurface::INVALID_ID) {
+					kept.Id = node.Id;
+				}
+				kept.OldNode = std::min(kept.OldNode, node.OldNode);
+			} else {
+				nodes.push_back(node);
+			}
+		});
+	}
+
+	// Prune the empty nodes bottom-up like Build does - a node is kept if it has a block or a kept child
+	for(int depth = m_LodLevels - 1; depth >= 0; --depth) {
+		auto childCursor = 0u;
+		std::for_each(depths[depth].begin(), depths[depth].end(), [&](PatchNode& node) {
+			if(depth + 1 < int(m_LodLevels)) {
+				const auto& children = depths[depth + 1];
+				for(; childCursor < children.size() && GetParentKey(children[childCursor].Key) == node.Key; ++childCursor) {
+					if(children[childCursor].IsUsed) {
+						node.ChildMask |= 1 << (children[childCursor].Key & 7);
+					}
+				}
+			}
+			// the root is always kept
+			node.IsUsed = node.Id != PolygonSurface::INVALID_ID || node.ChildMask || depth == 0;
+		});
+		assert((depth + 1 == int(m_LodLevels) || childCursor == depths[depth + 1].size()) && "Octree node without a parent!");
+	}
+
+	// Lay out the kept nodes breadth-first. The old nodes keep their cached culling data
+	auto oldRejectingPlanes = std::move(m_RejectingPlanes);
+	auto oldSettledNodes = std::move(m_SettledNodes);
+	auto oldNormalCones = std::move(m_NormalCones);
+	const NormalCone noCone = { XMFLOAT3(0, 0, 0), -1, 0 };
+	m_Nodes.clear();
+	m_RejectingPlanes.clear();
+	m_SettledNodes.clear();
+	m_NormalCones.clear();
+	m_NonEmptyNodes = 0;
+
+	auto nextDepthStart = 0u;
+	for(auto depth = 0u; depth < m_LodLevels; ++depth) {
+		nextDepthStart += unsigned(std::count_if(depths[depth].cbegin(), depths[depth].cend(), [](const PatchNode& node) {
+			return node.IsUsed;
+		}));
+		auto childCursor = nextDepthStart;
+
+		std::for_each(depths[depth].cbegin(), depths[depth].cend(), [&](const PatchNode& patchNode) {
+			if(!patchNode.IsUsed)
+				return;
+
+			Node node;
+			node.Id = patchNode.Id;
+			node.Key = patchNode.Key;
+			node.ChildMask = patchNode.ChildMask;
+			node.FirstChild = childCursor;
+			childCursor += CountChildren(node.ChildMask);
+			m_Nodes.push_back(node);
+
+			m_RejectingPlanes.push_back(patchNode.OldNode != NO_OLD_NODE ? oldRejectingPlanes[patchNode.OldNode] : NO_REJECTING_PLANE);
+			m_SettledNodes.push_back(patchNode.OldNode != NO_OLD_NODE ? oldSettledNodes[patchNode.OldNode] : 0);
+			m_NormalCones.push_back(patchNode.OldNode != NO_OLD_NODE ? oldNormalCones[patchNode.OldNode] : noCone);
+			m_NonEmptyNodes += (node.Id != PolygonSurface::INVALID_ID);
+		});
+	}
+}
+
+// The header of a saved octree. It's followed by the block index of each node in it's
+// LOD level of the map and then the child mask of each node, both in breadth-first order.
+// The rest of the node data comes from the order of the nodes
+struct SavedOctreeHeader
+{
+	char Magic[4];
+	unsigned Version;
+	unsigned long long Key;
+	unsigned LodLevels;
+	unsigned NodesCount;
+	unsigned NonEmptyNodes;
+	float Extents[3];
+};
+
+static const char SAVED_OCTREE_MAGIC[4] = { 'V', 'L', 'O', 'D' };
+// change when the layout of the saved octrees changes
+static const unsigned SAVED_OCTREE_VERSION = 2;
+
+void VoxelLodOctree::Save(const PolygonSurface& map, unsigned long long key, std::vector<char>& blob) const
+{
+	// Blocks are saved by their index in the map - the ids might be
+	// different the next time the same grid is polygonized
+	KeyIdsMap blockIndices;
+	blockIndices.reserve(m_NonEmptyNodes);
+	for(auto lodLevel = 0u; lodLevel < m_LodLevels; ++lodLevel) {
+		const auto blocksCnt = map.GetBlocksForLevelCount(lodLevel);
+		for(auto bit = 0u; bit < blocksCnt; ++bit) {
+			blockIndices.insert(std::make_pair(map.GetBlockForLevel(lodLevel, bit)->GetId(), bit));
+		}
+	}
+
+	SavedOctreeHeader header;
+	std::copy(SAVED_OCTREE_MAGIC, SAVED_OCTREE_MAGIC + 4, header.Magic);
+	header.Version = SAVED_OCTREE_VERSION;
+	header.Key = key;
+	header.LodLevels = m_LodLevels;
+	header.NodesCount = unsigned(m_Nodes.size());
+	header.NonEmptyNodes = m_NonEmptyNodes;
+	const auto extents = map.GetExtents();
+	header.Extents[0] = extents.x;
+	header.Extents[1] = extents.y;
+	header.Extents[2] = extents.z;
+
+	const auto nodesCnt = m_Nodes.size();
+	blob.resize(sizeof(SavedOctreeHeader) + nodesCnt * (sizeof(unsigned) + sizeof(unsigned char) + sizeof(NormalCone)));
+	memcpy(&blob[0], &header, sizeof(SavedOctreeHeader));
+	auto blockIndicesOut = &blob[sizeof(SavedOctreeHeader)];
+	auto childMasksOut = blockIndicesOut + nodesCnt * sizeof(unsigned);
+	auto normalConesOut = childMasksOut + nodesCnt;
+	for(auto nodeId = 0u; nodeId < nodesCnt; ++nodeId) {
+		const auto& node = m_Nodes[nodeId];
+		auto blockIndex = PolygonSurface::INVALID_ID;
+		if(node.Id != PolygonSurface::INVALID_ID) {
+			const auto index = blockIndices.find(node.Id);
+			assert(index != blockIndices.end() && "Saving an octree for a different map!");
+			blockIndex = index->second;
+		}
+		memcpy(blockIndicesOut + nodeId * sizeof(unsigned), &blockIndex, sizeof(unsigned));
+		childMasksOut[nodeId] = char(node.ChildMask);
+		memcpy(normalConesOut + nodeId * sizeof(NormalCone), &m_NormalCones[nodeId], sizeof(NormalCone));
+	}
+}
+
+bool VoxelLodOctree::Load(const PolygonSurface& map, unsigned long long key, const char* blob, size_t blobSize)
+{
+	SavedOctreeHeader header;
+	if(blobSize < sizeof(SavedOctreeHeader))
+		return false;
+	memcpy(&header, blob, sizeof(SavedOctreeHeader));
+
+	const auto extents = map.GetExtents();
+	if(!std::equal(SAVED_OCTREE_MAGIC, SAVED_OCTREE_MAGIC + 4, header.Magic)
+		|| header.Version != SAVED_OCTREE_VERSION
+		|| header.Key != key
+		|| header.LodLevels != map.GetLevelsCount()
+		|| header.Extents[0] != extents.x
+		|| header.Extents[1] != extents.y
+		|| header.Extents[2] != extents.z
+		|| !header.NodesCount
+		|| blobSize != sizeof(SavedOctreeHeader) + size_t(header.NodesCount) * (sizeof(unsigned) + sizeof(unsigned char) + sizeof(NormalCone)))
+	{
+		return false;
+	}
+
+	if(!InitializeLevels(map))
+		return false;
+
+	// Lay out the nodes again - the children of the nodes come one after the other in the
+	// next depth so their keys and indices follow from the child masks. The blocks of the
+	// map are checked to be at the places of their nodes
+	const auto blockIndicesIn = blob + sizeof(SavedOctreeHeader);
+	const auto childMasksIn = blockIndicesIn + header.NodesCount * sizeof(unsigned);
+	const auto normalConesIn = childMasksIn + header.NodesCount;
+	m_Nodes.resize(header.NodesCount);
+	m_Nodes[0].Key = MakeNodeKey(m_LodLevels - 1, 0, 0, 0);
+	auto childCursor = 1u;
+	auto isValid = true;
+	XMFLOAT3 nodeMinCorner;
+	XMFLOAT3 nodeMaxCorner;
+	for(auto nodeId = 0u; nodeId < header.NodesCount && isValid; ++nodeId) {
+		auto& node = m_Nodes[nodeId];
+		const auto level = GetKeyLevel(node.Key);
+		node.ChildMask = (unsigned char)childMasksIn[nodeId];
+		node.FirstChild = childCursor;
+
+		const auto childrenCnt = CountChildren(node.ChildMask);
+		if((node.ChildMask && level == 0) || childCursor + childrenCnt > header.NodesCount) {
+			isValid = false;
+			break;
+		}
+		auto childId = childCursor;
+		for(unsigned childMask = node.ChildMask; childMask; childMask &= childMask - 1, ++childId) {
+			const auto childBit = childMask & (~childMask + 1);
+			m_Nodes[childId].Key = GetChildKey(node.Key, CountChildren((unsigned char)(childBit - 1)));
+		}
+		childCursor += childrenCnt;
+
+		unsigned blockIndex;
+		memcpy(&blockIndex, blockIndicesIn + nodeId * sizeof(unsigned), sizeof(unsigned));
+		node.Id = PolygonSurface::INVALID_ID;
+		if(blockIndex != PolygonSurface::INVALID_ID) {
+			if(blockIndex >= map.GetBlocksForLevelCount(level)) {
+				isValid = false;
+				break;
+			}
+			const auto block = map.GetBlockForLevel(level, blockIndex);
+			const auto minCorner = block->GetMinimalCorner();
+			const auto maxCorner = block->GetMaximalCorner();
+			GetNodeBounds(node.Key, nodeMinCorner, nodeMaxCorner);
+			isValid = minCorner.x == nodeMinCorner.x && minCorner.y == nodeMinCorner.y && minCorner.z == nodeMinCorner.z
+				&& maxCorner.x == nodeMaxCorner.x && maxCorner.y == nodeMaxCorner.y && maxCorner.z == nodeMaxCorner.z;
+			node.Id = block->GetId();
+			++m_NonEmptyNodes;
+		}
+	}
+
+	// all the blocks of the map must be in the octree
+	auto blockTotalCnt = 0u;
+	for(auto lodLevel = 0u; lodLevel < m_LodLevels; ++lodLevel) {
+		blockTotalCnt += map.GetBlocksForLevelCount(lodLevel);
+	}
+	if(!isValid || childCursor != header.NodesCount || m_NonEmptyNodes != header.NonEmptyNodes || m_NonEmptyNodes != blockTotalCnt) {
+		m_Nodes.clear();
+		m_NonEmptyNodes = 0;
+		return false;
+	}
+
+	m_RejectingPlanes.assign(m_Nodes.size(), NO_REJECTING_PLANE);
+	m_SettledNodes.assign(m_Nodes.size(), 0);
+	m_NormalCones.resize(m_Nodes.size());
+	memcpy(&m_NormalCones[0], normalConesIn, m_Nodes.size() * sizeof(NormalCone));
+	BuildSolidHeights();
+	BuildNodeBiases();
+
+	return true;
+}
+
+VoxelLodOctree::VisibleBlocksVec VoxelLodOctree::Cull(const XMFLOAT4 frustumPlanes[6], const XMFLOAT3& cameraPosition) {
+	CullScratch scratch;
+	VisibleBlocksVec output;
+	Cull(frustumPlanes, cameraPosition, scratch, output);
+
+	return std::move(output);
+}
+
+void VoxelLodOctree::Cull(const XMFLOAT4 frustumPlanes[6], const XMFLOAT3& cameraPosition, CullScratch& scratch, VisibleBlocksVec& output, VisibleSetTracker* tracker) {
+	output.clear();
+	scratch.Selected.clear();
+
+	auto& nodesToDraw = scratch.NodesToDraw;
+	ResetNodesToDraw(nodesToDraw);
+
+	const auto selectionStart = std::chrono::high_resolution_clock::now();
+	m_LastCullStatistics = CullStatistics();
+
+	XMFLOAT3 nodeMinCorner;
+	XMFLOAT3 nodeMaxCorner;
+	unsigned rootPlaneMask = ALL_PLANES_MASK;
+	if(!m_Nodes.empty()) {
+		GetNodeBounds(m_Nodes[0].Key, nodeMinCorner, nodeMaxCorner);
+	}
+	if(m_Nodes.empty() || !ClassifyCube(frustumPlanes, nodeMinCorner, nodeMaxCorner, rootPlaneMask, m_LastCullStatistics.PlaneTests)) {
+		m_LastCullStatistics.FrustumRejectedNodes = m_Nodes.empty() ? 0 : 1;
+		if(tracker) {
+			TrackVisibleBlocks(scratch.Selected, output, *tracker);
+		}
+		return;
+	}
+
+	const FrustumPlanesSoA frustum(frustumPlanes);
+
+	// The nodes are visited breadth-first - the vector is used as a FIFO.
+	// Only visible nodes are pushed - all the children of a node are tested at once.
+	// Each node carries the frustum planes it's not completely inside of - only
+	// those have to be tested for it's children
+	auto& unvisitedNodes = scratch.UnvisitedNodes;
+	unvisitedNodes.clear();
+	TraversalEntry rootEntry = { 0, rootPlaneMask };
+	unvisitedNodes.push_back(rootEntry);
+
+	TraverseNodes(frustum, cameraPosition, unvisitedNodes, nodesToDraw, 0, nullptr, m_LastCullStatistics);
+	m_LastCullStatistics.SelectionTime = GetMicrosecondsSince(selectionStart);
+	const auto transitionStart = std::chrono::high_resolution_clock::now();
+	
+	// index the selected nodes so that the neighbours of each face are found with lookups
+	auto selectedCnt = 0u;
+	for(auto level = 0u; level < m_LodLevels; ++level) {
+		selectedCnt += unsigned(nodesToDraw[level].size());
+	}
+	auto& selectedKeys = scratch.SelectedKeys;
+	selectedKeys.Reset(selectedCnt);
+	for(auto level = 0u; level < m_LodLevels; ++level) {
+		std::for_each(nodesToDraw[level].cbegin(), nodesToDraw[level].cend(), [&](unsigned nodeId) {
+			selectedKeys.Insert(m_Nodes[nodeId].Key);
+		});
+	}
+
+	output.reserve(selectedCnt);
+	for(int level = m_LodLevels - 1; level >= 0; --level) {
+		std::for_each(nodesToDraw[level].cbegin(), nodesToDraw[level].cend(), [&](unsigned nodeId) {
+			const auto& node = m_Nodes[nodeId];
+			output.emplace_back(VisibleBlock(node.Id));
+			++m_LastCullStatistics.SelectedBlocks[level];
+
+			// we skip the transition face calculation for the nowest level nodes - they never draw transitions
+			if(level == 0) return;
+
+			FindTransitionFaces(node, selectedKeys, output.back());
+			m_LastCullStatistics.TransitionFaces += CountChildren(GetTransitionMask(output.back()));
+
+			#if VALIDATE_TRANSITION_FACES
+			// check the higher-res nodes for potential neighbours
+			VisibleBlock expected(node.Id);
+			std::for_each(nodesToDraw[level - 1].cbegin(), nodesToDraw[level - 1].cend(), [&](unsigned highNodeId) {
+				CheckForNeighbour(node, m_Nodes[highNodeId], expected);
+			});
+			assert(std::equal(expected.TransitionFaces, expected.TransitionFaces + BlockPolygons::Face_Count, output.back().TransitionFaces)
+				&& "Transition faces mismatch!");
+			#endif
+		});
+	}
+	m_LastCullStatistics.TransitionTime = GetMicrosecondsSince(transitionStart);
+
+	if(tracker || DropsBlocks()) {
+		for(int level = m_LodLevels - 1; level >= 0; --level) {
+			scratch.Selected.insert(scratch.Selected.end(), nodesToDraw[level].cbegin(), nodesToDraw[level].cend());
+		}
+		FinishOutput(cameraPosition, scratch.Selected, scratch.DrawnNodes, output, tracker);
+	}
+}
+
+void VoxelLodOctree::CullParallel(const XMFLOAT4 frustumPlanes[6], const XMFLOAT3& cameraPosition, unsigned splitDepth, ParallelCullScratch& scratch, VisibleBlocksVec& output, VisibleSetTracker* tracker) {
+	output.clear();
+	scratch.Selected.clear();
+
+	const auto selectionStart = std::chrono::high_resolution_clock::now();
+	m_LastCullStatistics = CullStatistics();
+
+	XMFLOAT3 nodeMinCorner;
+	XMFLOAT3 nodeMaxCorner;
+	unsigned rootPlaneMask = ALL_PLANES_MASK;
+	if(!m_Nodes.empty()) {
+		GetNodeBounds(m_Nodes[0].Key, nodeMinCorner, nodeMaxCorner);
+	}
+	if(m_Nodes.empty() || !ClassifyCube(frustumPlanes, nodeMinCorner, nodeMaxCorner, rootPlaneMask, m_LastCullStatistics.PlaneTests)) {
+		m_LastCullStatistics.FrustumRejectedNodes = m_Nodes.empty() ? 0 : 1;
+		if(tracker) {
+			TrackVisibleBlocks(scratch.Selected, output, *tracker);
+		}
+		return;
+	}
+
+	const FrustumPlanesSoA frustum(frustumPlanes);
+
+	// cull the top of the octree and collect the visible nodes at the split depth as tasks
+	auto& top = scratch.Top;
+	ResetNodesToDraw(top.NodesToDraw);
+	top.UnvisitedNodes.clear();
+	TraversalEntry rootEntry = { 0, rootPlaneMask };
+	top.UnvisitedNodes.push_back(rootEntry);
+
+	auto& tasks = scratch.Tasks;
+	tasks.clear();
+	const auto splitLevel = m_LodLevels - 1 - std::min(splitDepth, m_LodLevels - 1);
+	TraverseNodes(frustum, cameraPosition, top.UnvisitedNodes, top.NodesToDraw, splitLevel, &tasks, m_LastCullStatistics);
+
+	const auto tasksCnt = unsigned(tasks.size());
+	if(scratch.TaskScratches.size() < tasksCnt) {
+		scratch.TaskScratches.resize(tasksCnt);
+	}
+	scratch.TaskStatistics.assign(tasksCnt, CullStatistics());
+
+	// The subtrees share no nodes so the tasks need no synchronization. Their sizes vary a
+	// lot with the view - the scheduler balances them by stealing work between the threads
+	concurrency::parallel_for(0u, tasksCnt, [&](unsigned taskId) {
+		auto& taskScratch = scratch.TaskScratches[taskId];
+		ResetNodesToDraw(taskScratch.NodesToDraw);
+		taskScratch.UnvisitedNodes.clear();
+		taskScratch.UnvisitedNodes.push_back(tasks[taskId]);
+
+		TraverseNodes(frustum, cameraPosition, taskScratch.UnvisitedNodes, taskScratch.NodesToDraw, 0, nullptr, scratch.TaskStatistics[taskId]);
+	});
+
+	// merge in task order so that the result doesn't depend on the scheduling
+	auto& selected = scratch.Selected;
+	for(int level = m_LodLevels - 1; level >= 0; --level) {
+		selected.insert(selected.end(), top.NodesToDraw[level].cbegin(), top.NodesToDraw[level].cend());
+		for(auto taskId = 0u; taskId < tasksCnt; ++taskId) {
+			const auto& taskNodes = scratch.TaskScratches[taskId].NodesToDraw[level];
+			selected.insert(selected.end(), taskNodes.cbegin(), taskNodes.cend());
+		}
+	}
+	for(auto taskId = 0u; taskId < tasksCnt; ++taskId) {
+		const auto& taskStatistics = scratch.TaskStatistics[taskId];
+		m_LastCullStatistics.NodesVisited += taskStatistics.NodesVisited;
+		m_LastCullStatistics.PlaneTests += taskStatistics.PlaneTests;
+		m_LastCullStatistics.FrustumRejectedNodes += taskStatistics.FrustumRejectedNodes;
+	}
+	m_LastCullStatistics.SelectionTime = GetMicrosecondsSince(selectionStart);
+
+	const auto transitionStart = std::chrono::high_resolution_clock::now();
+	WriteVisibleBlocks(selected, top.SelectedKeys, output, true);
+	m_LastCullStatistics.TransitionTime = GetMicrosecondsSince(transitionStart);
+	CountSelection(selected, output);
+	FinishOutput(cameraPosition, selected, scratch.DrawnNodes, output, tracker);
+}
+
+void VoxelLodOctree::Cull(const CullView* views, unsigned viewsCount, MultiViewCullScratch& scratch, VisibleBlocksVec* outputs, VisibleSetTracker* trackers) {
+	// NB: Each batch adds it's times
+	m_LastCullStatistics = CullStatistics();
+
+	// the hysteresis and the rejecting planes of an older octree are useless
+	if(scratch.BuildId != m_BuildId) {
+		scratch.BuildId = m_BuildId;
+		scratch.Views.clear();
+	}
+	const auto knownViews = unsigned(scratch.Views.size());
+	if(knownViews < viewsCount) {
+		scratch.Views.resize(viewsCount);
+		for(auto view = knownViews; view < viewsCount; ++view) {
+			scratch.Views[view].RejectingPlanes.assign(m_Nodes.size(), NO_REJECTING_PLANE);
+			scratch.Views[view].SettledNodes.assign(m_Nodes.size(), 0);
+		}
+	}
+
+	for(auto first = 0u; first < viewsCount; first += MAX_BATCHED_VIEWS) {
+		CullViewBatch(views + first
+			, std::min(viewsCount - first, MAX_BATCHED_VIEWS)
+			, &scratch.Views[first]
+			, scratch.UnvisitedNodes
+			, scratch.Selected
+			, scratch.SelectedKeys
+			, outputs + first);
+
+		if(!trackers && !DropsBlocks())
+			continue;
+
+		// each view's output has the nodes of the batch selection that the view selected
+		const auto batchEnd = std::min(viewsCount, first + MAX_BATCHED_VIEWS);
+		for(auto view = first; view < batchEnd; ++view) {
+			const auto viewBit = 1u << (view - first);
+			scratch.ViewNodes.clear();
+			std::for_each(scratch.Selected.cbegin(), scratch.Selected.cend(), [&](const MultiViewSelection& selection) {
+				if(selection.ViewMask & viewBit) {
+					scratch.ViewNodes.push_back(selection.NodeId);
+				}
+			});
+			FinishOutput(views[view].CameraPosition, scratch.ViewNodes, scratch.ViewDrawnNodes, outputs[view], trackers ? trackers + view : nullptr);
+		}
+	}
+}
+
+bool VoxelLodOctree::Cull(const XMFLOAT4 frustumPlanes[6], const XMFLOAT3& cameraPosition, CoherentCullState& state, VisibleBlocksVec& output, VisibleSetTracker* tracker) {
+	const auto selectionStart = std::chrono::high_resolution_clock::now();
+	m_LastCullStatistics = CullStatistics();
+
+	if(m_Nodes.empty()) {
+		state.Reset();
+		state.Selected.clear();
+		output.clear();
+		if(tracker) {
+			TrackVisibleBlocks(state.Selected, output, *tracker);
+		}
+		return true;
+	}
+
+	// the last selection is only usable if it was made on this octree with the same LOD policy
+	if(state.BuildId != m_BuildId
+		|| state.Policy != m_LodPolicy
+		|| state.BackFaceCulling != m_BackFaceCulling
+		|| state.ContributionDistanceCoeff != m_ContributionDistanceCoeff
+		|| state.HorizonCulling != m_HorizonCulling)
+	{
+		state.BuildId = m_BuildId;
+		state.Policy = m_LodPolicy;
+		state.BackFaceCulling = m_BackFaceCulling;
+		state.ContributionDistanceCoeff = m_ContributionDistanceCoeff;
+		state.HorizonCulling = m_HorizonCulling;
+		state.Records.clear();
+		state.RecordOfNode.assign(m_Nodes.size(), NO_PARENT_RECORD);
+	}
+
+	// The most any distance used in a decision might have changed since the last time.
+	// A decision can't flip if it was taken with a bigger margin than that
+	auto lodChange = std::numeric_limits<float>::max();
+	auto frustumChange = std::numeric_limits<float>::max();
+	if(!state.Records.empty()) {
+		lodChange = GetCameraChange(state.CameraPosition, cameraPosition);
+		frustumChange = GetFrustumChange(state.FrustumPlanes, frustumPlanes, m_CellExtents[m_LodLevels - 1]);
+
+		const auto& root = state.Records[0];
+		if(root.LodSlack > lodChange
+			&& root.FrustumSlack > frustumChange
+			// the dropped blocks depend only on where the eye is
+			&& (state.DropSlack > lodChange || lodChange == 0))
+		{
+			if(tracker) {
+				tracker->ClearChanges();
+			}
+			m_LastCullStatistics.OutputReused = true;
+			m_LastCullStatistics.SelectionTime = GetMicrosecondsSince(selectionStart);
+			return false;
+		}
+	}
+
+	std::swap(state.Records, state.PreviousRecords);
+	std::swap(state.Selected, state.PreviousSelected);
+	auto& records = state.Records;
+	auto& selected = state.Selected;
+	const auto& previousRecords = state.PreviousRecords;
+	const auto& previousSelected = state.PreviousSelected;
+	const auto previousCount = unsigned(previousRecords.size());
+	records.clear();
+	selected.clear();
+
+	XMFLOAT3 nodeMinCorner;
+	XMFLOAT3 nodeMaxCorner;
+	GetNodeBounds(m_Nodes[0].Key, nodeMinCorner, nodeMaxCorner);
+	unsigned rootPlaneMask = ALL_PLANES_MASK;
+	auto rootSlack = std::numeric_limits<float>::max();
+	const auto isRootVisible = ClassifyCube(frustumPlanes, nodeMinCorner, nodeMaxCorner, rootPlaneMask, m_LastCullStatistics.PlaneTests, &rootSlack);
+
+	const FrustumPlanesSoA frustum(frustumPlanes);
+
+	// The nodes are visited depth-first so that the records and the selected nodes
+	// of every subtree are contiguous and can be copied over as a whole
+	auto& unvisitedNodes = state.UnvisitedNodes;
+	unvisitedNodes.clear();
+	if(isRootVisible) {
+		CoherentCullState::StackEntry rootEntry = { 0, rootPlaneMask, NO_PARENT_RECORD };
+		unvisitedNodes.push_back(rootEntry);
+	} else {
+		m_LastCullStatistics.FrustumRejectedNodes = 1;
+		CoherentRecord rootRecord = { 0, NO_PARENT_RECORD, rootPlaneMask, 1, 0, 0, std::numeric_limits<float>::max(), std::numeric_limits<float>::max() };
+		records.push_back(rootRecord);
+	}
+
+	unsigned nodeCell[3];
+	unsigned char childPlaneMasks[8];
+	CoherentCullState::StackEntry childEntries[8];
+	while(!unvisitedNodes.empty()) {
+		const auto entry = unvisitedNodes.back();
+		unvisitedNodes.pop_back();
+		const auto nodeId = entry.NodeId;
+		const auto& node = m_Nodes[nodeId];
+		const auto recordId = unsigned(records.size());
+
+		// Take the whole subtree from the last time if none of it's decisions could have flipped.
+		// If fewer planes have to be tested than the last time the results are the same - the
+		// planes left out are the ones that an ancestor is completely inside of
+		const auto previousId = state.RecordOfNode[nodeId];
+		if(previousId < previousCount) {
+			const auto& previous = previousRecords[previousId];
+			if(previous.NodeId == nodeId
+				&& !(entry.PlaneMask & ~previous.PlaneMask)
+				&& previous.LodSlack > lodChange
+				&& previous.FrustumSlack > frustumChange)
+			{
+				// NB: the offsets might "wrap around" - unsigned arithmetic takes care of it
+				const auto recordsOffset = recordId - previousId;
+				const auto selectedOffset = unsigned(selected.size()) - previous.SelectedBegin;
+				for(auto id = previousId; id < previous.SubtreeEnd; ++id) {
+					auto record = previousRecords[id];
+					record.Parent = (id == previousId) ? entry.Parent : record.Parent + recordsOffset;
+					record.SubtreeEnd += recordsOffset;
+					record.SelectedBegin += selectedOffset;
+					record.SelectedEnd += selectedOffset;
+					// make the margins relative to the current view
+					record.LodSlack -= lodChange;
+					record.FrustumSlack -= frustumChange;
+					records.push_back(record);
+				}
+				selected.insert(selected.end()
+					, previousSelected.begin() + previous.SelectedBegin
+					, previousSelected.begin() + previous.SelectedEnd);
+				continue;
+			}
+		}
+
+		++m_LastCullStatistics.NodesVisited;
+		CoherentRecord record = { nodeId
+			, entry.Parent
+			, entry.PlaneMask
+			, recordId + 1
+			, unsigned(selected.size())
+			, unsigned(selected.size())
+			, std::numeric_limits<float>::max()
+			, std::numeric_limits<float>::max() };
+
+		bool hasToPushChildren = true;
+		if(node.Id != PolygonSurface::INVALID_ID) {
+			if(!node.ChildMask || CanSettle(nodeId, cameraPosition, &record.LodSlack)) {
+				selected.push_back(nodeId);
+				hasToPushChildren = false;
+			}
+		}
+		record.SelectedEnd = unsigned(selected.size());
+
+		auto childEntriesCnt = 0u;
+		if(hasToPushChildren && node.ChildMask) {
+			const auto level = GetKeyLevel(node.Key);
+			auto visibleChildren = unsigned(node.ChildMask);
+			if(entry.PlaneMask) {
+				GetKeyCell(node.Key, nodeCell);
+				visibleChildren = ClassifyChildren(frustum
+					, ChildBoxesSoA(nodeCell, m_CellExtents[level - 1])
+					, node.ChildMask
+					, entry.PlaneMask
+					, m_RejectingPlanes[nodeId]
+					, childPlaneMasks
+					, m_LastCullStatistics.PlaneTests
+					, &record.FrustumSlack);
+				m_LastCullStatistics.FrustumRejectedNodes += CountChildren((unsigned char)(node.ChildMask & ~visibleChildren));
+			} else {
+				std::fill(childPlaneMasks, childPlaneMasks + 8, 0);
+			}
+
+			auto childId = node.FirstChild;
+			for(unsigned childMask = node.ChildMask; childMask; childMask &= childMask - 1, ++childId) {
+				const auto childBit = childMask & (~childMask + 1);
+				if(visibleChildren & childBit) {
+					CoherentCullState::StackEntry childEntry = { childId, childPlaneMasks[CountChildren((unsigned char)(childBit - 1))], recordId };
+					childEntries[childEntriesCnt++] = childEntry;
+				}
+			}
+		}
+		records.push_back(record);
+
+		// push in reverse so that the children are visited in order
+		while(childEntriesCnt) {
+			unvisitedNodes.push_back(childEntries[--childEntriesCnt]);
+		}
+	}
+
+	// the children come after their parents - gather the subtree ranges and margins bottom-up
+	for(auto id = unsigned(records.size()) - 1; id > 0; --id) {
+		const auto& record = records[id];
+		auto& parent = records[record.Parent];
+		parent.SubtreeEnd = std::max(parent.SubtreeEnd, record.SubtreeEnd);
+		parent.SelectedEnd = std::max(parent.SelectedEnd, record.SelectedEnd);
+		parent.LodSlack = std::min(parent.LodSlack, record.LodSlack);
+		parent.FrustumSlack = std::min(parent.FrustumSlack, record.FrustumSlack);
+	}
+	records[0].FrustumSlack = std::min(records[0].FrustumSlack, rootSlack);
+
+	for(auto id = 0u; id < records.size(); ++id) {
+		state.RecordOfNode[records[id].NodeId] = id;
+	}
+	state.CameraPosition = cameraPosition;
+	std::copy(frustumPlanes, frustumPlanes + 6, state.FrustumPlanes);
+
+	m_LastCullStatistics.SelectionTime = GetMicrosecondsSince(selectionStart);
+
+	// NB: The transition faces of all the selected nodes are found again - a change
+	// anywhere might have changed the neighbours of the reused nodes
+	const auto transitionStart = std::chrono::high_resolution_clock::now();
+	WriteVisibleBlocks(selected, state.SelectedKeys, output);
+	m_LastCullStatistics.TransitionTime = GetMicrosecondsSince(transitionStart);
+	CountSelection(selected, output);
+	state.DropSlack = std::numeric_limits<float>::max();
+	FinishOutput(cameraPosition, selected, state.DrawnNodes, output, tracker, &state.DropSlack);
+
+	#if VALIDATE_COHERENT_CULL
+	auto expected = Cull(frustumPlanes, cameraPosition);
+	auto actual = output;
+	const auto byId = [](const VisibleBlock& lhs, const VisibleBlock& rhs) { return lhs.Id < rhs.Id; };
+	std::sort(expected.begin(), expected.end(), byId);
+	std::sort(actual.begin(), actual.end(), byId);
+	assert(std::equal(expected.cbegin(), expected.cend(), actual.cbegin(), [](const VisibleBlock& lhs, const VisibleBlock& rhs) {
+			return lhs.Id == rhs.Id
+				&& std::equal(lhs.TransitionFaces, lhs.TransitionFaces + BlockPolygons::Face_Count, rhs.TransitionFaces);
+		}) && expected.size() == actual.size() && "Coherent cull mismatch!");
+	#endif
+
+	return true;
+}
+
+bool VoxelLodOctree::CullBudgeted(const XMFLOAT4 frustumPlanes[6], const XMFLOAT3& cameraPosition, unsigned budgetMicroseconds, BudgetedCullState& state, VisibleBlocksVec& output, VisibleSetTracker* tracker) {
+	const auto selectionStart = std::chrono::high_resolution_clock::now();
+	const auto deadline = selectionStart + std::chrono::microseconds(budgetMicroseconds);
+	m_LastCullStatistics = CullStatistics();
+
+	state.Selected.clear();
+	if(m_Nodes.empty()) {
+		state.Reset();
+		output.clear();
+		if(tracker) {
+			TrackVisibleBlocks(state.Selected, output, *tracker);
+		}
+		return true;
+	}
+
+	// the front of another octree or LOD policy is useless - start from the root
+	if(state.BuildId != m_BuildId || state.Policy != m_LodPolicy || state.FrontNodes.empty()) {
+		state.BuildId = m_BuildId;
+		state.Policy = m_LodPolicy;
+		state.Frame = 0;
+		state.FrontNodes.clear();
+		state.InFront.assign(m_Nodes.size(), 0);
+		state.Visible.assign(m_Nodes.size(), 0);
+		state.BlockedFrames.assign(m_Nodes.size(), 0);
+		state.NextExamined = 0;
+		AddToFront(0, state);
+	}
+	const auto frame = ++state.Frame;
+	const auto isRemoved = [&](unsigned nodeId) { return !state.InFront[nodeId]; };
+
+	// the front can only be merged into nodes with blocks - the nearest such ancestor is a candidate
+	const auto addMergeCandidate = [&](unsigned key) {
+		while(GetKeyLevel(key) + 1 < m_LodLevels) {
+			key = GetParentKey(key);
+			const auto nodeId = FindNode(key);
+			if(m_Nodes[nodeId].Id != PolygonSurface::INVALID_ID) {
+				state.MergeCandidates[GetKeyLevel(key)].push_back(nodeId);
+				return;
+			}
+		}
+	};
+
+	// the time is checked every that many steps of a pass
+	const auto isOutOfTime = [&](unsigned step, unsigned interval) {
+		return step && !(step % interval) && std::chrono::high_resolution_clock::now() >= deadline;
+	};
+	auto hasTime = true;
+	auto isComplete = true;
+
+	// Merge the children that don't have to be drawn any more - the finest first so that the merged
+	// nodes can be merged further. When the time runs out the merging stops - the front stays finer
+	state.MergeCandidates.resize(m_LodLevels);
+	std::for_each(state.MergeCandidates.begin(), state.MergeCandidates.end(), [](NodeIndicesVec& candidates) {
+		candidates.clear();
+	});
+	auto mergeSteps = 0u;
+	for(auto id = 0u; id < state.FrontNodes.size(); ++id) {
+		if(isOutOfTime(++mergeSteps, BUDGET_CHECK_NODES)) {
+			hasTime = false;
+			break;
+		}
+		addMergeCandidate(m_Nodes[state.FrontNodes[id]].Key);
+	}
+	for(auto level = 1u; level < m_LodLevels && hasTime; ++level) {
+		auto& candidates = state.MergeCandidates[level];
+		std::sort(candidates.begin(), candidates.end());
+		candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+		// NB: Merging only adds candidates in the levels above
+		for(auto candidate = candidates.cbegin(); candidate != candidates.cend(); ++candidate) {
+			if(isOutOfTime(++mergeSteps, BUDGET_CHECK_NODES)) {
+				hasTime = false;
+				break;
+			}
+
+			const auto nodeId = *candidate;
+			if(state.InFront[nodeId] || !IsFrontUnder(nodeId, state))
+				continue;
+			if(IsNodeVisible(frustumPlanes, nodeId) && !CanSettle(nodeId, cameraPosition))
+				continue;
+			if(HasFinerNeighbours(nodeId, state))
+				continue;
+
+			const auto& node = m_Nodes[nodeId];
+			const auto childrenCnt = CountChildren(node.ChildMask);
+			for(auto child = 0u; child < childrenCnt; ++child) {
+				RemoveFromFront(node.FirstChild + child, state);
+			}
+			AddToFront(nodeId, state);
+			addMergeCandidate(node.Key);
+		}
+	}
+	state.FrontNodes.erase(std::remove_if(state.FrontNodes.begin(), state.FrontNodes.end(), isRemoved), state.FrontNodes.end());
+
+	// Examine the front starting roughly where the last Cull ran out of time, so every node gets examined
+	// eventually. The nodes left when the time runs out are drawn and not split - drawing a block outside of
+	// the frustum is only wasted work while dropping a visible one would leave a hole
+	state.Splits.clear();
+	const auto frontCnt = unsigned(state.FrontNodes.size());
+	const auto firstExamined = frontCnt ? state.NextExamined % frontCnt : 0;
+	for(auto examined = 0u; examined < frontCnt; ++examined) {
+		const auto id = (firstExamined + examined) % frontCnt;
+		if(hasTime && isOutOfTime(examined, BUDGET_CHECK_NODES)) {
+			hasTime = false;
+			state.NextExamined = id;
+		}
+		if(!hasTime) {
+			state.Visible[state.FrontNodes[id]] = 1;
+			continue;
+		}
+		ExamineFrontNode(state.FrontNodes[id], frustumPlanes, cameraPosition, state);
+	}
+
+	// Split the nodes that the LOD policy wants finer - the nearest first
+	auto splitsCnt = 0u;
+	while(hasTime && !state.Splits.empty()) {
+		if(isOutOfTime(++splitsCnt, BUDGET_CHECK_INTERVAL)) {
+			hasTime = false;
+			break;
+		}
+
+		std::pop_heap(state.Splits.begin(), state.Splits.end());
+		const auto entry = state.Splits.back();
+		state.Splits.pop_back();
+		if(!state.InFront[entry.NodeId] || state.BlockedFrames[entry.NodeId] == frame)
+			continue;
+
+		// The coarser neighbours have to be split first so that the front stays at most one level
+		// apart. The LOD policy splits them anyway when the node is split in a complete front
+		auto nodeId = entry.NodeId;
+		auto blocker = FindCoarserNeighbour(nodeId, state);
+		while(blocker != PolygonSurface::INVALID_ID && m_Nodes[blocker].ChildMask) {
+			nodeId = blocker;
+			blocker = FindCoarserNeighbour(nodeId, state);
+		}
+		if(blocker != PolygonSurface::INVALID_ID) {
+			// a coarser neighbour has no children - the node stays as it is for this frame
+			// and the front isn't what a full Cull would select
+			state.BlockedFrames[entry.NodeId] = frame;
+			isComplete = false;
+			continue;
+		}
+		if(nodeId != entry.NodeId) {
+			// the node is tried again after it's neighbour
+			state.Splits.push_back(entry);
+			std::push_heap(state.Splits.begin(), state.Splits.end());
+		}
+
+		RemoveFromFront(nodeId, state);
+		const auto& node = m_Nodes[nodeId];
+		const auto childrenCnt = CountChildren(node.ChildMask);
+		const auto firstAdded = unsigned(state.FrontNodes.size());
+		for(auto child = 0u; child < childrenCnt; ++child) {
+			AddToFront(node.FirstChild + child, state);
+		}
+		for(auto id = firstAdded; id < state.FrontNodes.size(); ++id) {
+			ExamineFrontNode(state.FrontNodes[id], frustumPlanes, cameraPosition, state);
+		}
+	}
+	state.FrontNodes.erase(std::remove_if(state.FrontNodes.begin(), state.FrontNodes.end(), isRemoved), state.FrontNodes.end());
+
+	isComplete &= hasTime;
+
+	std::copy_if(state.FrontNodes.cbegin(), state.FrontNodes.cend(), std::back_inserter(state.Selected), [&](unsigned nodeId) {
+		return state.Visible[nodeId] != 0;
+	});
+	m_LastCullStatistics.SelectionTime = GetMicrosecondsSince(selectionStart);
+
+	const auto transitionStart = std::chrono::high_resolution_clock::now();
+	WriteVisibleBlocks(state.Selected, state.SelectedKeys, output);
+	m_LastCullStatistics.TransitionTime = GetMicrosecondsSince(transitionStart);
+	CountSelection(state.Selected, output);
+	FinishOutput(cameraPosition, state.Selected, state.DrawnNodes, output, tracker);
+
+	return isComplete;
+}
+
+void VoxelLodOctree::TraverseNodes(const FrustumPlanesSoA& frustum
+	, const XMFLOAT3& cameraPosition
+	, std::vector<TraversalEntry>& unvisitedNodes
+	, std::vector<NodeIndicesVec>& nodesToDraw
+	, unsigned splitLevel
+	, std::vector<TraversalEntry>* splitNodes
+	, CullStatistics& statistics)
+{
+	unsigned nodeCell[3];
+	unsigned char childPlaneMasks[8];
+	for(auto current = 0u; current < unvisitedNodes.size(); ++current) {
+		const auto entry = unvisitedNodes[current];
+		const auto nodeId = entry.NodeId;
+		const auto& node = m_Nodes[nodeId];
+		const auto level = GetKeyLevel(node.Key);
+
+		if(splitNodes && level == splitLevel) {
+			splitNodes->push_back(entry);
+			continue;
+		}
+		++statistics.NodesVisited;
+
+		bool hasToPushChildren = true;
+		if(node.Id != PolygonSurface::INVALID_ID) {
+			if(!node.ChildMask) {
+				// push this because it has no children anyway - a leaf
+				nodesToDraw[level].push_back(nodeId);
+				hasToPushChildren = false;
+			} else {
+				if(CanSettle(nodeId, cameraPosition)) {
+					// settle for this node	- it is far away
+					nodesToDraw[level].push_back(nodeId);
+					hasToPushChildren = false;
+				}
+			}
+		}
+
+		if(hasToPushChildren && node.ChildMask) {
+			auto visibleChildren = unsigned(node.ChildMask);
+			if(entry.PlaneMask) {
+				GetKeyCell(node.Key, nodeCell);
+				visibleChildren = ClassifyChildren(frustum
+					, ChildBoxesSoA(nodeCell, m_CellExtents[level - 1])
+					, node.ChildMask
+					, entry.PlaneMask
+					, m_RejectingPlanes[nodeId]
+					, childPlaneMasks
+					, statistics.PlaneTests);
+				statistics.FrustumRejectedNodes += CountChildren((unsigned char)(node.ChildMask & ~visibleChildren));
+			} else {
+				// completely inside the frustum - so are all the children
+				std::fill(childPlaneMasks, childPlaneMasks + 8, 0);
+			}
+
+			auto childId = node.FirstChild;
+			for(unsigned childMask = node.ChildMask; childMask; childMask &= childMask - 1, ++childId) {
+				const auto childBit = childMask & (~childMask + 1);
+				if(visibleChildren & childBit) {
+					TraversalEntry childEntry = { childId, childPlaneMasks[CountChildren((unsigned char)(childBit - 1))] };
+					unvisitedNodes.push_back(childEntry);
+				}
+			}
+		}
+	}
+}
+
+void VoxelLodOctree::CullViewBatch(const CullView* views
+	, unsigned viewsCount
+	, MultiViewCullScratch::ViewData* viewData
+	, std::vector<MultiViewEntry>& unvisitedNodes
+	, std::vector<MultiViewSelection>& selected
+	, NodeKeyViewsMap& selectedKeys
+	, VisibleBlocksVec* outputs)
+{
+	assert(viewsCount <= MAX_BATCHED_VIEWS);
+
+	for(auto view = 0u; view < viewsCount; ++view) {
+		outputs[view].clear();
+	}
+	selected.clear();
+	if(m_Nodes.empty())
+		return;
+	const auto selectionStart = std::chrono::high_resolution_clock::now();
+
+	// The root is tested separately by each view. The views that see it start the traversal
+	FrustumPlanesSoA frusta[MAX_BATCHED_VIEWS];
+	XMFLOAT3 nodeMinCorner;
+	XMFLOAT3 nodeMaxCorner;
+	GetNodeBounds(m_Nodes[0].Key, nodeMinCorner, nodeMaxCorner);
+	MultiViewEntry rootEntry = { 0, 0 };
+	for(auto view = 0u; view < viewsCount; ++view) {
+		unsigned rootPlaneMask = ALL_PLANES_MASK;
+		if(ClassifyCube(views[view].FrustumPlanes, nodeMinCorner, nodeMaxCorner, rootPlaneMask, m_LastCullStatistics.PlaneTests)) {
+			rootEntry.ViewMask |= 1 << view;
+			rootEntry.PlaneMasks[view] = (unsigned char)rootPlaneMask;
+			frusta[view] = FrustumPlanesSoA(views[view].FrustumPlanes);
+		} else {
+			++m_LastCullStatistics.FrustumRejectedNodes;
+		}
+	}
+
+	// Breadth-first like TraverseNodes, but every node is visited once for all the views that
+	// reach it. The bounds of the node and it's children are computed once and then each view
+	// decides on the LOD and tests the children against it's own frustum.
+	// NB: Every view sees the nodes in the order in which it's own Cull would visit them. That
+	// is one depth after the other so the nodes are selected from the lowest LOD level up
+	unvisitedNodes.clear();
+	if(rootEntry.ViewMask) {
+		unvisitedNodes.push_back(rootEntry);
+	}
+
+	unsigned nodeCell[3];
+	unsigned char childPlaneMasks[8];
+	MultiViewEntry childEntries[8];
+	for(auto current = 0u; current < unvisitedNodes.size(); ++current) {
+		const auto entry = unvisitedNodes[current];
+		const auto nodeId = entry.NodeId;
+		const auto& node = m_Nodes[nodeId];
+		const auto level = GetKeyLevel(node.Key);
+		++m_LastCullStatistics.NodesVisited;
+
+		unsigned viewMask = entry.ViewMask;
+		if(node.Id != PolygonSurface::INVALID_ID) {
+			// a leaf is drawn by all the views - the others ask the LOD policy for each view
+			auto settledViews = viewMask;
+			if(node.ChildMask) {
+				settledViews = 0;
+				for(auto viewBits = viewMask; viewBits; viewBits &= viewBits - 1) {
+					const auto view = CountChildren((unsigned char)((viewBits & (~viewBits + 1)) - 1));
+					auto& wasSettled = viewData[view].SettledNodes[nodeId];
+					const auto margin = GetBiasedSettleMargin(nodeId, views[view].CameraPosition, wasSettled != 0);
+					wasSettled = margin >= 0;
+					settledViews |= unsigned(wasSettled) << view;
+				}
+			}
+
+			if(settledViews) {
+				MultiViewSelection selection = { nodeId, settledViews };
+				selected.push_back(selection);
+			}
+			viewMask &= ~settledViews;
+		}
+
+		if(!viewMask || !node.ChildMask)
+			continue;
+
+		const auto childrenCnt = CountChildren(node.ChildMask);
+		for(auto child = 0u; child < childrenCnt; ++child) {
+			MultiViewEntry childEntry = { node.FirstChild + child, 0 };
+			childEntries[child] = childEntry;
+		}
+
+		GetKeyCell(node.Key, nodeCell);
+		const ChildBoxesSoA childBoxes(nodeCell, m_CellExtents[level - 1]);
+		for(auto viewBits = viewMask; viewBits; viewBits &= viewBits - 1) {
+			const auto view = CountChildren((unsigned char)((viewBits & (~viewBits + 1)) - 1));
+
+			auto visibleChildren = unsigned(node.ChildMask);
+			if(entry.PlaneMasks[view]) {
+				visibleChildren = ClassifyChildren(frusta[view]
+					, childBoxes
+					, node.ChildMask
+					, entry.PlaneMasks[view]
+					, viewData[view].RejectingPlanes[nodeId]
+					, childPlaneMasks
+					, m_LastCullStatistics.PlaneTests);
+				m_LastCullStatistics.FrustumRejectedNodes += CountChildren((unsigned char)(node.ChildMask & ~visibleChildren));
+			} else {
+				// completely inside the frustum - so are all the children
+				std::fill(childPlaneMasks, childPlaneMasks + 8, 0);
+			}
+
+			auto child = 0u;
+			for(unsigned childMask = node.ChildMask; childMask; childMask &= childMask - 1, ++child) {
+				const auto childBit = childMask & (~childMask + 1);
+				if(visibleChildren & childBit) {
+					childEntries[child].ViewMask |= 1 << view;
+					childEntries[child].PlaneMasks[view] = childPlaneMasks[CountChildren((unsigned char)(childBit - 1))];
+				}
+			}
+		}
+
+		for(auto child = 0u; child < childrenCnt; ++child) {
+			if(childEntries[child].ViewMask) {
+				unvisitedNodes.push_back(childEntries[child]);
+			}
+		}
+	}
+
+	m_LastCullStatistics.SelectionTime += GetMicrosecondsSince(selectionStart);
+	const auto transitionStart = std::chrono::high_resolution_clock::now();
+
+	// The selected nodes of all the views are indexed together - every neighbour of a node
+	// is looked up once and tells which of the views selected it
+	selectedKeys.Reset(unsigned(selected.size()));
+	unsigned selectedCnt[MAX_BATCHED_VIEWS] = {};
+	std::for_each(selected.cbegin(), selected.cend(), [&](const MultiViewSelection& selection) {
+		selectedKeys.Insert(m_Nodes[selection.NodeId].Key, selection.ViewMask);
+		for(auto viewBits = selection.ViewMask; viewBits; viewBits &= viewBits - 1) {
+			++selectedCnt[CountChildren((unsigned char)((viewBits & (~viewBits + 1)) - 1))];
+		}
+	});
+	for(auto view = 0u; view < viewsCount; ++view) {
+		outputs[view].reserve(selectedCnt[view]);
+	}
+
+	unsigned neighbourKeys[BlockPolygons::Face_Count][4];
+	std::for_each(selected.cbegin(), selected.cend(), [&](const MultiViewSelection& selection) {
+		const auto& node = m_Nodes[selection.NodeId];
+		for(auto viewBits = selection.ViewMask; viewBits; viewBits &= viewBits - 1) {
+			outputs[CountChildren((unsigned char)((viewBits & (~viewBits + 1)) - 1))].emplace_back(VisibleBlock(node.Id));
+		}
+		m_LastCullStatistics.SelectedBlocks[GetKeyLevel(node.Key)] += CountChildren((unsigned char)selection.ViewMask);
+
+		// the lowest level nodes never draw transitions
+		if(GetKeyLevel(node.Key) == 0)
+			return;
+
+		// a face needs a transition in the views that selected any of the 4 high-res cells right next to it
+		for(auto faceMask = GetFaceNeighbourKeys(node, neighbourKeys); faceMask; faceMask &= faceMask - 1) {
+			const auto face = CountChildren((unsigned char)((faceMask & (~faceMask + 1)) - 1));
+			auto transitionViews = 0u;
+			for(auto cell = 0u; cell < 4 && (transitionViews & selection.ViewMask) != selection.ViewMask; ++cell) {
+				transitionViews |= selectedKeys.GetViews(neighbourKeys[face][cell]);
+			}
+			for(auto viewBits = transitionViews & selection.ViewMask; viewBits; viewBits &= viewBits - 1) {
+				outputs[CountChildren((unsigned char)((viewBits & (~viewBits + 1)) - 1))].back().TransitionFaces[face] = true;
+			}
+			m_LastCullStatistics.TransitionFaces += CountChildren((unsigned char)(transitionViews & selection.ViewMask));
+		}
+	});
+	m_LastCullStatistics.TransitionTime += GetMicrosecondsSince(transitionStart);
+}
+
+template<typename BoundsTest>
+void VoxelLodOctree::QueryNodes(unsigned lodLevel, const BoundsTest& intersects, std::vector<unsigned>& blockIds) const
 {
+	blockIds.clear();
+	if(m_Nodes.empty() || lodLevel >= m_LodLevels)
+		return;
 
-// if the distance between the camera and the center of the node is
-// >= than the coeff than we settle for this block, otherwise we examine it's children
-// NB: setting a number < 1.6875 might lead to incorrect results
-static const float LOD_SETTLE_COEFF = 2.0f;
+	unsigned unvisitedNodes[QUERY_STACK_SIZE];
+	auto unvisitedCnt = 0u;
+	unvisitedNodes[unvisitedCnt++] = 0;
 
-inline DirectX::XMVECTOR XMLoadFloat3(const float3* fl)
+	XMFLOAT3 nodeMinCorner;
+	XMFLOAT3 nodeMaxCorner;
+	while(unvisitedCnt) {
+		const auto& node = m_Nodes[unvisitedNodes[--unvisitedCnt]];
+		GetNodeBounds(node.Key, nodeMinCorner, nodeMaxCorner);
+		if(!intersects(nodeMinCorner, nodeMaxCorner))
+			continue;
+
+		if(GetKeyLevel(node.Key) == lodLevel) {
+			if(node.Id != PolygonSurface::INVALID_ID) {
+				blockIds.push_back(node.Id);
+			}
+			continue;
+		}
+
+		const auto childrenCnt = CountChildren(node.ChildMask);
+		for(auto child = 0u; child < childrenCnt; ++child) {
+			assert(unvisitedCnt < QUERY_STACK_SIZE);
+			unvisitedNodes[unvisitedCnt++] = node.FirstChild + child;
+		}
+	}
+}
+
+void VoxelLodOctree::QueryBox(const XMFLOAT3& minCorner, const XMFLOAT3& maxCorner, unsigned lodLevel, std::vector<unsigned>& blockIds) const
 {
-	static_assert(sizeof(float3) == sizeof(DirectX::XMFLOAT3), "Float types incompatible!");
-	return XMLoadFloat3(reinterpret_cast<const DirectX::XMFLOAT3*>(fl));
+	QueryNodes(lodLevel, [&](const XMFLOAT3& nodeMin, const XMFLOAT3& nodeMax) {
+		return nodeMin.x <= maxCorner.x && nodeMax.x >= minCorner.x
+			&& nodeMin.y <= maxCorner.y && nodeMax.y >= minCorner.y
+			&& nodeMin.z <= maxCorner.z && nodeMax.z >= minCorner.z;
+	}, blockIds);
 }
 
-inline DirectX::XMVECTOR XMLoadFloat4(const float4* fl)
+void VoxelLodOctree::QuerySphere(const XMFLOAT3& center, float radius, unsigned lodLevel, std::vector<unsigned>& blockIds) const
 {
-	static_assert(sizeof(float4) == sizeof(DirectX::XMFLOAT4), "Float types incompatible!");
-	return XMLoadFloat4(reinterpret_cast<const DirectX::XMFLOAT4*>(fl));
+	const auto sphereCenter = XMLoadFloat3(&center);
+	const auto radiusSq = radius * radius;
+	QueryNodes(lodLevel, [&](const XMFLOAT3& nodeMin, const XMFLOAT3& nodeMax) {
+		// the nearest point of the box to the center
+		const auto nearest = XMVectorClamp(sphereCenter, XMLoadFloat3(&nodeMin), XMLoadFloat3(&nodeMax));
+		return XMVectorGetX(XMVector3LengthSq(nearest - sphereCenter)) <= radiusSq;
+	}, blockIds);
 }
 
-inline void XMStoreFloat3(float3* pDestination, DirectX::FXMVECTOR V)
+void VoxelLodOctree::QueryRay(const XMFLOAT3& origin, const XMFLOAT3& direction, float maxDistance, unsigned lodLevel, RayHitsVec& hits) const
 {
-	XMStoreFloat3(reinterpret_cast<DirectX::XMFLOAT3*>(pDestination), V);
+	hits.clear();
+	if(m_Nodes.empty() || lodLevel >= m_LodLevels)
+		return;
+
+	// Depth-first with the children of each node pushed far to near so that the nearest is visited
+	// first. The nodes are disjoint cubes so the blocks are found in the order the ray enters them
+	// NB: The ids of the entries on the stack are node indices
+	RayHit unvisitedNodes[QUERY_STACK_SIZE];
+	auto unvisitedCnt = 0u;
+
+	XMFLOAT3 nodeMinCorner;
+	XMFLOAT3 nodeMaxCorner;
+	GetNodeBounds(m_Nodes[0].Key, nodeMinCorner, nodeMaxCorner);
+	RayHit root = { 0, 0 };
+	if(!ClipRay(origin, direction, maxDistance, nodeMinCorner, nodeMaxCorner, root.Distance))
+		return;
+	unvisitedNodes[unvisitedCnt++] = root;
+
+	RayHit children[8];
+	while(unvisitedCnt) {
+		const auto entry = unvisitedNodes[--unvisitedCnt];
+		const auto& node = m_Nodes[entry.Id];
+		if(GetKeyLevel(node.Key) == lodLevel) {
+			if(node.Id != PolygonSurface::INVALID_ID) {
+				RayHit hit = { node.Id, entry.Distance };
+				hits.push_back(hit);
+			}
+			continue;
+		}
+
+		auto hitChildrenCnt = 0u;
+		const auto childrenCnt = CountChildren(node.ChildMask);
+		for(auto child = 0u; child < childrenCnt; ++child) {
+			const auto childId = node.FirstChild + child;
+			GetNodeBounds(m_Nodes[childId].Key, nodeMinCorner, nodeMaxCorner);
+			RayHit childHit = { childId, 0 };
+			if(ClipRay(origin, direction, maxDistance, nodeMinCorner, nodeMaxCorner, childHit.Distance)) {
+				children[hitChildrenCnt++] = childHit;
+			}
+		}
+		std::sort(children, children + hitChildrenCnt, [](const RayHit& lhs, const RayHit& rhs) {
+			return lhs.Distance > rhs.Distance;
+		});
+		for(auto child = 0u; child < hitChildrenCnt; ++child) {
+			assert(unvisitedCnt < QUERY_STACK_SIZE);
+			unvisitedNodes[unvisitedCnt++] = children[child];
+		}
+	}
 }
 
-inline void XMStoreFloat4(float4* pDestination, DirectX::FXMVECTOR V)
+void VoxelLodOctree::ResetNodesToDraw(std::vector<NodeIndicesVec>& nodesToDraw) const
 {
-	XMStoreFloat4(reinterpret_cast<DirectX::XMFLOAT4*>(pDestination), V);
+	nodesToDraw.resize(m_LodLevels);
+	std::for_each(nodesToDraw.begin(), nodesToDraw.end(), [](NodeIndicesVec& levelNodes) {
+		levelNodes.clear();
+	});
 }
 
-struct VoxelLodOctree::Node
+void VoxelLodOctree::SetLodBiasVolumes(const LodBiasVolumesVec& volumes)
 {
-	static NodePtr Create(unsigned level, const XMFLOAT3& min, const XMFLOAT3& max)
-	{
-		return NodePtr(new Node(level, min, max));
+	assert(std::all_of(volumes.cbegin(), volumes.cend(), [](const LodBiasVolume& volume) { return volume.DistanceScale > 0; })
+		&& "The distance scale of a LOD bias volume must be positive!");
+	m_LodBiasVolumes = volumes;
+	std::for_each(m_LodBiasVolumes.begin(), m_LodBiasVolumes.end(), [](LodBiasVolume& volume) {
+		volume.DistanceScale = std::max(volume.DistanceScale, MIN_LOD_BIAS_DISTANCE_SCALE);
+	});
+	// the coherent states decided the LOD without the new volumes
+	m_BuildId = GetNextBuildId();
+	BuildNodeBiases();
+}
+
+void VoxelLodOctree::BuildNodeBiases()
+{
+	m_NodeBiases.clear();
+	if(m_LodBiasVolumes.empty() || m_Nodes.empty())
+		return;
+
+	// the nodes outside of all the volumes are never visited
+	const NodeLodBias noBias = { 1.f, 0 };
+	m_NodeBiases.assign(m_Nodes.size(), noBias);
+	NodeIndicesVec volumes(m_LodBiasVolumes.size());
+	for(auto volume = 0u; volume < volumes.size(); ++volume) {
+		volumes[volume] = volume;
 	}
+	BiasNodes(0, volumes);
+}
 
-	unsigned Id;
-	unsigned Level;
-	XMFLOAT3 MinCorner;
-	XMFLOAT3 MaxCorner;
+void VoxelLodOctree::BiasNodes(unsigned nodeId, const NodeIndicesVec& volumes)
+{
+	const auto& node = m_Nodes[nodeId];
+	XMFLOAT3 nodeMinCorner;
+	XMFLOAT3 nodeMaxCorner;
+	GetNodeBounds(node.Key, nodeMinCorner, nodeMaxCorner);
+	// The bias is decided over the node's cube grown by it's extent. That covers the twice smaller nodes next to it and
+	// their grown cubes, so the node is biased at least as much as them and the LOD still changes by one level at a time
+	const auto nodeExtent = XMVectorReplicate(nodeMaxCorner.x - nodeMinCorner.x);
+	const auto nodeMin = XMLoadFloat3(&nodeMinCorner) - nodeExtent;
+	const auto nodeMax = XMLoadFloat3(&nodeMaxCorner) + nodeExtent;
 
-	unsigned ChildCount;
-	NodePtr Children[8];
+	auto& bias = m_NodeBiases[nodeId];
+	bias.DistanceScale = 0;
+	bias.FinestLevel = m_LodLevels;
+	auto isInside = false;
+	NodeIndicesVec intersected;
+	std::for_each(volumes.cbegin(), volumes.cend(), [&](unsigned volumeId) {
+		const auto& volume = m_LodBiasVolumes[volumeId];
+		bool intersects;
+		bool contains;
+		if(volume.VolumeShape == LodBiasVolume::Box) {
+			const auto boxMin = XMLoadFloat3(&volume.MinCorner);
+			const auto boxMax = XMLoadFloat3(&volume.MaxCorner);
+			intersects = XMVector3LessOrEqual(nodeMin, boxMax) && XMVector3LessOrEqual(boxMin, nodeMax);
+			contains = XMVector3LessOrEqual(boxMin, nodeMin) && XMVector3LessOrEqual(nodeMax, boxMax);
+		} else {
+			// the nearest point of the node to the center and the offset of the farthest one
+			const auto center = XMLoadFloat3(&volume.Center);
+			const auto nearest = XMVectorClamp(center, nodeMin, nodeMax);
+			const auto farthest = XMVectorMax(XMVectorAbs(center - nodeMin), XMVectorAbs(nodeMax - center));
+			const auto radiusSq = volume.Radius * volume.Radius;
+			intersects = XMVectorGetX(XMVector3LengthSq(nearest - center)) <= radiusSq;
+			contains = XMVectorGetX(XMVector3LengthSq(farthest)) <= radiusSq;
+		}
+		if(!intersects)
+			return;
 
-private:
-	Node(unsigned level, const XMFLOAT3& min, const XMFLOAT3& max)
-		: Id(PolygonSurface::INVALID_ID)
-		, Level(level)
-		, MinCorner(min)
-		, MaxCorner(max)
-		, ChildCount(0)
-	{}
-};
+		intersected.push_back(volumeId);
+		isInside |= contains;
+		bias.DistanceScale = std::max(bias.DistanceScale, volume.DistanceScale);
+		bias.FinestLevel = std::min(bias.FinestLevel, volume.FinestLevel);
+	});
 
-VoxelLodOctree::VoxelLodOctree()
-	: m_LodLevels(0)
-	, m_NonEmptyNodes(0)
-{}
+	// the part of the node outside of the volumes keeps the detail of the policy
+	if(!isInside) {
+		bias.DistanceScale = std::max(bias.DistanceScale, 1.f);
+		bias.FinestLevel = 0;
+	}
+	if(intersected.empty())
+		return;
 
-VoxelLodOctree::~VoxelLodOctree()
-{}
+	const auto childrenCnt = CountChildren(node.ChildMask);
+	for(auto child = 0u; child < childrenCnt; ++child) {
+		BiasNodes(node.FirstChild + child, intersected);
+	}
+}
 
-bool VoxelLodOctree::PruneNode(NodePtr& node) {
-	for(auto i = 0; i < 8 ; ++i) {
-		if(node->Children[i]) {
-			// this child is empty
-			if(!PruneNode(node->Children[i])) {
-				node->Children[i].reset();
-			} else {
-				++node->ChildCount;
-			}
-		}
+float VoxelLodOctree::GetBiasedSettleMargin(unsigned nodeId, const XMFLOAT3& cameraPosition, bool wasSettled) const
+{
+	XMFLOAT3 nodeCenter;
+	float nodeExtent;
+	GetNodeCenter(m_Nodes[nodeId].Key, nodeCenter, nodeExtent);
+
+	auto margin = 0.f;
+	if(m_NodeBiases.empty()) {
+		margin = m_LodPolicy->GetSettleMargin(nodeCenter, nodeExtent, cameraPosition, wasSettled);
+	} else if(GetKeyLevel(m_Nodes[nodeId].Key) <= m_NodeBiases[nodeId].FinestLevel) {
+		margin = std::numeric_limits<float>::max();
+	} else {
+		// Scaling the settle distance is the same as the camera being that many times nearer. The margin is
+		// scaled back so that it still doesn't change more than the camera moves
+		const auto distanceScale = m_NodeBiases[nodeId].DistanceScale;
+		const auto center = XMLoadFloat3(&nodeCenter);
+		XMFLOAT3 biasedCamera;
+		XMStoreFloat3(&biasedCamera, center + (XMLoadFloat3(&cameraPosition) - center) / distanceScale);
+		margin = distanceScale * m_LodPolicy->GetSettleMargin(nodeCenter, nodeExtent, biasedCamera, wasSettled);
+	}
+	return margin;
+}
+
+bool VoxelLodOctree::CanSettle(unsigned nodeId, const XMFLOAT3& cameraPosition, float* slack)
+{
+	const auto margin = GetBiasedSettleMargin(nodeId, cameraPosition, m_SettledNodes[nodeId] != 0);
+	if(slack) {
+		*slack = std::min(*slack, std::abs(margin));
 	}
 
-	return !!node->ChildCount || node->Id != PolygonSurface::INVALID_ID;
+	const auto settle = margin >= 0;
+	m_SettledNodes[nodeId] = settle;
+	return settle;
 }
 
-bool VoxelLodOctree::Build(const PolygonSurface& map)
+bool VoxelLodOctree::IsNodeVisible(const XMFLOAT4 frustumPlanes[6], unsigned nodeId)
 {
-	auto levelExtents = map.GetExtents();
-	m_LodLevels = map.GetLevelsCount();
+	XMFLOAT3 nodeMinCorner;
+	XMFLOAT3 nodeMaxCorner;
+	GetNodeBounds(m_Nodes[nodeId].Key, nodeMinCorner, nodeMaxCorner);
+	unsigned planeMask = ALL_PLANES_MASK;
+	++m_LastCullStatistics.NodesVisited;
+	if(ClassifyCube(frustumPlanes, nodeMinCorner, nodeMaxCorner, planeMask, m_LastCullStatistics.PlaneTests))
+		return true;
 
-	m_Root = Node::Create(m_LodLevels - 1,
-		XMFLOAT3(0.f, 0.f, 0.f),
-		XMFLOAT3(levelExtents.x, levelExtents.y, levelExtents.z));
+	++m_LastCullStatistics.FrustumRejectedNodes;
+	return false;
+}
 
-	NodesQueue currentLevelNodes;
-	NodesQueue nextLevelNodes;
+void VoxelLodOctree::AddToFront(unsigned nodeId, BudgetedCullState& state) const
+{
+	const auto& node = m_Nodes[nodeId];
+	if(node.Id != PolygonSurface::INVALID_ID) {
+		state.InFront[nodeId] = 1;
+		state.FrontNodes.push_back(nodeId);
+		return;
+	}
 
-	currentLevelNodes.push(&m_Root);
-	for(int lodLevel = m_LodLevels - 1; lodLevel >= 0; --lodLevel) {
-		const auto blocksCnt = map.GetBlocksForLevelCount(lodLevel);
-		while(!currentLevelNodes.empty()) {
-			auto& currentNode = *currentLevelNodes.front();
+	const auto childrenCnt = CountChildren(node.ChildMask);
+	for(auto child = 0u; child < childrenCnt; ++child) {
+		AddToFront(node.FirstChild + child, state);
+	}
+}
 
-			// look for a polygon block to assign to this node
-			const auto currentNodeMin = XMLoadFloat3(&currentNode->MinCorner);
-			for (auto bit = 0; bit < blocksCnt; ++bit) {
-				auto block = map.GetBlockForLevel(lodLevel, bit);
+void VoxelLodOctree::RemoveFromFront(unsigned nodeId, BudgetedCullState& state) const
+{
+	// NB: The node stays in the list of the front until it's compacted
+	if(state.InFront[nodeId]) {
+		state.InFront[nodeId] = 0;
+		return;
+	}
 
-				const auto minCorner = block->GetMinimalCorner();
-				const auto blockMin = XMLoadFloat3(&minCorner);
-				UINT areEqual;
-				XMVectorEqualIntR(&areEqual, currentNodeMin, blockMin);
-				if(XMComparisonAllTrue(areEqual)) {
-					currentNode->Id = block->GetId();
-					++m_NonEmptyNodes;
-
-					#ifdef _DEBUG
-					// assert that the max corners are the same
-					const auto currentNodeMax = XMLoadFloat3(&currentNode->MaxCorner);
-					const auto maxCorner = block->GetMaximalCorner();
-					const auto blockMax = XMLoadFloat3(&maxCorner);
-					XMVectorEqualIntR(&areEqual, currentNodeMax, blockMax);
-					assert(XMComparisonAllTrue(areEqual));
-					#endif
-				}
-			}
+	const auto& node = m_Nodes[nodeId];
+	assert(node.Id == PolygonSurface::INVALID_ID && "Removing a node that isn't in the front!");
+	const auto childrenCnt = CountChildren(node.ChildMask);
+	for(auto child = 0u; child < childrenCnt; ++child) {
+		RemoveFromFront(node.FirstChild + child, state);
+	}
+}
 
-			if(lodLevel > 0) {
-				// create all the children
-				auto nextLevelNodeExtents = XMFLOAT3(levelExtents.x / 2, levelExtents.y / 2, levelExtents.z / 2);
-
-				auto childId = 0u;
-
-				for(auto x = 0; x < 2; ++x)
-				for(auto y = 0; y < 2; ++y)
-				for(auto z = 0; z < 2; ++z)
-				{
-					const auto minCorner = XMFLOAT3(currentNode->MinCorner.x + (x * nextLevelNodeExtents.x)
-												  , currentNode->MinCorner.y + (y * nextLevelNodeExtents.y)
-												  , currentNode->MinCorner.z + (z * nextLevelNodeExtents.z));
-
-					const auto maxCorner = XMFLOAT3(currentNode->MinCorner.x + ((x + 1) * nextLevelNodeExtents.x)
-												  , currentNode->MinCorner.y + ((y + 1) * nextLevelNodeExtents.y)
-												  , currentNode->MinCorner.z + ((z + 1) * nextLevelNodeExtents.z));
-					
-					currentNode->Children[childId] = Node::Create(lodLevel - 1, minCorner, maxCorner);
-					
-					nextLevelNodes.push(&currentNode->Children[childId]);
-					
-					++childId;
-				}
+void VoxelLodOctree::ExamineFrontNode(unsigned nodeId, const XMFLOAT4 frustumPlanes[6], const XMFLOAT3& cameraPosition, BudgetedCullState& state)
+{
+	const auto isVisible = IsNodeVisible(frustumPlanes, nodeId);
+	state.Visible[nodeId] = isVisible;
+	if(!isVisible || !m_Nodes[nodeId].ChildMask || CanSettle(nodeId, cameraPosition))
+		return;
+
+	XMFLOAT3 nodeCenter;
+	float nodeExtent;
+	GetNodeCenter(m_Nodes[nodeId].Key, nodeCenter, nodeExtent);
+	const auto toNode = XMLoadFloat3(&nodeCenter) - XMLoadFloat3(&cameraPosition);
+	BudgetedCullState::SplitEntry entry = { nodeId, XMVectorGetX(XMVector3LengthSq(toNode)) };
+	state.Splits.push_back(entry);
+	std::push_heap(state.Splits.begin(), state.Splits.end());
+}
+
+bool VoxelLodOctree::IsFrontUnder(unsigned nodeId, const BudgetedCullState& state) const
+{
+	// the children without blocks are never in the front - their children have to be
+	const auto& node = m_Nodes[nodeId];
+	const auto childrenCnt = CountChildren(node.ChildMask);
+	for(auto child = node.FirstChild; child < node.FirstChild + childrenCnt; ++child) {
+		if(!state.InFront[child] && (m_Nodes[child].Id != PolygonSurface::INVALID_ID || !IsFrontUnder(child, state)))
+			return false;
+	}
+	return true;
+}
+
+unsigned VoxelLodOctree::FindCoarserNeighbour(unsigned nodeId, const BudgetedCullState& state) const
+{
+	const auto& node = m_Nodes[nodeId];
+	const auto level = GetKeyLevel(node.Key);
+	if(level + 1 >= m_LodLevels)
+		return PolygonSurface::INVALID_ID;
+
+	// the parents of the cells right next to the faces that aren't the node's own parent
+	const auto cellsPerAxis = 1u << (m_LodLevels - 1 - level);
+	const auto parentKey = GetParentKey(node.Key);
+	unsigned nodeCell[3];
+	GetKeyCell(node.Key, nodeCell);
+	for(auto axis = 0u; axis < 3; ++axis) {
+		for(auto side = 0u; side < 2; ++side) {
+			unsigned cell[3] = { nodeCell[0], nodeCell[1], nodeCell[2] };
+			if(side == 0) {
+				if(cell[axis] + 1 >= cellsPerAxis)
+					continue;
+				++cell[axis];
+			} else {
+				if(cell[axis] == 0)
+					continue;
+				--cell[axis];
 			}
 
-			currentLevelNodes.pop();
+			const auto neighbourParentKey = MakeNodeKey(level + 1, cell[0] / 2, cell[1] / 2, cell[2] / 2);
+			if(neighbourParentKey == parentKey)
+				continue;
+			const auto neighbourParent = FindNode(neighbourParentKey);
+			if(neighbourParent != PolygonSurface::INVALID_ID && state.InFront[neighbourParent])
+				return neighbourParent;
 		}
-		levelExtents.x /= 2;
-		levelExtents.y /= 2;
-		levelExtents.z /= 2;
-
-		std::swap(currentLevelNodes, nextLevelNodes);
-		assert(nextLevelNodes.empty());
 	}
+	return PolygonSurface::INVALID_ID;
+}
 
-	#ifdef _DEBUG
-	// assert that all blocks are in the octree
-	auto blockTotalCnt = 0u;
-	for(auto lodLevel = 0u; lodLevel < m_LodLevels; ++lodLevel) {
-		blockTotalCnt += map.GetBlocksForLevelCount(lodLevel);
+bool VoxelLodOctree::HasFinerNeighbours(unsigned nodeId, const BudgetedCullState& state) const
+{
+	const auto& node = m_Nodes[nodeId];
+	if(GetKeyLevel(node.Key) < 2)
+		return false;
+
+	// A cell one level finer next to a face is refined further if neither it nor it's parent is in the front.
+	// Coarser nodes can't cover it - they would be two levels apart from the node's children
+	unsigned neighbourKeys[BlockPolygons::Face_Count][4];
+	for(auto faceMask = GetFaceNeighbourKeys(node, neighbourKeys); faceMask; faceMask &= faceMask - 1) {
+		const auto face = CountChildren((unsigned char)((faceMask & (~faceMask + 1)) - 1));
+		for(auto cell = 0u; cell < 4; ++cell) {
+			const auto neighbour = FindNode(neighbourKeys[face][cell]);
+			if(neighbour == PolygonSurface::INVALID_ID || state.InFront[neighbour])
+				continue;
+			if(!state.InFront[FindNode(GetParentKey(neighbourKeys[face][cell]))])
+				return true;
+		}
 	}
-	assert(blockTotalCnt == m_NonEmptyNodes);
-	#endif
+	return false;
+}
 
-	// Prune all empty nodes
-	PruneNode(m_Root);
+void VoxelLodOctree::WriteVisibleBlocks(const NodeIndicesVec& selectedNodes, NodeKeySet& selectedKeys, VisibleBlocksVec& output, bool inParallel) const
+{
+	// index the selected nodes so that the neighbours of each face are found with lookups
+	selectedKeys.Reset(unsigned(selectedNodes.size()));
+	output.clear();
+	output.reserve(selectedNodes.size());
+	std::for_each(selectedNodes.cbegin(), selectedNodes.cend(), [&](unsigned nodeId) {
+		selectedKeys.Insert(m_Nodes[nodeId].Key);
+		output.emplace_back(VisibleBlock(m_Nodes[nodeId].Id));
+	});
 
-	return true;
+	// every block is written only by it's own lookups - they can go in parallel
+	const auto findTransitions = [&](unsigned id) {
+		const auto& node = m_Nodes[selectedNodes[id]];
+		// the lowest level nodes never draw transitions
+		if(GetKeyLevel(node.Key) > 0) {
+			FindTransitionFaces(node, selectedKeys, output[id]);
+		}
+	};
+	const auto selectedCnt = unsigned(selectedNodes.size());
+	if(inParallel) {
+		concurrency::parallel_for(0u, selectedCnt, findTransitions);
+	} else {
+		for(auto id = 0u; id < selectedCnt; ++id) {
+			findTransitions(id);
+		}
+	}
 }
 
-VoxelLodOctree::VisibleBlocksVec VoxelLodOctree::Cull(const XMFLOAT4 frustumPlanes[6], const XMFLOAT3& cameraPosition) {
-	VisibleBlocksVec output;
+void VoxelLodOctree::CountSelection(const NodeIndicesVec& selectedNodes, const VisibleBlocksVec& output)
+{
+	assert(selectedNodes.size() == output.size());
+	const auto selectedCnt = unsigned(output.size());
+	for(auto id = 0u; id < selectedCnt; ++id) {
+		++m_LastCullStatistics.SelectedBlocks[GetKeyLevel(m_Nodes[selectedNodes[id]].Key)];
+		m_LastCullStatistics.TransitionFaces += CountChildren(GetTransitionMask(output[id]));
+	}
+}
 
-	typedef std::vector<NodePtrVec> LodNodesVec;
-	LodNodesVec nodesToDraw;
-	nodesToDraw.resize(m_LodLevels);
+void VoxelLodOctree::FinishOutput(const XMFLOAT3& eye, const NodeIndicesVec& selectedNodes, NodeIndicesVec& drawnNodes, VisibleBlocksVec& output, VisibleSetTracker* tracker, float* slack)
+{
+	assert(selectedNodes.size() == output.size());
+	if(!DropsBlocks()) {
+		if(tracker) {
+			TrackVisibleBlocks(selectedNodes, output, *tracker);
+		}
+		return;
+	}
 
-	NodesQueue unvisitedNodes;
-	unvisitedNodes.push(&m_Root);
+	// The transition faces are already decided with all the selected blocks so dropping a block
+	// leaves no cracks around it. The borders of the blocks with transitions are moved in the
+	// vertex shader so their triangles aren't the ones in the cone - they are never back-facing
+	drawnNodes.clear();
+	auto drawnCnt = 0u;
+	const auto selectedCnt = unsigned(output.size());
+	// the horizon has no margin - any move of the eye might hide or reveal a block
+	if(m_HorizonCulling && slack) {
+		*slack = 0;
+	}
+	for(auto id = 0u; id < selectedCnt; ++id) {
+		if(IsSubPixel(selectedNodes[id], eye, slack)) {
+			++m_LastCullStatistics.SubPixelBlocks;
+			continue;
+		}
+		if(m_BackFaceCulling && !GetTransitionMask(output[id]) && IsBackFacing(selectedNodes[id], eye, slack)) {
+			++m_LastCullStatistics.BackFacingBlocks;
+			continue;
+		}
+		if(m_HorizonCulling && IsBelowHorizon(selectedNodes[id], eye)) {
+			++m_LastCullStatistics.BelowHorizonBlocks;
+			continue;
+		}
+		output[drawnCnt++] = output[id];
+		drawnNodes.push_back(selectedNodes[id]);
+	}
+	output.erase(output.begin() + drawnCnt, output.end());
 
-	XMVECTOR camPos = XMLoadFloat3(&cameraPosition);
+	if(tracker) {
+		TrackVisibleBlocks(drawnNodes, output, *tracker);
+	}
+}
 
-	while(!unvisitedNodes.empty()) {
-		auto& node = *unvisitedNodes.front();
-
-		if(IsCubeVisible(frustumPlanes, node->MinCorner, node->MaxCorner)) {
-			bool hasToPushChildren = true;
-			if(node->Id != PolygonSurface::INVALID_ID) {
-				if(node->ChildCount == 0) {
-					// push this because it has no children anyway - a leaf
-					nodesToDraw[node->Level].push_back(&node);
-					hasToPushChildren = false;
-				} else {
-					// check the distance
-					XMVECTOR minCorner = XMLoadFloat3(&node->MinCorner);
-					XMVECTOR maxCorner = XMLoadFloat3(&node->MaxCorner);
-
-					XMVECTOR nodeCenter = (maxCorner + minCorner) / 2;
-					XMFLOAT3A distanceVec;
-					XMStoreFloat3A(&distanceVec, XMVectorAbs(nodeCenter - camPos));
-					auto chebishevDistance = std::max(std::max(distanceVec.x, distanceVec.y), distanceVec.z);
-
-					XMVECTOR nodeExtent = maxCorner - minCorner; // it's a cube - all axes should have the same extent
-
-					if (chebishevDistance >= XMVectorGetX(nodeExtent) * LOD_SETTLE_COEFF) {
-						// settle for this node	- it is far away
-						nodesToDraw[node->Level].push_back(&node);
-						hasToPushChildren = false;
-					}
-				}
-			}
+void VoxelLodOctree::TrackVisibleBlocks(const NodeIndicesVec& selectedNodes, const VisibleBlocksVec& output, VisibleSetTracker& tracker) const
+{
+	assert(selectedNodes.size() == output.size());
+	tracker.ClearChanges();
+	const auto selectedCnt = unsigned(selectedNodes.size());
 
-			if(hasToPushChildren) {
-				for(auto child = 0u; child < 8; ++child) {
-					auto& theChild = (*node).Children[child];
-					if(theChild) {
-						unvisitedNodes.push(&theChild);
-					}
+	if(tracker.BuildId != m_BuildId) {
+		// The node indices of another octree mean nothing - match the blocks by their ids.
+		// Happens only once after each Build, Update or Load
+		std::unordered_map<unsigned, unsigned char> previousBlocks;
+		std::for_each(tracker.VisibleBlocks.cbegin(), tracker.VisibleBlocks.cend(), [&](const VisibleBlock& block) {
+			previousBlocks[block.Id] = GetTransitionMask(block);
+		});
+		for(auto id = 0u; id < selectedCnt; ++id) {
+			const auto previous = previousBlocks.find(output[id].Id);
+			if(previous == previousBlocks.end()) {
+				tracker.Entered.push_back(id);
+			} else {
+				if(previous->second != GetTransitionMask(output[id])) {
+					tracker.TransitionsChanged.push_back(id);
 				}
+				previousBlocks.erase(previous);
 			}
 		}
+		std::for_each(tracker.VisibleBlocks.cbegin(), tracker.VisibleBlocks.cend(), [&](const VisibleBlock& block) {
+			if(previousBlocks.count(block.Id)) {
+				tracker.Left.push_back(block.Id);
+			}
+		});
 
-		unvisitedNodes.pop();
+		tracker.BuildId = m_BuildId;
+		tracker.Frame = 1;
+		tracker.NodeFrames.assign(m_Nodes.size(), 0);
+		tracker.NodeTransitions.assign(m_Nodes.size(), 0);
+		for(auto id = 0u; id < selectedCnt; ++id) {
+			tracker.NodeFrames[selectedNodes[id]] = tracker.Frame;
+			tracker.NodeTransitions[selectedNodes[id]] = GetTransitionMask(output[id]);
+		}
+	} else {
+		// Every visible node is stamped with the frame - a node entered if it's stamp is not from
+		// the last frame and left if it was visible the last time and didn't get the new stamp
+		const auto lastFrame = tracker.Frame++;
+		for(auto id = 0u; id < selectedCnt; ++id) {
+			const auto nodeId = selectedNodes[id];
+			const auto transitions = GetTransitionMask(output[id]);
+			if(tracker.NodeFrames[nodeId] != lastFrame) {
+				tracker.Entered.push_back(id);
+			} else if(tracker.NodeTransitions[nodeId] != transitions) {
+				tracker.TransitionsChanged.push_back(id);
+			}
+			tracker.NodeFrames[nodeId] = tracker.Frame;
+			tracker.NodeTransitions[nodeId] = transitions;
+		}
+		std::for_each(tracker.VisibleNodes.cbegin(), tracker.VisibleNodes.cend(), [&](unsigned nodeId) {
+			if(tracker.NodeFrames[nodeId] != tracker.Frame) {
+				tracker.Left.push_back(m_Nodes[nodeId].Id);
+			}
+		});
 	}
-	
-	for(int level = m_LodLevels - 1; level >= 0; --level) {
-		std::for_each(nodesToDraw[level].cbegin(), nodesToDraw[level].cend(), [&](NodePtr* node_p) {
-			auto& node = (*node_p);
-			output.emplace_back(VisibleBlock(node->Id));
 
-			// we skip the transition face calculation for the nowest level nodes - they never draw transitions
-			if(level == 0) return;
+	tracker.VisibleNodes.assign(selectedNodes.cbegin(), selectedNodes.cend());
+	tracker.VisibleBlocks.assign(output.cbegin(), output.cend());
+}
 
-			// check the higher-res nodes for potential neighbours
-			std::for_each(nodesToDraw[level - 1].cbegin(), nodesToDraw[level - 1].cend(), [&](NodePtr* highnode_p) {
-				CheckForNeighbour(node, *highnode_p, output.back());
-			});
-		});
+void VoxelLodOctree::FindTransitionFaces(const Node& lowResNode, const NodeKeySet& selectedKeys, VisibleBlock& output) const
+{
+	unsigned neighbourKeys[BlockPolygons::Face_Count][4];
+	const auto faceMask = GetFaceNeighbourKeys(lowResNode, neighbourKeys);
+	FindTransitionFaces(neighbourKeys, faceMask, selectedKeys, output);
+}
+
+void VoxelLodOctree::FindTransitionFaces(const unsigned neighbourKeys[BlockPolygons::Face_Count][4], unsigned faceMask, const NodeKeySet& selectedKeys, VisibleBlock& output)
+{
+	// a face needs a transition if any of the 4 high-res cells right next to it is selected
+	for(; faceMask; faceMask &= faceMask - 1) {
+		const auto face = CountChildren((unsigned char)((faceMask & (~faceMask + 1)) - 1));
+		for(auto cell = 0u; cell < 4; ++cell) {
+			if(selectedKeys.Contains(neighbourKeys[face][cell])) {
+				output.TransitionFaces[face] = true;
+				break;
+			}
+		}
 	}
-	
-	return std::move(output);
 }
 
-void VoxelLodOctree::CheckForNeighbour(const NodePtr& lowResNode, const NodePtr& highResNode, VisibleBlock& output)
+unsigned VoxelLodOctree::GetFaceNeighbourKeys(const Node& lowResNode, unsigned neighbourKeys[BlockPolygons::Face_Count][4]) const
 {
-#ifdef _DEBUG
-	const XMFLOAT3& lMin = lowResNode->MinCorner;
-	const XMFLOAT3& lMax = lowResNode->MaxCorner;
+	const auto highLevel = GetKeyLevel(lowResNode.Key) - 1;
+	const auto highCellsPerAxis = 1u << (m_LodLevels - 1 - highLevel);
 
-	const XMFLOAT3& hMin = highResNode->MinCorner;
-	const XMFLOAT3& hMax = highResNode->MaxCorner;
-	// check that no two nodes overlap!
-	if(((lMin.x < hMax.x) && (hMin.x < lMax.x))
-	&& ((lMin.y < hMax.y) && (hMin.y < lMax.y))
-	&& ((lMin.z < hMax.z) && (hMin.z < lMax.z))) {
-		assert(false && "Detected overlapping blocks for drawing!");
+	// Work in the cells of the high-res level - the low-res node spans
+	// cells [lowMin, lowMin + 2) on each axis
+	unsigned lowMin[3];
+	GetKeyCell(lowResNode.Key, lowMin);
+	lowMin[0] *= 2;
+	lowMin[1] *= 2;
+	lowMin[2] *= 2;
+
+	// The Morton code bits of the cells [lowMin - 1, lowMin + 2] on each axis, so
+	// that every key is put together without spreading the coordinates again
+	unsigned spreadCells[3][4];
+	for(auto axis = 0u; axis < 3; ++axis) {
+		for(auto offset = 0u; offset < 4; ++offset) {
+			spreadCells[axis][offset] = SpreadBits(lowMin[axis] + offset - 1) << (2 - axis);
+		}
 	}
-#endif
+	const auto levelBits = highLevel << KEY_LEVEL_SHIFT;
 
-	XMVECTOR lowMin = XMLoadFloat3(&lowResNode->MinCorner);
-	XMVECTOR lowMax = XMLoadFloat3(&lowResNode->MaxCorner);
+	static const BlockPolygons::TransitionFaceId faces[3][2] = {
+		{ BlockPolygons::XPos, BlockPolygons::XNeg },
+		{ BlockPolygons::YPos, BlockPolygons::YNeg },
+		{ BlockPolygons::ZPos, BlockPolygons::ZNeg }
+	};
 
-	XMVECTOR highMin = XMLoadFloat3(&highResNode->MinCorner);
-	XMVECTOR highMax = XMLoadFloat3(&highResNode->MaxCorner);
+	auto faceMask = 0u;
+	for(auto axis = 0u; axis < 3; ++axis) {
+		const auto uAxis = (axis + 1) % 3;
+		const auto vAxis = (axis + 2) % 3;
+		for(auto side = 0u; side < 2; ++side) {
+			// the cell after the node on the positive side and the one before it on the negative
+			unsigned offset;
+			if(side == 0) {
+				if(lowMin[axis] + 2 >= highCellsPerAxis)
+					continue;
+				offset = 3;
+			} else {
+				if(lowMin[axis] == 0)
+					continue;
+				offset = 0;
+			}
 
-	// check if it's a direct neighbour
-	auto XPosPlane = XMPlaneFromPointNormal(lowMax, XMVectorSet(1, 0, 0, 1));
-	if(std::abs(XMVectorGetX(XMPlaneDotCoord(XPosPlane, highMin))) < std::numeric_limits<float>::epsilon()
-		&& floor(lowResNode->MaxCorner.y) > floor(highResNode->MinCorner.y)
-		&& floor(lowResNode->MaxCorner.z) > floor(highResNode->MinCorner.z)
-		&& floor(lowResNode->MinCorner.y) <= floor(highResNode->MinCorner.y)
-		&& floor(lowResNode->MinCorner.z) <= floor(highResNode->MinCorner.z)) {
-		output.TransitionFaces[BlockPolygons::XPos] = true;
-			return;
+			const auto face = faces[axis][side];
+			faceMask |= 1 << face;
+			for(auto u = 0u; u < 2; ++u)
+			for(auto v = 0u; v < 2; ++v)
+			{
+				neighbourKeys[face][u * 2 + v] = levelBits | spreadCells[axis][offset] | spreadCells[uAxis][u + 1] | spreadCells[vAxis][v + 1];
+			}
+		}
 	}
-	auto XNegPlane = XMPlaneFromPointNormal(lowMin, XMVectorSet(-1, 0, 0, 1));
-	if(std::abs(XMVectorGetX(XMPlaneDotCoord(XNegPlane, highMax))) < std::numeric_limits<float>::epsilon()
-		&& floor(lowResNode->MinCorner.y) < floor(highResNode->MaxCorner.y)
-		&& floor(lowResNode->MinCorner.z) < floor(highResNode->MaxCorner.z)
-		&& floor(lowResNode->MaxCorner.y) >= floor(highResNode->MaxCorner.y)
-		&& floor(lowResNode->MaxCorner.z) >= floor(highResNode->MaxCorner.z)) {
-		output.TransitionFaces[BlockPolygons::XNeg] = true;
+
+	return faceMask;
+}
+
+void VoxelLodOctree::MeasureChildClassification(const XMFLOAT4 frustumPlanes[6], ClassificationTimes& times) const
+{
+	// the visible children of each node with children in both tests
+	std::vector<unsigned char> simdVisible;
+	std::vector<unsigned char> scalarVisible;
+	simdVisible.reserve(m_Nodes.size());
+	scalarVisible.reserve(m_Nodes.size());
+	auto planeTests = 0u;
+
+	const FrustumPlanesSoA frustum(frustumPlanes);
+	unsigned nodeCell[3];
+	unsigned char childPlaneMasks[8];
+	const auto simdStart = std::chrono::high_resolution_clock::now();
+	std::for_each(m_Nodes.cbegin(), m_Nodes.cend(), [&](const Node& node) {
+		if(!node.ChildMask)
 			return;
-	}
+		GetKeyCell(node.Key, nodeCell);
+		auto rejectingPlane = NO_REJECTING_PLANE;
+		simdVisible.push_back((unsigned char)ClassifyChildren(frustum
+			, ChildBoxesSoA(nodeCell, m_CellExtents[GetKeyLevel(node.Key) - 1])
+			, node.ChildMask
+			, ALL_PLANES_MASK
+			, rejectingPlane
+			, childPlaneMasks
+			, planeTests));
+	});
+	times.SimdTime += GetMicrosecondsSince(simdStart);
 
-	auto YPosPlane = XMPlaneFromPointNormal(lowMax, XMVectorSet(0, 1, 0, 1));
-	if(std::abs(XMVectorGetX(XMPlaneDotCoord(YPosPlane, highMin))) < std::numeric_limits<float>::epsilon()
-		&& floor(lowResNode->MaxCorner.x) > floor(highResNode->MinCorner.x)
-		&& floor(lowResNode->MaxCorner.z) > floor(highResNode->MinCorner.z)
-		&& floor(lowResNode->MinCorner.x) <= floor(highResNode->MinCorner.x)
-		&& floor(lowResNode->MinCorner.z) <= floor(highResNode->MinCorner.z)) {
-		output.TransitionFaces[BlockPolygons::YPos] = true;
+	XMFLOAT3 childMin;
+	XMFLOAT3 childMax;
+	const auto scalarStart = std::chrono::high_resolution_clock::now();
+	std::for_each(m_Nodes.cbegin(), m_Nodes.cend(), [&](const Node& node) {
+		if(!node.ChildMask)
 			return;
+		auto visible = 0u;
+		for(unsigned childMask = node.ChildMask; childMask; childMask &= childMask - 1) {
+			const auto child = CountChildren((unsigned char)((childMask & (~childMask + 1)) - 1));
+			GetNodeBounds(GetChildKey(node.Key, child), childMin, childMax);
+			auto planeMask = ALL_PLANES_MASK;
+			if(ClassifyCube(frustumPlanes, childMin, childMax, planeMask, planeTests)) {
+				visible |= 1 << child;
+			}
+		}
+		scalarVisible.push_back((unsigned char)visible);
+	});
+	times.ScalarTime += GetMicrosecondsSince(scalarStart);
+
+	std::for_each(m_Nodes.cbegin(), m_Nodes.cend(), [&](const Node& node) {
+		times.ChildrenTested += CountChildren(node.ChildMask);
+	});
+	for(auto id = 0u; id < simdVisible.size(); ++id) {
+		times.Mismatches += (simdVisible[id] != scalarVisible[id]);
 	}
-	auto YNegPlane = XMPlaneFromPointNormal(lowMin, XMVectorSet(0, -1, 0, 1));
-	if(std::abs(XMVectorGetX(XMPlaneDotCoord(YNegPlane, highMax))) < std::numeric_limits<float>::epsilon()
-		&& floor(lowResNode->MinCorner.x) < floor(highResNode->MaxCorner.x)
-		&& floor(lowResNode->MinCorner.z) < floor(highResNode->MaxCorner.z)
-		&& floor(lowResNode->MaxCorner.x) >= floor(highResNode->MaxCorner.x)
-		&& floor(lowResNode->MaxCorner.z) >= floor(highResNode->MaxCorner.z)) {
-		output.TransitionFaces[BlockPolygons::YNeg] = true;
-			return;
+}
+
+unsigned VoxelLodOctree::ValidateTransitionFaces(const VisibleBlocksVec& output) const
+{
+	KeyIdsMap nodeOfBlock;
+	for(auto nodeId = 0u; nodeId < m_Nodes.size(); ++nodeId) {
+		if(m_Nodes[nodeId].Id != PolygonSurface::INVALID_ID) {
+			nodeOfBlock[m_Nodes[nodeId].Id] = nodeId;
+		}
 	}
 
-	auto ZPosPlane = XMPlaneFromPointNormal(lowMax, XMVectorSet(0, 0, 1, 1));
-	if(std::abs(XMVectorGetX(XMPlaneDotCoord(ZPosPlane, highMin))) < std::numeric_limits<float>::epsilon()
-		&& floor(lowResNode->MaxCorner.x) > floor(highResNode->MinCorner.x)
-		&& floor(lowResNode->MaxCorner.y) > floor(highResNode->MinCorner.y)
-		&& floor(lowResNode->MinCorner.x) <= floor(highResNode->MinCorner.x)
-		&& floor(lowResNode->MinCorner.y) <= floor(highResNode->MinCorner.y)) {
-		output.TransitionFaces[BlockPolygons::ZPos] = true;
-			return;
+	// the output blocks in each LOD level
+	std::vector<std::vector<unsigned>> levelBlocks(m_LodLevels);
+	for(auto block = 0u; block < output.size(); ++block) {
+		const auto node = nodeOfBlock.find(output[block].Id);
+		assert(node != nodeOfBlock.end() && "Culled block not in the octree!");
+		levelBlocks[GetKeyLevel(m_Nodes[node->second].Key)].push_back(node->second);
+	}
+
+	auto mismatchesCnt = 0u;
+	std::for_each(output.cbegin(), output.cend(), [&](const VisibleBlock& block) {
+		const auto& node = m_Nodes[nodeOfBlock[block.Id]];
+		const auto level = GetKeyLevel(node.Key);
+		VisibleBlock expected(block.Id);
+		if(level) {
+			std::for_each(levelBlocks[level - 1].cbegin(), levelBlocks[level - 1].cend(), [&](unsigned highNodeId) {
+				CheckForNeighbour(node, m_Nodes[highNodeId], expected);
+			});
+		}
+		if(!std::equal(expected.TransitionFaces, expected.TransitionFaces + BlockPolygons::Face_Count, block.TransitionFaces)) {
+			++mismatchesCnt;
+		}
+	});
+	return mismatchesCnt;
+}
+
+void VoxelLodOctree::CheckForNeighbour(const Node& lowResNode, const Node& highResNode, VisibleBlock& output) const
+{
+	assert(GetKeyLevel(lowResNode.Key) == GetKeyLevel(highResNode.Key) + 1);
+
+	// Work in the cells of the high-res level - the low-res node spans
+	// cells [lowMin, lowMin + 2) on each axis
+	unsigned lowMin[3];
+	GetKeyCell(lowResNode.Key, lowMin);
+	lowMin[0] *= 2;
+	lowMin[1] *= 2;
+	lowMin[2] *= 2;
+
+	unsigned high[3];
+	GetKeyCell(highResNode.Key, high);
+
+	bool isInside[3];
+	for(auto axis = 0u; axis < 3; ++axis) {
+		isInside[axis] = high[axis] >= lowMin[axis] && high[axis] < lowMin[axis] + 2;
 	}
+	// check that no two nodes overlap!
+	assert(!(isInside[0] && isInside[1] && isInside[2]) && "Detected overlapping blocks for drawing!");
 
-	auto ZNegPlane = XMPlaneFromPointNormal(lowMin, XMVectorSet(0, 0, -1, 1));
-	if(std::abs(XMVectorGetX(XMPlaneDotCoord(ZNegPlane, highMax))) < std::numeric_limits<float>::epsilon()
-		&& floor(lowResNode->MinCorner.x) < floor(highResNode->MaxCorner.x)
-		&& floor(lowResNode->MinCorner.y) < floor(highResNode->MaxCorner.y)
-		&& floor(lowResNode->MaxCorner.x) >= floor(highResNode->MaxCorner.x)
-		&& floor(lowResNode->MaxCorner.y) >= floor(highResNode->MaxCorner.y)) {
-		output.TransitionFaces[BlockPolygons::ZNeg] = true;
+	static const BlockPolygons::TransitionFaceId faces[3][2] = {
+		{ BlockPolygons::XPos, BlockPolygons::XNeg },
+		{ BlockPolygons::YPos, BlockPolygons::YNeg },
+		{ BlockPolygons::ZPos, BlockPolygons::ZNeg }
+	};
+
+	// it's a direct neighbour if it's right next to the low-res node on one axis
+	// and lies within it's face on the other two
+	for(auto axis = 0u; axis < 3; ++axis) {
+		if(!isInside[(axis + 1) % 3] || !isInside[(axis + 2) % 3])
+			continue;
+
+		if(high[axis] == lowMin[axis] + 2) {
+			output.TransitionFaces[faces[axis][0]] = true;
+			return;
+		}
+		if(high[axis] + 1 == lowMin[axis]) {
+			output.TransitionFaces[faces[axis][1]] = true;
 			return;
+		}
 	}
 }
  
-bool VoxelLodOctree::IsCubeVisible(const XMFLOAT4 frustumPlanes[6], const XMFLOAT3& cubeMin, const XMFLOAT3& cubeMax) {
+bool VoxelLodOctree::ClassifyCube(const XMFLOAT4 frustumPlanes[6], const XMFLOAT3& cubeMin, const XMFLOAT3& cubeMax, unsigned& planeMask, unsigned& planeTests, float* slack) {
 	XMFLOAT4 minExtreme;
+	XMFLOAT4 maxExtreme;
 
 	for(unsigned i = 0; i < 6; i++)
 	{
+		if (!(planeMask & (1 << i)))
+			continue;
+
+		++planeTests;
 		if (frustumPlanes[i].x <= 0)
 		{
 			minExtreme.x = cubeMin.x;
+			maxExtreme.x = cubeMax.x;
 		}
 		else
 		{
 			minExtreme.x = cubeMax.x;
+			maxExtreme.x = cubeMin.x;
 		}
 
 		if (frustumPlanes[i].y <= 0)
 		{
 			minExtreme.y = cubeMin.y;
+			maxExtreme.y = cubeMax.y;
 		}
 		else
 		{
 			minExtreme.y = cubeMax.y;
+			maxExtreme.y = cubeMin.y;
 		}
 
 		if (frustumPlanes[i].z <= 0)
 		{
 			minExtreme.z = cubeMin.z;
+			maxExtreme.z = cubeMax.z;
 		}
 		else
 		{
 			minExtreme.z = cubeMax.z;
+			maxExtreme.z = cubeMin.z;
+		}
+
+		const auto outerDistance = frustumPlanes[i].x * minExtreme.x + frustumPlanes[i].y * minExtreme.y + frustumPlanes[i].z * minExtreme.z + frustumPlanes[i].w;
+		const auto innerDistance = frustumPlanes[i].x * maxExtreme.x + frustumPlanes[i].y * maxExtreme.y + frustumPlanes[i].z * maxExtreme.z + frustumPlanes[i].w;
+		if (slack)
+		{
+			*slack = std::min(*slack, std::min(std::abs(outerDistance), std::abs(innerDistance)));
 		}
 
-		if ((frustumPlanes[i].x * minExtreme.x + frustumPlanes[i].y * minExtreme.y + frustumPlanes[i].z * minExtreme.z + frustumPlanes[i].w) < 0.f)
+		if (outerDistance < 0.f)
 		{
 			return false;
 		}
+
+		// completely inside this plane - the children don't need to test it
+		if (innerDistance >= 0.f)
+		{
+			planeMask &= ~(1 << i);
+		}
 	}
 
 	return true;
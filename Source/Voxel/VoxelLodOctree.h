@@ -6,10 +6,13 @@
 #pragma once
 
 #include "../../Voxels/include/Polygonizer.h"
+#include "LodPolicy.h"
 
 namespace Voxels
 {
 
+struct FrustumPlanesSoA;
+
 // Culls surface blocks and decides wich LOD levels to use based on
 // the position of the camera each frame
 class VoxelLodOctree
@@ -27,31 +30,642 @@ public:
 	};
 	typedef std::vector<VisibleBlock> VisibleBlocksVec;
 
+	// Max LOD levels that fit in the keys of the nodes
+	static const unsigned MAX_LOD_LEVELS = 10;
+
+	// Data collected during the last Cull. It's only increments and two reads of the clock per pass so
+	// it's always on. The multi-view Cull sums up all the views.
+	// NB: The coherent Cull counts nothing when it keeps it's last output as a whole - OutputReused tells that
+	struct CullStatistics
+	{
+		CullStatistics()
+			: NodesVisited(0)
+			, PlaneTests(0)
+			, FrustumRejectedNodes(0)
+			, TransitionFaces(0)
+			, BackFacingBlocks(0)
+			, SubPixelBlocks(0)
+			, BelowHorizonBlocks(0)
+			, SelectionTime(0)
+			, TransitionTime(0)
+			, OutputReused(false)
+		{
+			std::fill(SelectedBlocks, SelectedBlocks + MAX_LOD_LEVELS, 0);
+		}
+
+		unsigned GetSelectedBlocksCount() const
+		{
+			auto count = 0u;
+			for(auto level = 0u; level < MAX_LOD_LEVELS; ++level) {
+				count += SelectedBlocks[level];
+			}
+			return count;
+		}
+
+		// nodes whose LOD was decided or whose children were tested against the frustum
+		unsigned NodesVisited;
+		// box vs. frustum plane tests done
+		unsigned PlaneTests;
+		// nodes found outside of the frustum - their subtrees are skipped
+		unsigned FrustumRejectedNodes;
+		// blocks selected in each LOD level before any are dropped
+		unsigned SelectedBlocks[MAX_LOD_LEVELS];
+		// faces of the selected blocks that draw transitions
+		unsigned TransitionFaces;
+		// selected blocks dropped because all their triangles face away from the camera
+		unsigned BackFacingBlocks;
+		// selected blocks dropped because they cover too few pixels
+		unsigned SubPixelBlocks;
+		// selected blocks dropped because nearer terrain hides them
+		unsigned BelowHorizonBlocks;
+		// in microseconds - deciding on the LOD & the frustum and finding the transition faces
+		long long SelectionTime;
+		long long TransitionTime;
+		// the coherent Cull kept it's last output - only SelectionTime is counted then
+		bool OutputReused;
+	};
+
+	// A block hit by a ray query and the distance along the ray where it enters the block
+	struct RayHit
+	{
+		unsigned Id;
+		float Distance;
+	};
+	typedef std::vector<RayHit> RayHitsVec;
+
+	// Max views culled with a single traversal - more views are culled in batches of that many
+	static const unsigned MAX_BATCHED_VIEWS = 8;
+
+	// A view of the multi-view Cull - the frustum and the LOD reference point
+	// NB: Planes and camera position MUST be in un-transformed grid coordinates
+	struct CullView
+	{
+		DirectX::XMFLOAT4 FrustumPlanes[6];
+		DirectX::XMFLOAT3 CameraPosition;
+	};
+
+	// A region of the grid where the LOD differs from what the policy decides. Boxes use
+	// the corners and spheres the center & radius
+	// NB: Volumes MUST be in un-transformed grid coordinates
+	struct LodBiasVolume
+	{
+		enum Shape
+		{
+			Box,
+			Sphere
+		};
+
+		Shape VolumeShape;
+		DirectX::XMFLOAT3 MinCorner;
+		DirectX::XMFLOAT3 MaxCorner;
+		DirectX::XMFLOAT3 Center;
+		float Radius;
+		// the settle distance of the LOD policy is multiplied by that - above 1 keeps the detail further away.
+		// Drop detail with FinestLevel - scales below 1 can only go down to 8 / 9
+		float DistanceScale;
+		// the nodes of that LOD level are never split - 0 doesn't cap the detail
+		unsigned FinestLevel;
+	};
+	typedef std::vector<LodBiasVolume> LodBiasVolumesVec;
+
+private:
+	typedef std::vector<unsigned> NodeIndicesVec;
+
+	// A node waiting to be visited and the frustum planes it's not completely inside of
+	struct TraversalEntry
+	{
+		unsigned NodeId;
+		unsigned PlaneMask;
+	};
+
+	// A node waiting to be visited by the multi-view Cull - the views that still have to
+	// decide on it and for each of them the frustum planes it's not completely inside of
+	struct MultiViewEntry
+	{
+		unsigned NodeId;
+		unsigned char ViewMask;
+		unsigned char PlaneMasks[MAX_BATCHED_VIEWS];
+	};
+
+	// A node selected by the multi-view Cull and the views that draw it
+	struct MultiViewSelection
+	{
+		unsigned NodeId;
+		unsigned ViewMask;
+	};
+
+	// Open addressing hash set of node keys. The memory is kept between uses
+	class NodeKeySet
+	{
+	public:
+		void Reset(unsigned expectedCount);
+		void Insert(unsigned key);
+		bool Contains(unsigned key) const;
+		size_t GetReservedMemory() const { return m_Slots.capacity() * sizeof(unsigned); }
+
+	private:
+		static const unsigned EMPTY_SLOT = ~0u;
+
+		unsigned Hash(unsigned key) const { return (key * 2654435761u >> 7) & m_Mask; }
+
+		std::vector<unsigned> m_Slots;
+		unsigned m_Mask;
+	};
+
+	// Same as NodeKeySet but keeps a mask of views for each key
+	class NodeKeyViewsMap
+	{
+	public:
+		void Reset(unsigned expectedCount);
+		void Insert(unsigned key, unsigned viewMask);
+		unsigned GetViews(unsigned key) const;
+
+	private:
+		static const unsigned EMPTY_SLOT = ~0u;
+
+		unsigned Hash(unsigned key) const { return (key * 2654435761u >> 7) & m_Mask; }
+
+		std::vector<unsigned> m_Slots;
+		std::vector<unsigned> m_Views;
+		unsigned m_Mask;
+	};
+
+public:
+	// Working memory of Cull. Keep one alive between frames and Cull
+	// does no allocations once it has grown enough
+	class CullScratch
+	{
+	public:
+		// The memory held by the scratch - it only grows when Cull allocates
+		size_t GetReservedMemory() const;
+
+	private:
+		friend class VoxelLodOctree;
+
+		std::vector<TraversalEntry> UnvisitedNodes;
+		std::vector<NodeIndicesVec> NodesToDraw;
+		NodeKeySet SelectedKeys;
+		// the selected nodes in output order for the tracker and the back-face culling
+		NodeIndicesVec Selected;
+		NodeIndicesVec DrawnNodes;
+	};
+
+	// Working memory of the parallel Cull - the top of the octree is culled with
+	// the Top scratch and each subtree below the split depth with it's own
+	class ParallelCullScratch
+	{
+		friend class VoxelLodOctree;
+
+		CullScratch Top;
+		std::vector<TraversalEntry> Tasks;
+		std::vector<CullScratch> TaskScratches;
+		std::vector<CullStatistics> TaskStatistics;
+		NodeIndicesVec Selected;
+		NodeIndicesVec DrawnNodes;
+	};
+
+	// Working memory of the multi-view Cull. It also keeps the LOD hysteresis and the rejecting
+	// planes of each view, so the views should be passed in the same order every frame
+	class MultiViewCullScratch
+	{
+	public:
+		MultiViewCullScratch() : BuildId(0) {}
+
+	private:
+		friend class VoxelLodOctree;
+
+		struct ViewData
+		{
+			// per node - the frustum plane that rejected one of it's children in the last Cull
+			std::vector<unsigned char> RejectingPlanes;
+			// per node - if it was drawn the last time the view examined it
+			std::vector<unsigned char> SettledNodes;
+		};
+
+		unsigned BuildId;
+		std::vector<MultiViewEntry> UnvisitedNodes;
+		std::vector<MultiViewSelection> Selected;
+		NodeKeyViewsMap SelectedKeys;
+		std::vector<ViewData> Views;
+		// the selected nodes of a single view for it's tracker and the back-face culling
+		NodeIndicesVec ViewNodes;
+		NodeIndicesVec ViewDrawnNodes;
+	};
+
+	// Finds which blocks changed between the Culls it's passed to - for consumers that stream block
+	// data and need only the differences. The changes come from the selected nodes so no sorting or
+	// diffing of the outputs is needed. Keep one tracker alive per output
+	class VisibleSetTracker
+	{
+	public:
+		VisibleSetTracker() : BuildId(0), Frame(0) {}
+
+		// Indices in the output of the blocks that weren't visible the last time
+		const std::vector<unsigned>& GetEntered() const { return Entered; }
+		// Ids of the blocks that were visible the last time but aren't now
+		const std::vector<unsigned>& GetLeft() const { return Left; }
+		// Indices in the output of the blocks that were visible the last time with other transition faces
+		const std::vector<unsigned>& GetTransitionsChanged() const { return TransitionsChanged; }
+
+		// Forgets the visible blocks - all blocks enter with the next Cull
+		void Reset() { BuildId = 0; VisibleNodes.clear(); VisibleBlocks.clear(); }
+
+	private:
+		friend class VoxelLodOctree;
+
+		void ClearChanges() { Entered.clear(); Left.clear(); TransitionsChanged.clear(); }
+
+		unsigned BuildId;
+		unsigned Frame;
+		// per node - the last Frame it was visible in and it's transition faces then
+		NodeIndicesVec NodeFrames;
+		std::vector<unsigned char> NodeTransitions;
+		// the blocks visible the last time and their nodes
+		NodeIndicesVec VisibleNodes;
+		VisibleBlocksVec VisibleBlocks;
+
+		std::vector<unsigned> Entered;
+		std::vector<unsigned> Left;
+		std::vector<unsigned> TransitionsChanged;
+	};
+
+private:
+	// A node visited by the last coherent Cull. The records are in depth-first order so
+	// the subtree of a node and the nodes it selected are contiguous ranges.
+	// The slacks are how much the camera and the frustum planes can change before any
+	// decision taken in the subtree flips.
+	struct CoherentRecord
+	{
+		unsigned NodeId;
+		unsigned Parent;
+		unsigned PlaneMask;
+		unsigned SubtreeEnd;
+		unsigned SelectedBegin;
+		unsigned SelectedEnd;
+		float LodSlack;
+		float FrustumSlack;
+	};
+
+public:
+	// The state that a coherent Cull keeps between frames - the nodes visited
+	// and selected last time and the view they were selected for
+	class CoherentCullState
+	{
+	public:
+		CoherentCullState() : BuildId(0), Policy(nullptr), BackFaceCulling(false), ContributionDistanceCoeff(0), HorizonCulling(false), DropSlack(0) {}
+
+		// Forces the next coherent Cull to examine the whole octree
+		void Reset() { Records.clear(); }
+
+	private:
+		friend class VoxelLodOctree;
+
+		struct StackEntry
+		{
+			unsigned NodeId;
+			unsigned PlaneMask;
+			unsigned Parent;
+		};
+
+		unsigned BuildId;
+		const LodPolicy* Policy;
+		bool BackFaceCulling;
+		float ContributionDistanceCoeff;
+		bool HorizonCulling;
+		// how much the camera can move before a selected block might be dropped or kept differently
+		float DropSlack;
+		DirectX::XMFLOAT4 FrustumPlanes[6];
+		DirectX::XMFLOAT3 CameraPosition;
+
+		std::vector<CoherentRecord> Records;
+		std::vector<CoherentRecord> PreviousRecords;
+		NodeIndicesVec Selected;
+		NodeIndicesVec PreviousSelected;
+		NodeIndicesVec DrawnNodes;
+		// per node - it's index in Records if it was visited
+		NodeIndicesVec RecordOfNode;
+		std::vector<StackEntry> UnvisitedNodes;
+		NodeKeySet SelectedKeys;
+	};
+
+	// The state that a budgeted Cull keeps between frames - the LOD front refined so far. The front
+	// covers the whole octree and the nodes in it that share a face are at most one LOD level apart
+	class BudgetedCullState
+	{
+	public:
+		BudgetedCullState() : BuildId(0), Policy(nullptr), Frame(0), NextExamined(0) {}
+
+		// Forces the next budgeted Cull to start from the root
+		void Reset() { FrontNodes.clear(); }
+
+	private:
+		friend class VoxelLodOctree;
+
+		// A node of the front that the LOD policy wants split and the squared distance to it's center
+		struct SplitEntry
+		{
+			// ordered so that the nearest is on top of the heap
+			bool operator<(const SplitEntry& other) const { return DistanceSq > other.DistanceSq; }
+
+			unsigned NodeId;
+			float DistanceSq;
+		};
+
+		unsigned BuildId;
+		const LodPolicy* Policy;
+		unsigned Frame;
+		// the index in the front where the next Cull starts examining - where the last one ran out of time
+		unsigned NextExamined;
+
+		NodeIndicesVec FrontNodes;
+		// per node - if it's in the front and if it's visible (only kept for the front)
+		std::vector<unsigned char> InFront;
+		std::vector<unsigned char> Visible;
+		// per node - the last frame in which it couldn't be split
+		NodeIndicesVec BlockedFrames;
+		// per LOD level - the nodes whose children in the front might be merged into them
+		std::vector<NodeIndicesVec> MergeCandidates;
+		// a heap - the nearest node first
+		std::vector<SplitEntry> Splits;
+		NodeIndicesVec Selected;
+		NodeIndicesVec DrawnNodes;
+		NodeKeySet SelectedKeys;
+	};
+
 	VoxelLodOctree();
 	~VoxelLodOctree();
 
 	bool Build(const PolygonSurface& map);
+	// Patches the octree after the blocks in the modified box were recalculated - only the nodes
+	// around the box are examined. The map has to be the same grid that the octree was built
+	// from, otherwise the octree is built from scratch
+	bool Update(const PolygonSurface& map, const float3pair& modified);
+
+	// Writes the octree built from the map in a compact binary blob tagged with the key
+	void Save(const PolygonSurface& map, unsigned long long key, std::vector<char>& blob) const;
+	// Loads an octree saved with the same key for the same map. Returns false if the
+	// blob doesn't match - the octree has to be built then
+	bool Load(const PolygonSurface& map, unsigned long long key, const char* blob, size_t blobSize);
 
 	// Culls blocks and decides which LOD levels to use
 	// NB: Planes and camera position MUST be in un-transformed grid coordinates
 	VisibleBlocksVec Cull(const DirectX::XMFLOAT4 frustumPlanes[6], const DirectX::XMFLOAT3& cameraPosition);
+	// Same as above but writes in the output and reuses the memory of the scratch and output
+	// If a tracker is passed it gets the changes since the last Cull it was passed to - all the Culls below take one
+	void Cull(const DirectX::XMFLOAT4 frustumPlanes[6], const DirectX::XMFLOAT3& cameraPosition, CullScratch& scratch, VisibleBlocksVec& output, VisibleSetTracker* tracker = nullptr);
+	// Temporally coherent Cull - starts from the nodes selected the last time and re-examines only
+	// those whose LOD or visibility might have changed since. The output MUST be the same vector
+	// passed the last time with the state. Returns false and leaves the output untouched if the
+	// selection can't have changed - the tracker then gets no changes
+	bool Cull(const DirectX::XMFLOAT4 frustumPlanes[6], const DirectX::XMFLOAT3& cameraPosition, CoherentCullState& state, VisibleBlocksVec& output, VisibleSetTracker* tracker = nullptr);
+	// Same as Cull but the subtrees of the visible nodes at splitDepth (the root is at depth 0) are
+	// culled in parallel. The result is the same regardless of the number of threads
+	void CullParallel(const DirectX::XMFLOAT4 frustumPlanes[6], const DirectX::XMFLOAT3& cameraPosition, unsigned splitDepth, ParallelCullScratch& scratch, VisibleBlocksVec& output, VisibleSetTracker* tracker = nullptr);
+	// Culls several views with a single traversal for up to MAX_BATCHED_VIEWS views - the nodes
+	// are loaded and their children's boxes are computed once for all of them. Writes in outputs[i]
+	// the same blocks that a separate Cull of views[i] would. If trackers is not null it has one tracker per view
+	void Cull(const CullView* views, unsigned viewsCount, MultiViewCullScratch& scratch, VisibleBlocksVec* outputs, VisibleSetTracker* trackers = nullptr);
+	// Budgeted Cull - continues from the LOD front left by the last budgeted Cull with the state. The nodes
+	// that can be coarser are merged, the front is tested against the frustum and then the nodes that the LOD
+	// policy wants finer are split nearest first until budgetMicroseconds run out - all three passes stop then.
+	// The rest is refined in the next frames, so the time doesn't grow with the grid. Writing the output of
+	// the front isn't budgeted - it's proportional to the blocks drawn.
+	// Returns false if the front isn't what a full Cull would select - the time ran out or
+	// a split was blocked by a coarser neighbour without children
+	bool CullBudgeted(const DirectX::XMFLOAT4 frustumPlanes[6], const DirectX::XMFLOAT3& cameraPosition, unsigned budgetMicroseconds, BudgetedCullState& state, VisibleBlocksVec& output, VisibleSetTracker* tracker = nullptr);
+
+	// Range queries - write the ids of the blocks in the given LOD level that intersect the range.
+	// Subtrees outside of the range are skipped so the cost depends on the blocks found, not on all the blocks
+	// NB: The ranges MUST be in un-transformed grid coordinates
+	void QueryBox(const DirectX::XMFLOAT3& minCorner, const DirectX::XMFLOAT3& maxCorner, unsigned lodLevel, std::vector<unsigned>& blockIds) const;
+	void QuerySphere(const DirectX::XMFLOAT3& center, float radius, unsigned lodLevel, std::vector<unsigned>& blockIds) const;
+	// The blocks are sorted near to far by the distance at which the ray enters them. The direction
+	// doesn't have to be normalized - the distances are in multiples of it's length
+	void QueryRay(const DirectX::XMFLOAT3& origin, const DirectX::XMFLOAT3& direction, float maxDistance, unsigned lodLevel, RayHitsVec& hits) const;
+
+	// The policy isn't owned and must outlive the octree. nullptr sets the default DistanceLodPolicy.
+	// NB: The coherent Cull starts over when the policy changes
+	void SetLodPolicy(const LodPolicy* policy) { m_LodPolicy = policy ? policy : &m_DefaultLodPolicy; }
+	const LodPolicy* GetLodPolicy() const { return m_LodPolicy; }
+
+	// Biases the LOD in the volumes. Where volumes overlap or a node is partly outside of them the finer
+	// detail wins, so the volumes that drop detail only change the nodes completely inside of them.
+	// The bias of each node is found here and after every Build, Update and Load - only the subtrees that
+	// the volumes intersect are visited and the Culls just read it.
+	// To keep the neighbours on the border of a volume within one LOD level a node is biased as if it
+	// were grown by it's extent on all sides - the added detail reaches a bit outside of the volume and
+	// the dropped one stops a bit inside of it. Distance scales below 8 / 9 are raised to that.
+	// NB: The coherent Cull starts over when the volumes change
+	void SetLodBiasVolumes(const LodBiasVolumesVec& volumes);
+	const LodBiasVolumesVec& GetLodBiasVolumes() const { return m_LodBiasVolumes; }
+
+	// When enabled the Culls drop the blocks whose triangles all face away from the camera. The LOD
+	// and the transition faces are decided before that, so the neighbours of a dropped block still
+	// match it. Blocks that draw transitions are never dropped - their borders move in the shader
+	void SetBackFaceCulling(bool enabled) { m_BackFaceCulling = enabled; }
+	bool GetBackFaceCulling() const { return m_BackFaceCulling; }
+
+	// When minPixelArea > 0 the Culls drop the blocks that cover fewer pixels on the screen. It's dropped
+	// after the transition faces are decided, so the neighbours still draw the transitions towards it and
+	// the only gap is the block itself. The area is estimated with the bounding sphere of the block.
+	// projectionScale is the vertical scale of the projection matrix - cot(fovY / 2)
+	void SetContributionCulling(float projectionScale, float viewportHeight, float minPixelArea);
+	float GetContributionCullingArea() const { return m_MinPixelArea; }
+
+	// When enabled the Culls drop the blocks hidden behind nearer terrain. Only for 2.5D terrains like the
+	// grids made from heightmaps - the grid is taken to be solid under the lowest block of each column.
+	// The lowest solid height of the columns is kept in a pyramid that is updated with the octree
+	void SetHorizonCulling(bool enabled) { m_HorizonCulling = enabled; }
+	bool GetHorizonCulling() const { return m_HorizonCulling; }
 
 	unsigned GetLodLevelsCount() const { return m_LodLevels; }
 	unsigned GetNonEmptyNodesCount() const { return m_NonEmptyNodes; }
 
+	const CullStatistics& GetLastCullStatistics() const { return m_LastCullStatistics; }
+
+	// The frustum tests of the children of all the nodes - 8 at once with SIMD and one by one
+	struct ClassificationTimes
+	{
+		ClassificationTimes()
+			: ChildrenTested(0)
+			, Mismatches(0)
+			, SimdTime(0)
+			, ScalarTime(0)
+		{}
+
+		unsigned ChildrenTested;
+		// nodes whose children the two tests found visible differently
+		unsigned Mismatches;
+		// in microseconds
+		long long SimdTime;
+		long long ScalarTime;
+	};
+	// Tests the children of every node with both tests against the frustum and adds up the times
+	// NB: For benchmarks only. Planes MUST be in un-transformed grid coordinates
+	void MeasureChildClassification(const DirectX::XMFLOAT4 frustumPlanes[6], ClassificationTimes& times) const;
+
+	// Checks the transition faces in the output of a Cull against a brute-force comparison of all the pairs
+	// of blocks in neighbouring LOD levels. Returns how many blocks have wrong faces.
+	// NB: Slow - for tests only. The Cull MUST not drop blocks (no back-face, contribution or horizon culling)
+	unsigned ValidateTransitionFaces(const VisibleBlocksVec& output) const;
+
 private:
-	struct Node;
-	typedef std::unique_ptr<Node> NodePtr;
-	typedef std::vector<NodePtr*> NodePtrVec;
+	// Nodes are stored in a single array in breadth-first order. The children
+	// of a node are contiguous - one for each bit set in ChildMask, starting at FirstChild.
+	// Every node is an aligned cube of the grid so it's bounds are not stored but
+	// computed from the Key that packs the LOD level and the Morton code of the cell
+	struct Node
+	{
+		unsigned Id;
+		unsigned FirstChild;
+		unsigned Key;
+		unsigned char ChildMask;
+	};
+	typedef std::vector<Node> NodesVec;
+
+	// The bias of the LOD volumes that intersect a node
+	struct NodeLodBias
+	{
+		float DistanceScale;
+		unsigned FinestLevel;
+	};
+
+	// The normals of all the triangles of a block are within the angle of the axis.
+	// A block with no triangles or a cone of 90 degrees or wider never faces away
+	struct NormalCone
+	{
+		DirectX::XMFLOAT3 Axis;
+		float CosAngle;
+		float SinAngle;
+	};
+
+	typedef std::unordered_map<unsigned, unsigned> KeyIdsMap;
+
+	// Clears the octree and sets up the LOD levels of the map
+	bool InitializeLevels(const PolygonSurface& map);
+
+	// Lays out the nodes again after the blocks in addedBlocks got new nodes and
+	// some nodes lost their blocks. The other nodes keep their data
+	void PatchLayout(const KeyIdsMap& addedBlocks);
+	void GetNodeBounds(unsigned key, DirectX::XMFLOAT3& minCorner, DirectX::XMFLOAT3& maxCorner) const;
+	// The key of the node of a block in the LOD level
+	unsigned GetBlockKey(unsigned lodLevel, const BlockPolygons& block) const;
+	// The index of the node with the key or INVALID_ID if it's not in the octree
+	unsigned FindNode(unsigned key) const;
+	static NormalCone ComputeNormalCone(const BlockPolygons& block);
+	// True if all the triangles of the node's block face away from the eye. If slack
+	// is not null it's lowered to how much the eye can move before that might change
+	bool IsBackFacing(unsigned nodeId, const DirectX::XMFLOAT3& eye, float* slack) const;
+	// True if the node's block covers fewer pixels than the contribution culling allows. The slack is as in IsBackFacing
+	bool IsSubPixel(unsigned nodeId, const DirectX::XMFLOAT3& eye, float* slack) const;
+	// Fills the pyramid of the solid heights from the finest nodes
+	void BuildSolidHeights();
+	// The lowest solid height of the columns under the rectangle. Nothing is solid outside of the grid
+	float GetSolidHeight(float minX, float minZ, float maxX, float maxZ) const;
+	// True if terrain nearer to the eye hides the node's block
+	bool IsBelowHorizon(unsigned nodeId, const DirectX::XMFLOAT3& eye) const;
+	bool DropsBlocks() const { return m_BackFaceCulling || m_ContributionDistanceCoeff > 0 || m_HorizonCulling; }
+	// Finds the LOD bias of every node from the volumes
+	void BuildNodeBiases();
+	// Finds the bias of the node from the volumes that intersect it's parent and goes on
+	// with the children of the node if any of them intersect it
+	void BiasNodes(unsigned nodeId, const NodeIndicesVec& volumes);
+	// The center and the extent of a node as the LOD policy sees it
+	void GetNodeCenter(unsigned key, DirectX::XMFLOAT3& center, float& extent) const;
+	// The margin of the LOD policy for the node with the bias of the LOD volumes applied
+	float GetBiasedSettleMargin(unsigned nodeId, const DirectX::XMFLOAT3& cameraPosition, bool wasSettled) const;
+	// True if the LOD policy allows the node to be drawn instead of it's children. If slack is not
+	// null it's lowered to the policy's margin. Remembers the decision for the hysteresis
+	bool CanSettle(unsigned nodeId, const DirectX::XMFLOAT3& cameraPosition, float* slack = nullptr);
+	bool IsNodeVisible(const DirectX::XMFLOAT4 frustumPlanes[6], unsigned nodeId);
+	// Nodes without blocks are never in the front of the budgeted Cull - their children are added instead
+	void AddToFront(unsigned nodeId, BudgetedCullState& state) const;
+	void RemoveFromFront(unsigned nodeId, BudgetedCullState& state) const;
+	// Decides if a front node is visible and if it has to be split
+	void ExamineFrontNode(unsigned nodeId, const DirectX::XMFLOAT4 frustumPlanes[6], const DirectX::XMFLOAT3& cameraPosition, BudgetedCullState& state);
+	// True if the children of the node are in the front
+	bool IsFrontUnder(unsigned nodeId, const BudgetedCullState& state) const;
+	// A front node one level coarser than the node right next to one of it's faces or INVALID_ID.
+	// The node can't be split before it
+	unsigned FindCoarserNeighbour(unsigned nodeId, const BudgetedCullState& state) const;
+	// True if front nodes two levels finer than the node touch one of it's faces - the node can't be merged then
+	bool HasFinerNeighbours(unsigned nodeId, const BudgetedCullState& state) const;
+	// Visits breadth-first the nodes in unvisitedNodes and all their visible children and adds the
+	// ones to draw to nodesToDraw. The nodes in splitLevel are added to splitNodes instead if it's not null.
+	// Counts the nodes visited & rejected and the plane tests in statistics
+	void TraverseNodes(const FrustumPlanesSoA& frustum
+		, const DirectX::XMFLOAT3& cameraPosition
+		, std::vector<TraversalEntry>& unvisitedNodes
+		, std::vector<NodeIndicesVec>& nodesToDraw
+		, unsigned splitLevel
+		, std::vector<TraversalEntry>* splitNodes
+		, CullStatistics& statistics);
+	// Culls up to MAX_BATCHED_VIEWS views with a single breadth-first traversal
+	void CullViewBatch(const CullView* views
+		, unsigned viewsCount
+		, MultiViewCullScratch::ViewData* viewData
+		, std::vector<MultiViewEntry>& unvisitedNodes
+		, std::vector<MultiViewSelection>& selected
+		, NodeKeyViewsMap& selectedKeys
+		, VisibleBlocksVec* outputs);
+	// Visits depth-first the nodes whose bounds pass the test down to the LOD level and writes their block ids
+	template<typename BoundsTest>
+	void QueryNodes(unsigned lodLevel, const BoundsTest& intersects, std::vector<unsigned>& blockIds) const;
+	void ResetNodesToDraw(std::vector<NodeIndicesVec>& nodesToDraw) const;
+	void WriteVisibleBlocks(const NodeIndicesVec& selectedNodes, NodeKeySet& selectedKeys, VisibleBlocksVec& output, bool inParallel = false) const;
+	// Counts the selected blocks of each LOD level and their transition faces
+	void CountSelection(const NodeIndicesVec& selectedNodes, const VisibleBlocksVec& output);
+	// Drops the back-facing, the sub-pixel and the hidden blocks if that's enabled and tracks the output. selectedNodes has
+	// the node of each output block and drawnNodes gets the nodes of the blocks kept. The slack is as in IsBackFacing
+	void FinishOutput(const DirectX::XMFLOAT3& eye
+		, const NodeIndicesVec& selectedNodes
+		, NodeIndicesVec& drawnNodes
+		, VisibleBlocksVec& output
+		, VisibleSetTracker* tracker
+		, float* slack = nullptr);
+	// Finds the changes since the last output of the tracker. The output has the blocks of the selected nodes in the same order
+	void TrackVisibleBlocks(const NodeIndicesVec& selectedNodes, const VisibleBlocksVec& output, VisibleSetTracker& tracker) const;
+	void FindTransitionFaces(const Node& lowResNode, const NodeKeySet& selectedKeys, VisibleBlock& output) const;
+	// Same as above with the keys from GetFaceNeighbourKeys
+	static void FindTransitionFaces(const unsigned neighbourKeys[BlockPolygons::Face_Count][4], unsigned faceMask, const NodeKeySet& selectedKeys, VisibleBlock& output);
+	// Writes the keys of the 4 high-res cells right next to each face of the node. Returns a
+	// bit for each face that isn't on the border of the grid
+	unsigned GetFaceNeighbourKeys(const Node& lowResNode, unsigned neighbourKeys[BlockPolygons::Face_Count][4]) const;
+	void CheckForNeighbour(const Node& lowResNode, const Node& highResNode, VisibleBlock& output) const;
+	// Tests the cube against the frustum planes in the mask and clears the ones it's completely inside of
+	// If slack is not null it's lowered to the smallest distance between the cube and a tested plane
+	static bool ClassifyCube(const DirectX::XMFLOAT4 frustumPlanes[6], const DirectX::XMFLOAT3& cubeMin, const DirectX::XMFLOAT3& cubeMax, unsigned& planeMask, unsigned& planeTests, float* slack = nullptr);
+
+	NodesVec m_Nodes;
+	// the extents of the nodes in each LOD level
+	std::vector<DirectX::XMFLOAT3> m_CellExtents;
+	// per node - the frustum plane that rejected one of it's children in the last Cull
+	std::vector<unsigned char> m_RejectingPlanes;
+	// per node - if it was drawn the last time the LOD policy examined it
+	std::vector<unsigned char> m_SettledNodes;
+	// per node - the normal cone of it's block
+	std::vector<NormalCone> m_NormalCones;
+	bool m_BackFaceCulling;
+	float m_MinPixelArea;
+	// Blocks further than that many times their radius cover fewer pixels than m_MinPixelArea. 0 if disabled
+	float m_ContributionDistanceCoeff;
+	bool m_HorizonCulling;
+	// Per level of the pyramid - the lowest solid height of each column of cells, row by row along X.
+	// The first level has the columns of the finest nodes. -FLT_MAX if nothing is known to be solid
+	std::vector<std::vector<float>> m_SolidHeights;
+	// the highest solid height of all the columns
+	float m_MaxSolidHeight;
 
-	bool PruneNode(NodePtr& node);
-	void CheckForNeighbour(const NodePtr& lowResNode, const NodePtr& highResNode, VisibleBlock& output);
-	static bool IsCubeVisible(const DirectX::XMFLOAT4 frustumPlanes[6], const DirectX::XMFLOAT3& cubeMin, const DirectX::XMFLOAT3& cubeMax);
+	LodBiasVolumesVec m_LodBiasVolumes;
+	// per node - the bias of the volumes. Empty if there are no volumes
+	std::vector<NodeLodBias> m_NodeBiases;
 
-	NodePtr m_Root;
+	DistanceLodPolicy m_DefaultLodPolicy;
+	const LodPolicy* m_LodPolicy;
 
-	typedef std::deque<NodePtr*> qcontainer;
-	typedef std::queue<NodePtr*, qcontainer> NodesQueue;
+	CullStatistics m_LastCullStatistics;
+	// changes on every Build so that coherent states of older octrees are discarded - unique in the process
+	unsigned m_BuildId;
 
 	// statistical data
 	unsigned m_LodLevels;
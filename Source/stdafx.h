@@ -21,6 +21,7 @@
 #include <D3DX11tex.h>
 
 #include <queue>
+#include <ppl.h>
 
 #ifdef PROFI_ENABLE
 #include <profi_decls.h>